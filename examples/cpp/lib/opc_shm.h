@@ -0,0 +1,216 @@
+/*
+ * Shared-memory frame producer for a Fadecandy server on the same machine
+ *
+ * Copyright (c) 2014 Micah Elizabeth Scott <micah@scanlime.org>
+ *
+ * Permission is hereby granted, free of charge, to any person
+ * obtaining a copy of this software and associated documentation
+ * files (the "Software"), to deal in the Software without
+ * restriction, including without limitation the rights to use,
+ * copy, modify, merge, publish, distribute, sublicense, and/or sell
+ * copies of the Software, and to permit persons to whom the
+ * Software is furnished to do so, subject to the following
+ * conditions:
+ *
+ * The above copyright notice and this permission notice shall be
+ * included in all copies or substantial portions of the Software.
+ *
+ * THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND,
+ * EXPRESS OR IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES
+ * OF MERCHANTABILITY, FITNESS FOR A PARTICULAR PURPOSE AND
+ * NONINFRINGEMENT. IN NO EVENT SHALL THE AUTHORS OR COPYRIGHT
+ * HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER LIABILITY,
+ * WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING
+ * FROM, OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR
+ * OTHER DEALINGS IN THE SOFTWARE.
+ */
+
+#pragma once
+
+#include <atomic>
+#include <stdint.h>
+#include <stdio.h>
+#include <string.h>
+#include <unistd.h>
+#include <fcntl.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <sys/syscall.h>
+#include <linux/futex.h>
+
+
+/*
+ * Sends frames to an fcserver running on the same Linux machine, through the shared
+ * memory segment it creates when its configuration has an "shm" key. Each canvas
+ * carries one OPC message at a time, usually a Set Pixel Colors message for one
+ * channel. Write a frame in place, then publish it:
+ *
+ *     OPCShmProducer shm;
+ *     if (shm.attach("/fcserver")) {
+ *         uint8_t *rgb = shm.begin(0, 0, numPixels * 3);
+ *         ... fill in rgb ...
+ *         shm.publish(0);
+ *     }
+ *
+ * Publishing never blocks. If the server hasn't taken the last frame yet, the new one
+ * replaces it. Only one producer may use each canvas at a time.
+ *
+ * The segment layout must match ShmInput in the server.
+ */
+
+class OPCShmProducer {
+public:
+    OPCShmProducer();
+    ~OPCShmProducer();
+
+    // Map the segment the server created. False if it isn't there, or doesn't look right.
+    bool attach(const char *name = "/fcserver");
+    void detach();
+    bool isAttached();
+
+    unsigned numCanvases();
+
+    // Start a message on a canvas, and return its data to fill in. Valid until publish().
+    uint8_t *begin(unsigned canvas, uint8_t channel, uint16_t length, uint8_t command = SET_PIXEL_COLORS);
+
+    // Hand the message to the server
+    void publish(unsigned canvas);
+
+    static const uint8_t SET_PIXEL_COLORS = 0;
+
+private:
+    static const uint32_t MAGIC = 0x48534346;      // "FCSH"
+    static const uint32_t VERSION = 1;
+    static const uint32_t SLOTS = 3;
+    static const uint32_t FRESH = 0x80000000;
+
+    struct Header {
+        uint32_t magic;
+        uint32_t version;
+        uint32_t canvases;
+        uint32_t slotSize;
+        std::atomic<uint32_t> doorbell;
+        std::atomic<uint32_t> sleeping;
+        uint32_t reserved[10];
+    };
+
+    struct Canvas {
+        std::atomic<uint32_t> ready;
+        std::atomic<uint32_t> back;
+        std::atomic<uint32_t> published;
+        uint32_t reserved[13];
+    };
+
+    uint8_t *segment;
+    size_t segmentSize;
+
+    Header *header() { return (Header*) segment; }
+    Canvas *canvases() { return (Canvas*) (header() + 1); }
+    uint8_t *slot(unsigned canvas, unsigned index);
+};
+
+
+/*****************************************************************************************
+ *                                   Implementation
+ *****************************************************************************************/
+
+
+inline OPCShmProducer::OPCShmProducer()
+{
+    segment = 0;
+    segmentSize = 0;
+}
+
+inline OPCShmProducer::~OPCShmProducer()
+{
+    detach();
+}
+
+inline bool OPCShmProducer::attach(const char *name)
+{
+    detach();
+
+    int fd = shm_open(name, O_RDWR, 0);
+    if (fd < 0) {
+        return false;
+    }
+
+    struct stat st;
+    if (fstat(fd, &st) < 0 || size_t(st.st_size) < sizeof(Header)) {
+        close(fd);
+        return false;
+    }
+
+    void *addr = mmap(0, st.st_size, PROT_READ | PROT_WRITE, MAP_SHARED, fd, 0);
+    close(fd);
+    if (addr == MAP_FAILED) {
+        return false;
+    }
+
+    segment = (uint8_t*) addr;
+    segmentSize = st.st_size;
+
+    Header *h = header();
+    if (h->magic != MAGIC || h->version != VERSION ||
+        sizeof(Header) + h->canvases * (sizeof(Canvas) + SLOTS * size_t(h->slotSize)) > segmentSize) {
+        detach();
+        return false;
+    }
+
+    std::atomic_thread_fence(std::memory_order_acquire);
+    return true;
+}
+
+inline void OPCShmProducer::detach()
+{
+    if (segment) {
+        munmap(segment, segmentSize);
+        segment = 0;
+        segmentSize = 0;
+    }
+}
+
+inline bool OPCShmProducer::isAttached()
+{
+    return segment != 0;
+}
+
+inline unsigned OPCShmProducer::numCanvases()
+{
+    return isAttached() ? header()->canvases : 0;
+}
+
+inline uint8_t *OPCShmProducer::slot(unsigned canvas, unsigned index)
+{
+    uint8_t *slots = (uint8_t*) (canvases() + header()->canvases);
+    return slots + (canvas * SLOTS + index) * size_t(header()->slotSize);
+}
+
+inline uint8_t *OPCShmProducer::begin(unsigned canvas, uint8_t channel, uint16_t length, uint8_t command)
+{
+    // Our slot is the one nobody else is looking at
+    uint8_t *msg = slot(canvas, canvases()[canvas].back.load(std::memory_order_relaxed) % SLOTS);
+    msg[0] = channel;
+    msg[1] = command;
+    msg[2] = length >> 8;
+    msg[3] = (uint8_t) length;
+    return msg + 4;
+}
+
+inline void OPCShmProducer::publish(unsigned canvas)
+{
+    Canvas &c = canvases()[canvas];
+    Header *h = header();
+
+    // Swap our slot with the ready one. Whatever was there becomes our next slot.
+    uint32_t mine = c.back.load(std::memory_order_relaxed) % SLOTS;
+    uint32_t old = c.ready.exchange(mine | FRESH, std::memory_order_acq_rel);
+    c.back.store(old & ~FRESH, std::memory_order_relaxed);
+    c.published.fetch_add(1, std::memory_order_relaxed);
+
+    // Ring the doorbell. Only a sleeping server needs a system call to wake it.
+    h->doorbell.fetch_add(1);
+    if (h->sleeping.load()) {
+        syscall(SYS_futex, &h->doorbell, FUTEX_WAKE, 1, NULL, NULL, 0);
+    }
+}
@@ -48,5 +48,5 @@
 
 #define VENDOR_ID               0x1d50    // OpenMoko
 #define PRODUCT_ID              0x607a    // Assigned to Fadecandy project
-#define DEVICE_VER              0x0108	  // BCD device version
-#define DEVICE_VER_STRING	"1.09"
+#define DEVICE_VER              0x0110	  // BCD device version
+#define DEVICE_VER_STRING	"1.10"
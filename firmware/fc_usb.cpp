@@ -23,6 +23,7 @@
 
 #include "fc_usb.h"
 #include <algorithm>
+#include <string.h>
 
 // USB protocol definitions
 
@@ -83,6 +84,7 @@ bool fcBuffers::handleUSB(usb_packet_t *packet)
             }
 
             fbNew->store(index, packet);
+            fbNewMask |= 1 << index;
             if (final) {
                 pendingFinalizeFrame = true;
             }
@@ -116,6 +118,19 @@ bool fcBuffers::handleUSB(usb_packet_t *packet)
 
 void fcBuffers::finalizeFramebuffer()
 {
+    /*
+     * The host may only send the packets that changed since the last frame. fbNew is a
+     * recycled buffer two frames old, so copy every packet that didn't arrive forward
+     * from fbNext. When the host sends whole frames, this does nothing.
+     */
+
+    for (unsigned i = 0; i < PACKETS_PER_FRAME; ++i) {
+        if (!(fbNewMask & (1 << i))) {
+            memcpy(fbNew->packets[i]->buf, fbNext->packets[i]->buf, sizeof fbNew->packets[i]->buf);
+        }
+    }
+    fbNewMask = 0;
+
     fcFramebuffer *recycle = fbPrev;
     fbNew->timestamp = millis();
     fbPrev = fbNext;
@@ -122,6 +122,7 @@ struct fcBuffers
     fcFramebuffer *fbPrev;      // Frame we're interpolating from
     fcFramebuffer *fbNext;      // Frame we're interpolating to
     fcFramebuffer *fbNew;       // Partial frame, getting ready to become fbNext
+    uint32_t fbNewMask;         // Which of fbNew's packets have arrived since the last frame
 
     fcFramebuffer fb[3];        // Triple-buffered video frames
 
@@ -135,6 +136,7 @@ struct fcBuffers
         fbPrev = &fb[0];
         fbNext = &fb[1];
         fbNew = &fb[2];
+        fbNewMask = 0;
     }
 
     // Interrupt context
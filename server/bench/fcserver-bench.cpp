@@ -0,0 +1,489 @@
+/*
+ * Load generator and latency benchmark for fcserver
+ *
+ * Copyright (c) 2013 Micah Elizabeth Scott
+ *
+ * Permission is hereby granted, free of charge, to any person obtaining a copy of
+ * this software and associated documentation files (the "Software"), to deal in
+ * the Software without restriction, including without limitation the rights to
+ * use, copy, modify, merge, publish, distribute, sublicense, and/or sell copies of
+ * the Software, and to permit persons to whom the Software is furnished to do so,
+ * subject to the following conditions:
+ *
+ * The above copyright notice and this permission notice shall be included in all
+ * copies or substantial portions of the Software.
+ *
+ * THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+ * IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY, FITNESS
+ * FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL THE AUTHORS OR
+ * COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER LIABILITY, WHETHER
+ * IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING FROM, OUT OF OR IN
+ * CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN THE SOFTWARE.
+ */
+
+/*
+ * Opens one or more OPC connections to a running fcserver and streams frames
+ * at a fixed rate or as fast as the server accepts them. Every frame carries a
+ * sequence stamp in the first four bytes of each 512-pixel block, so whichever
+ * block a device is mapped to, its decoded frame says which message it came from.
+ *
+ * The server should be built with the mock USB backend and started with
+ * FCSERVER_MOCK_REPORT pointing at our report port. Each completion report is
+ * matched with the time its frame was written, giving end-to-end latency from
+ * socket write to USB transfer completion. Frames that never complete on a
+ * device were superseded somewhere along the way, and are counted as drops.
+ */
+
+#include "opc.h"
+#include "mockusb.h"
+#include "tinythread.h"
+#include <stdint.h>
+#include <stdlib.h>
+#include <stdio.h>
+#include <string.h>
+#include <errno.h>
+#include <time.h>
+#include <unistd.h>
+#include <getopt.h>
+#include <netdb.h>
+#include <netinet/in.h>
+#include <netinet/tcp.h>
+#include <sys/socket.h>
+#include <sys/time.h>
+#include <algorithm>
+#include <atomic>
+#include <set>
+#include <string>
+#include <vector>
+
+static const unsigned kPixelsPerDevice = 512;
+static const unsigned kHistorySize = 1 << 16;   // Frames remembered per connection
+static const unsigned kCounterBits = 24;        // Stamp is connection:8, counter:24
+static const uint32_t kCounterMask = (1 << kCounterBits) - 1;
+
+struct Options
+{
+    const char *host;
+    const char *port;
+    unsigned connections;
+    double rate;
+    double duration;
+    unsigned pixels;
+    unsigned reportPort;
+    unsigned devices;
+    bool channelPerConnection;
+    const char *replayFile;
+};
+
+// A frame we've sent, waiting for completion reports
+struct SentFrame
+{
+    uint32_t counter;
+    uint64_t timestamp;
+};
+
+struct Connection
+{
+    unsigned id;
+    int fd;
+    tthread::thread *thread;
+    uint64_t framesSent;
+    uint64_t bytesSent;
+    std::vector<SentFrame> history;
+};
+
+static Options gOptions;
+static std::vector<Connection*> gConnections;
+static std::vector<std::vector<uint8_t> > gReplay;
+static std::atomic<bool> gStop(false);
+
+// Shared between senders and the report thread
+static tthread::mutex gMutex;
+static std::vector<uint32_t> gLatencies;
+static std::set<uint32_t> gDevicesSeen;
+static uint64_t gUnmatched;
+
+static uint64_t now()
+{
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return uint64_t(ts.tv_sec) * 1000000 + ts.tv_nsec / 1000;
+}
+
+static void sleepMicroseconds(uint64_t us)
+{
+    struct timespec ts;
+    ts.tv_sec = us / 1000000;
+    ts.tv_nsec = (us % 1000000) * 1000;
+    while (nanosleep(&ts, &ts) < 0 && errno == EINTR);
+}
+
+static void usage(const char *argv0)
+{
+    fprintf(stderr,
+        "usage: %s [options]\n"
+        "\n"
+        "  -h HOST     fcserver host (default 127.0.0.1)\n"
+        "  -p PORT     fcserver OPC port (default 7890)\n"
+        "  -c COUNT    number of OPC connections (default 1)\n"
+        "  -r FPS      frames per second per connection, 0 for flat-out (default 0)\n"
+        "  -t SECONDS  test duration (default 10)\n"
+        "  -n PIXELS   pixels per synthetic frame (default 512)\n"
+        "  -f FILE     replay OPC messages captured in FILE instead of synthetic frames\n"
+        "  -u PORT     UDP port for mock USB completion reports (default 7891)\n"
+        "  -d COUNT    number of devices each frame should reach (default: all that report)\n"
+        "  -s          send each connection's frames on its own channel, starting at 1\n",
+        argv0);
+}
+
+static bool parseOptions(int argc, char **argv)
+{
+    gOptions.host = "127.0.0.1";
+    gOptions.port = "7890";
+    gOptions.connections = 1;
+    gOptions.rate = 0;
+    gOptions.duration = 10;
+    gOptions.pixels = kPixelsPerDevice;
+    gOptions.reportPort = 7891;
+    gOptions.devices = 0;
+    gOptions.channelPerConnection = false;
+    gOptions.replayFile = 0;
+
+    int c;
+    while ((c = getopt(argc, argv, "h:p:c:r:t:n:f:u:d:s")) != -1) {
+        switch (c) {
+            case 'h': gOptions.host = optarg; break;
+            case 'p': gOptions.port = optarg; break;
+            case 'c': gOptions.connections = atoi(optarg); break;
+            case 'r': gOptions.rate = atof(optarg); break;
+            case 't': gOptions.duration = atof(optarg); break;
+            case 'n': gOptions.pixels = atoi(optarg); break;
+            case 'f': gOptions.replayFile = optarg; break;
+            case 'u': gOptions.reportPort = atoi(optarg); break;
+            case 'd': gOptions.devices = atoi(optarg); break;
+            case 's': gOptions.channelPerConnection = true; break;
+            default: return false;
+        }
+    }
+
+    if (gOptions.connections < 1 || gOptions.connections > 255) {
+        fprintf(stderr, "Connection count must be between 1 and 255\n");
+        return false;
+    }
+    if (gOptions.pixels < 1 || gOptions.pixels * 3 > 0xFFFF) {
+        fprintf(stderr, "Pixel count must be between 1 and %d\n", 0xFFFF / 3);
+        return false;
+    }
+    return optind == argc;
+}
+
+static bool loadReplay(const char *path)
+{
+    // A raw OPC stream, for example captured with netcat
+    FILE *f = fopen(path, "rb");
+    if (!f) {
+        perror(path);
+        return false;
+    }
+
+    uint8_t header[OPC::HEADER_BYTES];
+    while (fread(header, sizeof header, 1, f) == 1) {
+        unsigned length = (unsigned(header[2]) << 8) | header[3];
+        std::vector<uint8_t> msg(header, header + sizeof header);
+        msg.resize(sizeof header + length);
+        if (length && fread(&msg[sizeof header], length, 1, f) != 1) {
+            break;
+        }
+        if (header[1] == OPC::SetPixelColors) {
+            gReplay.push_back(msg);
+        }
+    }
+    fclose(f);
+
+    if (gReplay.empty()) {
+        fprintf(stderr, "%s: no pixel messages found\n", path);
+        return false;
+    }
+    return true;
+}
+
+static int connectTCP()
+{
+    struct addrinfo hints, *ai;
+    memset(&hints, 0, sizeof hints);
+    hints.ai_family = AF_UNSPEC;
+    hints.ai_socktype = SOCK_STREAM;
+
+    int err = getaddrinfo(gOptions.host, gOptions.port, &hints, &ai);
+    if (err) {
+        fprintf(stderr, "%s: %s\n", gOptions.host, gai_strerror(err));
+        return -1;
+    }
+
+    int fd = socket(ai->ai_family, ai->ai_socktype, ai->ai_protocol);
+    if (fd >= 0 && connect(fd, ai->ai_addr, ai->ai_addrlen) < 0) {
+        perror("connect");
+        close(fd);
+        fd = -1;
+    }
+    freeaddrinfo(ai);
+
+    if (fd >= 0) {
+        int one = 1;
+        setsockopt(fd, IPPROTO_TCP, TCP_NODELAY, &one, sizeof one);
+    }
+    return fd;
+}
+
+static int openReportSocket()
+{
+    int fd = socket(AF_INET, SOCK_DGRAM, 0);
+    if (fd < 0) {
+        perror("socket");
+        return -1;
+    }
+
+    struct sockaddr_in addr;
+    memset(&addr, 0, sizeof addr);
+    addr.sin_family = AF_INET;
+    addr.sin_addr.s_addr = htonl(INADDR_LOOPBACK);
+    addr.sin_port = htons(gOptions.reportPort);
+    if (bind(fd, (struct sockaddr*) &addr, sizeof addr) < 0) {
+        perror("bind");
+        close(fd);
+        return -1;
+    }
+
+    // Wake up periodically to notice when the test is over
+    struct timeval tv = { 0, 100000 };
+    setsockopt(fd, SOL_SOCKET, SO_RCVTIMEO, &tv, sizeof tv);
+
+    // Plenty of buffer for bursts of completions from many devices
+    int size = 4 << 20;
+    setsockopt(fd, SOL_SOCKET, SO_RCVBUF, &size, sizeof size);
+    return fd;
+}
+
+static bool writeAll(int fd, const uint8_t *data, size_t length)
+{
+    while (length) {
+        ssize_t r = write(fd, data, length);
+        if (r < 0 && errno == EINTR) {
+            continue;
+        }
+        if (r <= 0) {
+            return false;
+        }
+        data += r;
+        length -= r;
+    }
+    return true;
+}
+
+static void buildSynthetic(std::vector<uint8_t> &msg, unsigned channel, unsigned frame)
+{
+    unsigned length = gOptions.pixels * 3;
+    msg.resize(OPC::HEADER_BYTES + length);
+    msg[0] = channel;
+    msg[1] = OPC::SetPixelColors;
+    msg[2] = length >> 8;
+    msg[3] = length;
+
+    // A moving gradient, so every frame actually differs
+    for (unsigned i = 0; i < length; ++i) {
+        msg[OPC::HEADER_BYTES + i] = uint8_t(i + frame);
+    }
+}
+
+static void stamp(std::vector<uint8_t> &msg, uint32_t value)
+{
+    // The start of each device-sized block of pixels
+    for (size_t offset = OPC::HEADER_BYTES; offset + sizeof value <= msg.size();
+        offset += kPixelsPerDevice * 3) {
+        memcpy(&msg[offset], &value, sizeof value);
+    }
+}
+
+static void senderThread(void *arg)
+{
+    Connection *conn = (Connection*) arg;
+    unsigned channel = gOptions.channelPerConnection ? conn->id + 1 : 0;
+    uint64_t interval = gOptions.rate > 0 ? uint64_t(1e6 / gOptions.rate) : 0;
+    uint64_t nextSend = now();
+    std::vector<uint8_t> msg;
+
+    for (uint32_t counter = 1; !gStop; counter = (counter + 1) & kCounterMask) {
+        if (!counter) {
+            continue;
+        }
+
+        if (gReplay.empty()) {
+            buildSynthetic(msg, channel, counter);
+        } else {
+            msg = gReplay[counter % gReplay.size()];
+            msg[0] = channel;
+        }
+
+        // Stamps are never zero, so an unstamped frame can't match anything
+        stamp(msg, (conn->id << kCounterBits) | counter);
+
+        if (interval) {
+            uint64_t t = now();
+            if (nextSend > t) {
+                sleepMicroseconds(nextSend - t);
+            }
+            nextSend += interval;
+        }
+
+        uint64_t timestamp = now();
+        gMutex.lock();
+        SentFrame &sent = conn->history[counter % kHistorySize];
+        sent.counter = counter;
+        sent.timestamp = timestamp;
+        gMutex.unlock();
+
+        if (!writeAll(conn->fd, &msg[0], msg.size())) {
+            fprintf(stderr, "Connection %u: write failed, %s\n", conn->id, strerror(errno));
+            break;
+        }
+        conn->framesSent++;
+        conn->bytesSent += msg.size();
+    }
+}
+
+static void handleReport(const MockUSBReport &r)
+{
+    unsigned id = r.stamp >> kCounterBits;
+    uint32_t counter = r.stamp & kCounterMask;
+
+    tthread::lock_guard<tthread::mutex> lock(gMutex);
+    gDevicesSeen.insert(r.device);
+
+    if (id >= gConnections.size() || !counter) {
+        gUnmatched++;
+        return;
+    }
+
+    const SentFrame &sent = gConnections[id]->history[counter % kHistorySize];
+    if (sent.counter != counter || r.timestamp < sent.timestamp) {
+        gUnmatched++;
+        return;
+    }
+
+    gLatencies.push_back(uint32_t(std::min<uint64_t>(r.timestamp - sent.timestamp, 0xFFFFFFFF)));
+}
+
+static void reportThread(void *arg)
+{
+    int fd = *(int*) arg;
+    MockUSBReport r;
+
+    // Keep listening a little after the senders stop, for frames still in flight
+    uint64_t drainUntil = 0;
+    for (;;) {
+        if (gStop) {
+            if (!drainUntil) {
+                drainUntil = now() + 500000;
+            } else if (now() > drainUntil) {
+                break;
+            }
+        }
+
+        ssize_t len = recv(fd, &r, sizeof r, 0);
+        if (len == sizeof r) {
+            handleReport(r);
+        }
+    }
+}
+
+static unsigned percentile(const std::vector<uint32_t> &sorted, double p)
+{
+    size_t index = std::min(sorted.size() - 1, size_t(p * sorted.size()));
+    return sorted[index];
+}
+
+static void printResults(double seconds)
+{
+    uint64_t framesSent = 0, bytesSent = 0;
+    for (unsigned i = 0; i < gConnections.size(); ++i) {
+        framesSent += gConnections[i]->framesSent;
+        bytesSent += gConnections[i]->bytesSent;
+    }
+
+    unsigned devices = gOptions.devices ? gOptions.devices : gDevicesSeen.size();
+    uint64_t expected = framesSent * devices;
+    uint64_t completed = gLatencies.size();
+    uint64_t dropped = expected > completed ? expected - completed : 0;
+
+    printf("Sent:       %llu frames in %.2f s, %.1f frames/s, %.2f MB/s\n",
+        (unsigned long long) framesSent, seconds, framesSent / seconds, bytesSent / seconds / 1e6);
+    printf("Completed:  %llu device frames from %u devices, %.1f frames/s\n",
+        (unsigned long long) completed, devices, completed / seconds);
+    printf("Dropped:    %llu device frames (%.2f%%)\n",
+        (unsigned long long) dropped, expected ? 100.0 * dropped / expected : 0.0);
+    if (gUnmatched) {
+        printf("Unmatched:  %llu completion reports\n", (unsigned long long) gUnmatched);
+    }
+
+    if (gLatencies.empty()) {
+        printf("Latency:    no completions received. Is fcserver built with MOCK_USB and "
+            "running with FCSERVER_MOCK_REPORT=%u?\n", gOptions.reportPort);
+        return;
+    }
+
+    std::sort(gLatencies.begin(), gLatencies.end());
+    printf("Latency:    min %u  p50 %u  p99 %u  p999 %u  max %u (us)\n",
+        gLatencies.front(),
+        percentile(gLatencies, 0.5),
+        percentile(gLatencies, 0.99),
+        percentile(gLatencies, 0.999),
+        gLatencies.back());
+}
+
+int main(int argc, char **argv)
+{
+    if (!parseOptions(argc, argv)) {
+        usage(argv[0]);
+        return 1;
+    }
+    if (gOptions.replayFile && !loadReplay(gOptions.replayFile)) {
+        return 2;
+    }
+
+    int reportFD = openReportSocket();
+    if (reportFD < 0) {
+        return 3;
+    }
+
+    for (unsigned i = 0; i < gOptions.connections; ++i) {
+        Connection *conn = new Connection;
+        conn->id = i;
+        conn->fd = connectTCP();
+        conn->framesSent = 0;
+        conn->bytesSent = 0;
+        conn->history.resize(kHistorySize);
+        if (conn->fd < 0) {
+            return 4;
+        }
+        gConnections.push_back(conn);
+    }
+
+    tthread::thread reporter(reportThread, &reportFD);
+    uint64_t start = now();
+    for (unsigned i = 0; i < gConnections.size(); ++i) {
+        gConnections[i]->thread = new tthread::thread(senderThread, gConnections[i]);
+    }
+
+    sleepMicroseconds(uint64_t(gOptions.duration * 1e6));
+    gStop = true;
+
+    for (unsigned i = 0; i < gConnections.size(); ++i) {
+        gConnections[i]->thread->join();
+        delete gConnections[i]->thread;
+    }
+    double seconds = (now() - start) / 1e6;
+    reporter.join();
+
+    printResults(seconds);
+    return 0;
+}
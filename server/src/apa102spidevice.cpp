@@ -23,8 +23,6 @@
  */
 
 #include "apa102spidevice.h"
-#include "rapidjson/stringbuffer.h"
-#include "rapidjson/writer.h"
 #include "opc.h"
 #include <sstream>
 #include <iostream>
@@ -33,7 +31,6 @@ const char* APA102SPIDevice::DEVICE_TYPE = "apa102spi";
 
 APA102SPIDevice::APA102SPIDevice(uint32_t numLights, bool verbose)
     : SPIDevice(DEVICE_TYPE, verbose),
-      mConfigMap(0),
       mNumLights(numLights)
 {
     uint32_t bufferSize = sizeof(PixelFrame) * (numLights + 2); // Number of lights plus start and end frames
@@ -61,7 +58,19 @@ APA102SPIDevice::~APA102SPIDevice()
 
 void APA102SPIDevice::loadConfiguration(const Value &config)
 {
-    mConfigMap = findConfigMap(config);
+    // Compile the JSON mapping once, so the per-frame path never has to look at it.
+
+    mMap.clear();
+    const Value *map = findConfigMap(config);
+    if (map) {
+        for (unsigned i = 0, e = map->Size(); i != e; i++) {
+            const Value &inst = (*map)[i];
+            if (!mMap.addRange(inst, mNumLights, false) && mVerbose) {
+                PixelMap::logUnsupported(inst);
+            }
+        }
+    }
+    mMap.buildChannelIndex();
 }
 
 std::string APA102SPIDevice::getName()
@@ -177,90 +186,34 @@ void APA102SPIDevice::writeMessage(const OPC::Message &msg)
 void APA102SPIDevice::opcSetPixelColors(const OPC::Message &msg)
 {
     /*
-     * Parse through our device's mapping, and store any relevant portions of 'msg'
-     * in the framebuffer.
+     * Run through the part of our compiled mapping that reads from this message's
+     * channel, and store the relevant portions of 'msg' in the framebuffer.
      */
 
-    if (!mConfigMap) {
-        // No mapping defined yet. This device is inactive.
-        return;
-    }
-
-    const Value &map = *mConfigMap;
-    for (unsigned i = 0, e = map.Size(); i != e; i++) {
-        opcMapPixelColors(msg, map[i]);
+    for (PixelMap::iterator i = mMap.channelBegin(msg.channel), e = mMap.channelEnd(msg.channel); i != e; ++i) {
+        opcMapPixelColors(msg, *i);
     }
 }
 
-void APA102SPIDevice::opcMapPixelColors(const OPC::Message &msg, const Value &inst)
+void APA102SPIDevice::opcMapPixelColors(const OPC::Message &msg, const PixelMap::Op &op)
 {
     /*
-    * Parse one JSON mapping instruction, and copy any relevant parts of 'msg'
-    * into our framebuffer. This looks for any mapping instructions that we
-    * recognize:
-    *
-    *   [ OPC Channel, First OPC Pixel, First output pixel, Pixel count ]
+    * Copy one compiled mapping operation's worth of 'msg' into our framebuffer.
+    * Only plain and reversed ranges are supported by this device's map format.
     */
 
-    unsigned msgPixelCount = msg.length() / 3;
-
-    if (inst.IsArray() && inst.Size() == 4) {
-        // Map a range from an OPC channel to our framebuffer
-
-        const Value &vChannel = inst[0u];
-        const Value &vFirstOPC = inst[1];
-        const Value &vFirstOut = inst[2];
-        const Value &vCount = inst[3];
-
-        if (vChannel.IsUint() && vFirstOPC.IsUint() && vFirstOut.IsUint() && vCount.IsInt()) {
-            unsigned channel = vChannel.GetUint();
-            unsigned firstOPC = vFirstOPC.GetUint();
-            unsigned firstOut = vFirstOut.GetUint();
-            unsigned count;
-            int direction;
-            if (vCount.GetInt() >= 0) {
-                count = vCount.GetInt();
-                direction = 1;
-            }
-            else {
-                count = -vCount.GetInt();
-                direction = -1;
-            }
-
-            if (channel != msg.channel) {
-                return;
-            }
-
-            // Clamping, overflow-safe
-            firstOPC = std::min<unsigned>(firstOPC, msgPixelCount);
-            firstOut = std::min<unsigned>(firstOut, mNumLights);
-            count = std::min<unsigned>(count, msgPixelCount - firstOPC);
-            count = std::min<unsigned>(count,
-                direction > 0 ? mNumLights - firstOut : firstOut + 1);
-
-            // Copy pixels
-            const uint8_t *inPtr = msg.data + (firstOPC * 3);
-            unsigned outIndex = firstOut;
-            while (count--) {
-                PixelFrame *outPtr = fbPixel(outIndex);
-                outIndex += direction;
-                outPtr->r = inPtr[0];
-                outPtr->g = inPtr[1];
-                outPtr->b = inPtr[2];
-                outPtr->l = 0xEF; // todo: fix so we actually pass brightness
-                inPtr += 3;
-            }
-
-            return;
-        }
-    }
-
-    // Still haven't found a match?
-    if (mVerbose) {
-        rapidjson::GenericStringBuffer<rapidjson::UTF8<> > buffer;
-        rapidjson::Writer<rapidjson::GenericStringBuffer<rapidjson::UTF8<> > > writer(buffer);
-        inst.Accept(writer);
-        std::clog << "Unsupported JSON mapping instruction: " << buffer.GetString() << "\n";
+    unsigned count = PixelMap::inputCount(op, msg.length() / 3);
+    const uint8_t *inPtr = msg.data + (op.firstOPC * 3);
+    unsigned outIndex = op.firstOut;
+
+    while (count--) {
+        PixelFrame *outPtr = fbPixel(outIndex);
+        outIndex += op.direction;
+        outPtr->r = inPtr[0];
+        outPtr->g = inPtr[1];
+        outPtr->b = inPtr[2];
+        outPtr->l = 0xEF; // todo: fix so we actually pass brightness
+        inPtr += 3;
     }
 }
 
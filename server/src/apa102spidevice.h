@@ -62,7 +62,6 @@ private:
         uint32_t value;
     };
 
-    const Value *mConfigMap;
     PixelFrame* mFrameBuffer;
     PixelFrame* mFlushBuffer;
     uint32_t mNumLights;
@@ -76,5 +75,5 @@ private:
     void writeDevicePixels(Document &msg);
 
     void opcSetPixelColors(const OPC::Message &msg);
-    void opcMapPixelColors(const OPC::Message &msg, const Value &inst);
+    void opcMapPixelColors(const OPC::Message &msg, const PixelMap::Op &op);
 };
@@ -22,15 +22,13 @@
  */
 
 #include "enttecdmxdevice.h"
-#include "rapidjson/stringbuffer.h"
-#include "rapidjson/writer.h"
 #include "opc.h"
 #include <sstream>
 #include <iostream>
 
 
 EnttecDMXDevice::Transfer::Transfer(EnttecDMXDevice *device, void *buffer, int length)
-    : transfer(libusb_alloc_transfer(0)), finished(false)
+    : transfer(libusb_alloc_transfer(0)), finished(false), submitTime(0), completeTime(0)
 {
     libusb_fill_bulk_transfer(transfer, device->mHandle,
         OUT_ENDPOINT, (uint8_t*) buffer, length, EnttecDMXDevice::completeTransfer, this, 2000);
@@ -43,8 +41,7 @@ EnttecDMXDevice::Transfer::~Transfer()
 
 EnttecDMXDevice::EnttecDMXDevice(libusb_device *device, bool verbose)
     : USBDevice(device, "enttec", verbose),
-      mFoundEnttecStrings(false),
-      mConfigMap(0)
+      mFoundEnttecStrings(false)
 {
     mSerialBuffer[0] = '\0';
     mSerialString = mSerialBuffer;
@@ -156,7 +153,36 @@ bool EnttecDMXDevice::probeAfterOpening()
 
 void EnttecDMXDevice::loadConfiguration(const Value &config)
 {
-    mConfigMap = findConfigMap(config);
+    // Compile the JSON mapping once, so the per-frame path never has to look at it.
+
+    mMap.clear();
+    const Value *map = findConfigMap(config);
+    if (map) {
+        for (unsigned i = 0, e = map->Size(); i != e; i++) {
+            const Value &inst = (*map)[i];
+            if (!mMap.addPick(inst) && !mMap.addConstant(inst) && mVerbose) {
+                PixelMap::logUnsupported(inst);
+            }
+        }
+    }
+    mMap.buildChannelIndex();
+
+    /*
+     * Constant channels don't depend on any OPC message, and the DMX interface keeps
+     * repeating the last packet it received. Send them out right away, so they take
+     * effect even if we never see a message on a channel this device listens to.
+     */
+
+    bool hasConstants = false;
+    for (PixelMap::iterator i = mMap.begin(), e = mMap.end(); i != e; ++i) {
+        if (i->type == PixelMap::CONSTANT) {
+            setChannel(i->firstOut, i->value);
+            hasConstants = true;
+        }
+    }
+    if (hasConstants) {
+        writeDMXPacket();
+    }
 }
 
 std::string EnttecDMXDevice::getName()
@@ -186,7 +212,9 @@ void EnttecDMXDevice::submitTransfer(Transfer *fct)
      * On error, it's freed right away.
      */
 
+    fct->submitTime = Metrics::now();
     int r = libusb_submit_transfer(fct->transfer);
+    countSubmission(r);
 
     if (r < 0) {
         if (mVerbose && r != LIBUSB_ERROR_PIPE) {
@@ -202,6 +230,7 @@ void EnttecDMXDevice::completeTransfer(struct libusb_transfer *transfer)
 {
     EnttecDMXDevice::Transfer *fct = static_cast<EnttecDMXDevice::Transfer*>(transfer->user_data);
     fct->finished = true;
+    fct->completeTime = Metrics::now();
 }
 
 void EnttecDMXDevice::flush()
@@ -215,25 +244,43 @@ void EnttecDMXDevice::flush()
 
         Transfer *fct = *current;
         if (fct->finished) {
+            countCompletion(fct->transfer, fct->completeTime - fct->submitTime);
+            countFrameCompletion(fct->transfer, fct->submitTime, fct->completeTime);
             mPending.erase(current);
             delete fct;
         }
 
         current = next;
     }
+
+    /*
+     * Send the newest queued packet, one at a time. Anything written while a packet is
+     * still in flight just replaces whatever is queued, so we never send DMX faster than
+     * the Enttec device can keep up. Waiting for the previous transfer also keeps the
+     * slot from reusing a buffer that Windows or Mac OS may still have mapped.
+     */
+
+    if (mPending.empty() && mPacketSlot.consume()) {
+        Packet *packet = mPacketSlot.front();
+        submitTransfer(new Transfer(this, packet, packet->length + 5));
+    }
 }
 
 void EnttecDMXDevice::writeDMXPacket()
 {
     /*
-     * Asynchronously write an FTDI packet containing an Enttec packet containing
-     * our set of DMX channels.
-     *
-     * XXX: We should probably throttle this so that we don't send DMX messages
-     *      faster than the Enttec device can keep up!
+     * Queue an FTDI packet containing an Enttec packet containing our set of
+     * DMX channels. This never blocks and never calls into libusb; the next
+     * flush() sends it.
      */
 
-    submitTransfer(new Transfer(this, &mChannelBuffer, mChannelBuffer.length + 5));
+    *mPacketSlot.back() = mChannelBuffer;
+    mStats.framesMapped.add();
+
+    if (mPacketSlot.publish()) {
+        // The USB thread never saw the previous packet
+        mStats.framesSuperseded.add();
+    }
 }
 
 void EnttecDMXDevice::writeMessage(const OPC::Message &msg)
@@ -244,10 +291,13 @@ void EnttecDMXDevice::writeMessage(const OPC::Message &msg)
 
     switch (msg.command) {
 
-        case OPC::SetPixelColors:
+        case OPC::SetPixelColors: {
+            TRACE_SCOPE("map", mTraceLane, "frame", uint32_t(mStats.framesMapped.get()));
+            mStats.framesReceived.add();
             opcSetPixelColors(msg);
             writeDMXPacket();
             return;
+        }
 
         case OPC::SystemExclusive:
             // No relevant SysEx for this device
@@ -262,81 +312,29 @@ void EnttecDMXDevice::writeMessage(const OPC::Message &msg)
 void EnttecDMXDevice::opcSetPixelColors(const OPC::Message &msg)
 {
     /*
-     * Parse through our device's mapping, and store any relevant portions of 'msg'
-     * in the framebuffer.
+     * Run through the part of our compiled mapping that reads from this message's
+     * channel, and store the relevant portions of 'msg' in the framebuffer.
      */
 
-    if (!mConfigMap) {
-        // No mapping defined yet. This device is inactive.
-        return;
-    }
-
-    const Value &map = *mConfigMap;
-    for (unsigned i = 0, e = map.Size(); i != e; i++) {
-        opcMapPixelColors(msg, map[i]);
+    for (PixelMap::iterator i = mMap.channelBegin(msg.channel), e = mMap.channelEnd(msg.channel); i != e; ++i) {
+        opcMapPixelColors(msg, *i);
     }
 }
 
-void EnttecDMXDevice::opcMapPixelColors(const OPC::Message &msg, const Value &inst)
+void EnttecDMXDevice::opcMapPixelColors(const OPC::Message &msg, const PixelMap::Op &op)
 {
     /*
-     * Parse one JSON mapping instruction, and copy any relevant parts of 'msg'
-     * into our framebuffer. This looks for any mapping instructions that we
-     * recognize:
+     * Apply one compiled mapping operation. Our map format has two kinds of instruction:
      *
-     *   [ OPC Channel, OPC Pixel, Pixel Color, DMX Channel ]
+     *   [ OPC Channel, OPC Pixel, Pixel Color, DMX Channel ]  -> one-pixel SWIZZLE
+     *   [ Value, DMX Channel ]                                -> CONSTANT
      */
 
-    unsigned msgPixelCount = msg.length() / 3;
-
-    if (inst.IsArray() && inst.Size() == 4) {
-        // Map a range from an OPC channel to our framebuffer
-
-        const Value &vChannel = inst[0u];
-        const Value &vPixelIndex = inst[1];
-        const Value &vPixelColor = inst[2];
-        const Value &vDMXChannel = inst[3];
-
-        if (vChannel.IsUint() && vPixelIndex.IsUint() && vPixelColor.IsString() && vDMXChannel.IsUint()) {
-            unsigned channel = vChannel.GetUint();
-            unsigned pixelIndex = vPixelIndex.GetUint();
-            const char *pixelColor = vPixelColor.GetString();
-            unsigned dmxChannel = vDMXChannel.GetUint();
-
-            if (channel != msg.channel || pixelIndex >= msgPixelCount) {
-                return;
-            }
-
-            const uint8_t *pixel = msg.data + (pixelIndex * 3);
-            uint8_t value;
+    if (op.type == PixelMap::CONSTANT) {
+        setChannel(op.firstOut, op.value);
 
-            if (OPC::pickColorChannel(value, pixelColor[0], pixel)) {
-                setChannel(dmxChannel, value);
-                return;
-            }
-        }
-    }
-
-    if (inst.IsArray() && inst.Size() == 2) {
-        // Constant value
-
-        const Value &vValue = inst[0u];
-        const Value &vDMXChannel = inst[1];
-
-        if (vValue.IsUint() && vDMXChannel.IsUint()) {
-            unsigned value = vValue.GetUint();
-            unsigned dmxChannel = vDMXChannel.GetUint();
-
-            setChannel(dmxChannel, value);
-            return;
-        }
-    }
-
-    // Still haven't found a match?
-    if (mVerbose) {
-        rapidjson::GenericStringBuffer<rapidjson::UTF8<> > buffer;
-        rapidjson::Writer<rapidjson::GenericStringBuffer<rapidjson::UTF8<> > > writer(buffer);
-        inst.Accept(writer);
-        std::clog << "Unsupported JSON mapping instruction: " << buffer.GetString() << "\n";
+    } else if (PixelMap::inputCount(op, msg.length() / 3)) {
+        const uint8_t *pixel = msg.data + (op.firstOPC * 3);
+        setChannel(op.firstOut, PixelMap::pickColor(op.colors[0], pixel));
     }
 }
@@ -24,6 +24,7 @@
 #pragma once
 #include "usbdevice.h"
 #include "opc.h"
+#include "frameslot.h"
 #include <set>
 
 
@@ -64,17 +65,21 @@ private:
         ~Transfer();
         libusb_transfer *transfer;
         bool finished;
+        uint64_t submitTime;
+        uint64_t completeTime;
     };
 
     char mSerialBuffer[256];
     bool mFoundEnttecStrings;
-    const Value *mConfigMap;
     Packet mChannelBuffer;
     std::set<Transfer*> mPending;
 
+    // Packets queued by writeDMXPacket(), waiting for flush()
+    FrameSlot<Packet> mPacketSlot;
+
     void submitTransfer(Transfer *fct);
     static LIBUSB_CALL void completeTransfer(struct libusb_transfer *transfer);
 
     void opcSetPixelColors(const OPC::Message &msg);
-    void opcMapPixelColors(const OPC::Message &msg, const Value &inst);
+    void opcMapPixelColors(const OPC::Message &msg, const PixelMap::Op &op);
 };
@@ -0,0 +1,317 @@
+/*
+ * Event loop for file descriptors and cross-thread wakeups
+ *
+ * Copyright (c) 2013 Micah Elizabeth Scott
+ *
+ * Permission is hereby granted, free of charge, to any person obtaining a copy of
+ * this software and associated documentation files (the "Software"), to deal in
+ * the Software without restriction, including without limitation the rights to
+ * use, copy, modify, merge, publish, distribute, sublicense, and/or sell copies of
+ * the Software, and to permit persons to whom the Software is furnished to do so,
+ * subject to the following conditions:
+ *
+ * The above copyright notice and this permission notice shall be included in all
+ * copies or substantial portions of the Software.
+ *
+ * THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+ * IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY, FITNESS
+ * FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL THE AUTHORS OR
+ * COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER LIABILITY, WHETHER
+ * IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING FROM, OUT OF OR IN
+ * CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN THE SOFTWARE.
+ */
+
+#include "eventloop.h"
+#ifndef OS_WINDOWS
+#include <iostream>
+#include <unistd.h>
+#include <fcntl.h>
+
+#ifdef OS_LINUX
+#include <sys/epoll.h>
+#include <sys/eventfd.h>
+#endif
+
+// Descriptors serviced per epoll_wait()
+static const unsigned kMaxEvents = 64;
+
+
+EventLoop::EventLoop()
+    : mNextSerial(0),
+      mWakePending(false),
+      mWokeAt(0)
+{
+#ifdef OS_LINUX
+    mEpollFD = -1;
+    mWakeFD = -1;
+#else
+    mWakePipe[0] = mWakePipe[1] = -1;
+#endif
+}
+
+EventLoop::~EventLoop()
+{
+#ifdef OS_LINUX
+    if (mEpollFD >= 0) {
+        close(mEpollFD);
+    }
+    if (mWakeFD >= 0) {
+        close(mWakeFD);
+    }
+#else
+    if (mWakePipe[0] >= 0) {
+        close(mWakePipe[0]);
+        close(mWakePipe[1]);
+    }
+#endif
+}
+
+#ifdef OS_LINUX
+
+static uint32_t toEpoll(short events)
+{
+    return ((events & POLLIN) ? uint32_t(EPOLLIN) : 0) |
+           ((events & POLLPRI) ? uint32_t(EPOLLPRI) : 0) |
+           ((events & POLLOUT) ? uint32_t(EPOLLOUT) : 0);
+}
+
+static short fromEpoll(uint32_t events)
+{
+    return ((events & EPOLLIN) ? POLLIN : 0) |
+           ((events & EPOLLPRI) ? POLLPRI : 0) |
+           ((events & EPOLLOUT) ? POLLOUT : 0) |
+           ((events & EPOLLERR) ? POLLERR : 0) |
+           ((events & EPOLLHUP) ? POLLHUP : 0);
+}
+
+static uint64_t epollKey(int fd, uint32_t serial)
+{
+    return (uint64_t(serial) << 32) | uint32_t(fd);
+}
+
+bool EventLoop::init()
+{
+    mEpollFD = epoll_create1(EPOLL_CLOEXEC);
+    if (mEpollFD < 0) {
+        std::clog << "Error creating epoll instance\n";
+        return false;
+    }
+
+    mWakeFD = eventfd(0, EFD_NONBLOCK | EFD_CLOEXEC);
+    if (mWakeFD < 0) {
+        std::clog << "Error creating eventfd\n";
+        return false;
+    }
+
+    struct epoll_event ev;
+    ev.events = EPOLLIN;
+    ev.data.u64 = epollKey(mWakeFD, 0);
+    return epoll_ctl(mEpollFD, EPOLL_CTL_ADD, mWakeFD, &ev) == 0;
+}
+
+void EventLoop::add(int fd, short events, callback_t cb, void *context)
+{
+    mMutex.lock();
+    Handler &h = mHandlers[fd];
+    h.callback = cb;
+    h.context = context;
+    h.events = events;
+    h.serial = ++mNextSerial;
+
+    struct epoll_event ev;
+    ev.events = toEpoll(events);
+    ev.data.u64 = epollKey(fd, h.serial);
+    if (epoll_ctl(mEpollFD, EPOLL_CTL_ADD, fd, &ev) < 0) {
+        epoll_ctl(mEpollFD, EPOLL_CTL_MOD, fd, &ev);
+    }
+    mMutex.unlock();
+}
+
+void EventLoop::modify(int fd, short events)
+{
+    mMutex.lock();
+    handlerMap_t::iterator i = mHandlers.find(fd);
+    if (i != mHandlers.end()) {
+        i->second.events = events;
+
+        struct epoll_event ev;
+        ev.events = toEpoll(events);
+        ev.data.u64 = epollKey(fd, i->second.serial);
+        epoll_ctl(mEpollFD, EPOLL_CTL_MOD, fd, &ev);
+    }
+    mMutex.unlock();
+}
+
+void EventLoop::remove(int fd)
+{
+    mMutex.lock();
+    if (mHandlers.erase(fd)) {
+        // May fail harmlessly if the fd is already closed
+        struct epoll_event ev;
+        epoll_ctl(mEpollFD, EPOLL_CTL_DEL, fd, &ev);
+    }
+    mMutex.unlock();
+}
+
+void EventLoop::runOnce(int timeoutMS)
+{
+    struct epoll_event events[kMaxEvents];
+    int count = epoll_wait(mEpollFD, events, kMaxEvents, timeoutMS < 0 ? -1 : timeoutMS);
+    mWokeAt = Metrics::now();
+
+    for (int i = 0; i < count; i++) {
+        int fd = int(uint32_t(events[i].data.u64));
+        uint32_t serial = uint32_t(events[i].data.u64 >> 32);
+
+        if (fd == mWakeFD) {
+            clearWake();
+        } else {
+            dispatch(fd, serial, fromEpoll(events[i].events));
+        }
+    }
+}
+
+void EventLoop::wake()
+{
+    if (!mWakePending.exchange(true)) {
+        uint64_t one = 1;
+        if (write(mWakeFD, &one, sizeof one) < 0) {
+            // Counter is saturated. The loop is already awake.
+        }
+    }
+}
+
+void EventLoop::clearWake()
+{
+    uint64_t count;
+    if (read(mWakeFD, &count, sizeof count) < 0) {
+        // Nothing to read, that's fine.
+    }
+
+    // Drain before clearing, so a wake() that races with us always leaves the fd readable.
+    mWakePending.store(false);
+}
+
+#else   // !OS_LINUX
+
+bool EventLoop::init()
+{
+    if (pipe(mWakePipe) < 0) {
+        std::clog << "Error creating wakeup pipe\n";
+        return false;
+    }
+    fcntl(mWakePipe[0], F_SETFL, O_NONBLOCK);
+    fcntl(mWakePipe[1], F_SETFL, O_NONBLOCK);
+    return true;
+}
+
+void EventLoop::add(int fd, short events, callback_t cb, void *context)
+{
+    mMutex.lock();
+    Handler &h = mHandlers[fd];
+    h.callback = cb;
+    h.context = context;
+    h.events = events;
+    h.serial = ++mNextSerial;
+    mMutex.unlock();
+
+    // The poll set is rebuilt on every pass. Make sure the next pass sees this.
+    wake();
+}
+
+void EventLoop::modify(int fd, short events)
+{
+    mMutex.lock();
+    handlerMap_t::iterator i = mHandlers.find(fd);
+    if (i != mHandlers.end()) {
+        i->second.events = events;
+    }
+    mMutex.unlock();
+    wake();
+}
+
+void EventLoop::remove(int fd)
+{
+    mMutex.lock();
+    mHandlers.erase(fd);
+    mMutex.unlock();
+}
+
+void EventLoop::runOnce(int timeoutMS)
+{
+    struct pollfd wakeFD = { mWakePipe[0], POLLIN, 0 };
+
+    mPollFDs.clear();
+    mPollSerials.clear();
+    mPollFDs.push_back(wakeFD);
+    mPollSerials.push_back(0);
+
+    mMutex.lock();
+    for (handlerMap_t::iterator i = mHandlers.begin(), e = mHandlers.end(); i != e; ++i) {
+        struct pollfd pfd = { i->first, i->second.events, 0 };
+        mPollFDs.push_back(pfd);
+        mPollSerials.push_back(i->second.serial);
+    }
+    mMutex.unlock();
+
+    int count = poll(&mPollFDs[0], mPollFDs.size(), timeoutMS < 0 ? -1 : timeoutMS);
+    mWokeAt = Metrics::now();
+    if (count <= 0) {
+        return;
+    }
+
+    if (mPollFDs[0].revents) {
+        clearWake();
+    }
+
+    for (unsigned i = 1; i < mPollFDs.size(); i++) {
+        if (mPollFDs[i].revents) {
+            dispatch(mPollFDs[i].fd, mPollSerials[i], mPollFDs[i].revents);
+        }
+    }
+}
+
+void EventLoop::wake()
+{
+    if (!mWakePending.exchange(true)) {
+        char byte = 0;
+        if (write(mWakePipe[1], &byte, 1) < 0) {
+            // Pipe is full. The loop is already awake.
+        }
+    }
+}
+
+void EventLoop::clearWake()
+{
+    char buffer[64];
+    while (read(mWakePipe[0], buffer, sizeof buffer) > 0);
+
+    // Drain before clearing, so a wake() that races with us always leaves the pipe readable.
+    mWakePending.store(false);
+}
+
+#endif  // !OS_LINUX
+
+void EventLoop::dispatch(int fd, uint32_t serial, short revents)
+{
+    /*
+     * Look the handler up again, without holding the lock during the callback.
+     * An earlier callback in this same pass may have removed this fd, or even
+     * removed it and added a new one with the same number.
+     */
+
+    mMutex.lock();
+    handlerMap_t::iterator i = mHandlers.find(fd);
+    bool current = i != mHandlers.end() && i->second.serial == serial;
+    Handler h;
+    if (current) {
+        h = i->second;
+    }
+    mMutex.unlock();
+
+    if (current) {
+        h.callback(fd, revents, h.context);
+    }
+}
+
+#endif  // !OS_WINDOWS
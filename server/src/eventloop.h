@@ -0,0 +1,103 @@
+/*
+ * Event loop for file descriptors and cross-thread wakeups
+ *
+ * Copyright (c) 2013 Micah Elizabeth Scott
+ *
+ * Permission is hereby granted, free of charge, to any person obtaining a copy of
+ * this software and associated documentation files (the "Software"), to deal in
+ * the Software without restriction, including without limitation the rights to
+ * use, copy, modify, merge, publish, distribute, sublicense, and/or sell copies of
+ * the Software, and to permit persons to whom the Software is furnished to do so,
+ * subject to the following conditions:
+ *
+ * The above copyright notice and this permission notice shall be included in all
+ * copies or substantial portions of the Software.
+ *
+ * THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+ * IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY, FITNESS
+ * FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL THE AUTHORS OR
+ * COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER LIABILITY, WHETHER
+ * IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING FROM, OUT OF OR IN
+ * CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN THE SOFTWARE.
+ */
+
+#pragma once
+#ifndef OS_WINDOWS
+#include <map>
+#include <vector>
+#include <atomic>
+#include <stdint.h>
+#include <poll.h>
+#include "tinythread.h"
+#include "metrics.h"
+
+
+/*
+ * Waits on a set of file descriptors and calls back when they're ready. On Linux
+ * this is epoll, with an eventfd for wakeups. Other POSIX systems use poll() and
+ * a pipe.
+ *
+ * One thread runs the loop. Any thread may add or remove descriptors, or wake the
+ * loop up so it can look at work queued from elsewhere.
+ *
+ * Events use the poll() flags (POLLIN, POLLOUT, ...) on every platform.
+ *
+ * Not available on Windows. There, libusb and libwebsockets keep their own
+ * polling, on a short timer.
+ */
+
+class EventLoop
+{
+public:
+    typedef void (*callback_t)(int fd, short revents, void *context);
+
+    EventLoop();
+    ~EventLoop();
+
+    // Must succeed before anything else is used
+    bool init();
+
+    void add(int fd, short events, callback_t cb, void *context);
+    void modify(int fd, short events);
+    void remove(int fd);
+
+    // Wait up to timeoutMS (forever if negative), and run callbacks for whatever is ready.
+    // Also returns early after a wake().
+    void runOnce(int timeoutMS);
+
+    // Interrupt runOnce(), from any thread. Only the first call per wakeup makes a syscall.
+    void wake();
+
+    // When the last runOnce() stopped waiting, for timing the work done after it
+    uint64_t wokeAt() const { return mWokeAt; }
+
+private:
+    struct Handler {
+        callback_t callback;
+        void *context;
+        short events;
+        uint32_t serial;    // Tells a reused fd apart from the one that was removed
+    };
+
+    typedef std::map<int, Handler> handlerMap_t;
+
+    handlerMap_t mHandlers;
+    tthread::mutex mMutex;
+    uint32_t mNextSerial;
+    std::atomic<bool> mWakePending;
+    uint64_t mWokeAt;
+
+#ifdef OS_LINUX
+    int mEpollFD;
+    int mWakeFD;
+#else
+    int mWakePipe[2];
+    std::vector<struct pollfd> mPollFDs;
+    std::vector<uint32_t> mPollSerials;
+#endif
+
+    void dispatch(int fd, uint32_t serial, short revents);
+    void clearWake();
+};
+
+#endif  // !OS_WINDOWS
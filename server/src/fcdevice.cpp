@@ -22,20 +22,37 @@
  */
 
 #include "fcdevice.h"
-#include "rapidjson/stringbuffer.h"
-#include "rapidjson/writer.h"
 #include "opc.h"
 #include <math.h>
 #include <iostream>
 #include <sstream>
 #include <algorithm>
 #include <stdio.h>
+#include <stdlib.h>
 
 
-FCDevice::Transfer::Transfer(FCDevice *device, void *buffer, int length, PacketType type)
+FCDevice::Transfer::Transfer(FCDevice *device, void *buffer, int length)
     : transfer(libusb_alloc_transfer(0)),
-      type(type), finished(false)
+      finished(false),
+      orphaned(false),
+      submitTime(0),
+      completeTime(0)
 {
+    #if HAVE_USB_DEV_MEM
+        // Our own copy, in memory the kernel won't need to copy again
+        devMemHandle = 0;
+        devMem = 0;
+        if (device->mDevMemHandle) {
+            devMem = libusb_dev_mem_alloc(device->mHandle, length);
+        }
+        if (devMem) {
+            devMemHandle = device->mDevMemHandle;
+            devMemHandle->refs++;
+            memcpy(devMem, buffer, length);
+            buffer = devMem;
+        }
+    #endif
+
     #if NEED_COPY_USB_TRANSFER_BUFFER
         bufferCopy = malloc(length);
         memcpy(bufferCopy, buffer, length);
@@ -45,21 +62,70 @@ FCDevice::Transfer::Transfer(FCDevice *device, void *buffer, int length, PacketT
     #endif
 
     libusb_fill_bulk_transfer(transfer, device->mHandle,
-        OUT_ENDPOINT, data, length, FCDevice::completeTransfer, this, 2000);
+        OUT_ENDPOINT, data, length, FCDevice::completeTransfer, this, TRANSFER_TIMEOUT);
 }
 
 FCDevice::Transfer::~Transfer()
 {
+    #if HAVE_USB_DEV_MEM
+        if (devMemHandle) {
+            releaseDevMem(devMemHandle, devMem, transfer->length);
+        }
+    #endif
     libusb_free_transfer(transfer);
     #if NEED_COPY_USB_TRANSFER_BUFFER
         free(bufferCopy);
     #endif
 }
 
+FCDevice::FrameTransfer::FrameTransfer(FCDevice *device)
+    : transfer(libusb_alloc_transfer(0)),
+      device(device), inFlight(false), heldBack(false), whole(false), generation(0), submitTime(0)
+{
+    #if HAVE_USB_DEV_MEM
+        devMemHandle = 0;
+        devMem = 0;
+    #endif
+}
+
+FCDevice::FrameTransfer::~FrameTransfer()
+{
+    #if HAVE_USB_DEV_MEM
+        if (devMemHandle) {
+            releaseDevMem(devMemHandle, devMem, sizeof *devMem);
+        }
+    #endif
+    libusb_free_transfer(transfer);
+}
+
 FCDevice::FCDevice(libusb_device *device, bool verbose)
     : USBDevice(device, "fadecandy", verbose),
-      mConfigMap(0), mNumFramesPending(0), mFrameWaitingForSubmit(false)
+      mDeltaFrames(false),
+      mDeltaSynced(false),
+      mDeltaGeneration(0),
+      mNextFrame(0),
+      mWindow(DEFAULT_WINDOW),
+      mMaxWindow(MAX_FRAMES_PENDING),
+      mInFlight(0),
+      mLatencyBudget(0),
+      mWaitingForWindow(false),
+      mLatencyAvg(0),
+      mLatencyDev(0),
+      mLatencyMin(0),
+      mEpochCompletions(0),
+      mEpochStarved(0),
+      mCalmEpochs(0),
+      mKeepalive(DEFAULT_KEEPALIVE * 1000),
+      mLastQueuedAt(0)
 {
+#if HAVE_USB_DEV_MEM
+    mDevMemHandle = 0;
+#endif
+
+    for (unsigned i = 0; i < MAX_FRAMES_PENDING; ++i) {
+        mFrameRing[i] = new FrameTransfer(this);
+    }
+
     mSerialBuffer[0] = '\0';
     mSerialString = mSerialBuffer;
 
@@ -91,10 +157,77 @@ FCDevice::~FCDevice()
 
     for (std::set<Transfer*>::iterator i = mPending.begin(), e = mPending.end(); i != e; ++i) {
         Transfer *fct = *i;
-        libusb_cancel_transfer(fct->transfer);
+        if (fct->finished) {
+            delete fct;
+        } else {
+            fct->orphaned = true;
+            libusb_cancel_transfer(fct->transfer);
+        }
+    }
+
+    // Frame transfers still in flight outlive us, and free themselves on completion.
+    for (unsigned i = 0; i < MAX_FRAMES_PENDING; ++i) {
+        FrameTransfer *ft = mFrameRing[i];
+        if (ft->inFlight) {
+            ft->device = 0;
+            libusb_cancel_transfer(ft->transfer);
+        } else {
+            delete ft;
+        }
+    }
+
+#if HAVE_USB_DEV_MEM
+    if (mDevMemHandle) {
+        // Buffers still in flight keep the handle open, so it isn't ours to close anymore
+        mHandle = 0;
+        releaseDevMem(mDevMemHandle, 0, 0);
+    }
+#endif
+}
+
+#if HAVE_USB_DEV_MEM
+
+void FCDevice::allocDevMem()
+{
+    /*
+     * Give each frame ring entry a buffer that usbfs shares with the kernel. An entry's
+     * buffer is only written while its transfer is idle, so frames in flight never tear.
+     * If the kernel can't spare any, we keep using ordinary buffers for everything.
+     */
+
+    HandleRef *ref = new HandleRef;
+    ref->handle = mHandle;
+    ref->refs = 1;      // Ours, until the destructor
+
+    for (unsigned i = 0; i < MAX_FRAMES_PENDING; ++i) {
+        FrameTransfer *ft = mFrameRing[i];
+        ft->devMem = (Frame*) libusb_dev_mem_alloc(mHandle, sizeof(Frame));
+        if (ft->devMem) {
+            ft->devMemHandle = ref;
+            ref->refs++;
+        }
+    }
+
+    if (ref->refs == 1) {
+        delete ref;
+    } else {
+        mDevMemHandle = ref;
     }
 }
 
+void FCDevice::releaseDevMem(HandleRef *ref, void *buffer, size_t length)
+{
+    if (buffer) {
+        libusb_dev_mem_free(ref->handle, (unsigned char*) buffer, length);
+    }
+    if (--ref->refs == 0) {
+        libusb_close(ref->handle);
+        delete ref;
+    }
+}
+
+#endif
+
 bool FCDevice::probe(libusb_device *device)
 {
     libusb_device_descriptor dd;
@@ -124,17 +257,61 @@ int FCDevice::open()
         return r;
     }
 
+#if HAVE_USB_DEV_MEM
+    allocDevMem();
+#endif
+
     unsigned major = mDD.bcdDevice >> 8;
     unsigned minor = mDD.bcdDevice & 0xFF;
     snprintf(mVersionString, sizeof mVersionString, "%x.%02x", major, minor);
 
+    // Versions 0x03xx are unofficial forks, which we can't assume anything about
+    mDeltaFrames = mDD.bcdDevice >= FIRST_DELTA_FIRMWARE && major != 0x03;
+
     return libusb_get_string_descriptor_ascii(mHandle, mDD.iSerialNumber, 
         (uint8_t*)mSerialBuffer, sizeof mSerialBuffer);
 }
 
 void FCDevice::loadConfiguration(const Value &config)
 {
-    mConfigMap = findConfigMap(config);
+    /*
+     * Compile the JSON mapping once, so the per-frame path never has to look at it.
+     */
+
+    mMap.clear();
+    const Value *map = findConfigMap(config);
+    if (map) {
+        for (unsigned i = 0, e = map->Size(); i != e; i++) {
+            const Value &inst = (*map)[i];
+            if (!mMap.addRange(inst, NUM_PIXELS, true) && mVerbose) {
+                PixelMap::logUnsupported(inst);
+            }
+        }
+    }
+    mMap.buildChannelIndex();
+
+    const Value &maxFramesPending = config["maxFramesPending"];
+    if (maxFramesPending.IsUint() && maxFramesPending.GetUint() >= 1 &&
+        maxFramesPending.GetUint() <= MAX_FRAMES_PENDING) {
+        mMaxWindow = maxFramesPending.GetUint();
+        mWindow = std::min(mWindow, mMaxWindow);
+    } else if (!maxFramesPending.IsNull()) {
+        std::clog << "maxFramesPending must be a number from 1 to " << MAX_FRAMES_PENDING << ".\n";
+    }
+
+    const Value &latencyBudget = config["latencyBudget"];
+    if (latencyBudget.IsNumber() && latencyBudget.GetDouble() > 0) {
+        mLatencyBudget = uint64_t(latencyBudget.GetDouble() * 1000);
+    } else if (!latencyBudget.IsNull()) {
+        std::clog << "latencyBudget must be a positive number of milliseconds, or null to aim for throughput.\n";
+    }
+
+    const Value &keepalive = config["keepalive"];
+    if (keepalive.IsUint()) {
+        mKeepalive = uint64_t(keepalive.GetUint()) * 1000;
+    } else if (!keepalive.IsNull()) {
+        std::clog << "Keepalive must be a number of milliseconds, or 0 to send every frame.\n";
+    }
 
     // Initial firmware configuration from our device options
     writeFirmwareConfiguration(config);
@@ -176,7 +353,9 @@ bool FCDevice::submitTransfer(Transfer *fct)
      * On error, it's freed right away.
      */
 
+    fct->submitTime = Metrics::now();
     int r = libusb_submit_transfer(fct->transfer);
+    countSubmission(r);
 
     if (r < 0) {
         if (mVerbose && r != LIBUSB_ERROR_PIPE) {
@@ -194,7 +373,255 @@ bool FCDevice::submitTransfer(Transfer *fct)
 void FCDevice::completeTransfer(libusb_transfer *transfer)
 {
     FCDevice::Transfer *fct = static_cast<FCDevice::Transfer*>(transfer->user_data);
+
+    if (fct->orphaned) {
+        // The device went away while we were in flight
+        delete fct;
+        return;
+    }
+
     fct->finished = true;
+    fct->completeTime = Metrics::now();
+}
+
+bool FCDevice::submitFrame()
+{
+    /*
+     * Send the newest queued frame, if the window has room. Frames stay in the slot
+     * until then, so a newer one can replace them for free. Bulk transfers on one
+     * endpoint complete in order, so the ring frees up in the same order we fill it.
+     *
+     * Only called on the device's shard thread, from flush() or a completion callback,
+     * with the shard's lock held.
+     */
+
+    FrameTransfer *ft = mFrameRing[mNextFrame];
+    if (mInFlight >= mWindow || ft->inFlight) {
+        if (mFrameSlot.pending()) {
+            mWaitingForWindow = true;
+        }
+        return false;
+    }
+    if (!mFrameSlot.consume()) {
+        return false;
+    }
+
+    #ifdef FCSERVER_TRACE
+        TRACE_SPAN("queued", mTraceLane, mFrameSlot.front()->mappedAt, "frame", mFrameSlot.front()->number);
+        ft->frameNumber = mFrameSlot.front()->number;
+    #endif
+
+    /*
+     * Delta frames are packed into the ring entry's own buffer. Otherwise, on Linux the
+     * kernel copies the frame during submission, so we can send straight from the slot.
+     * Elsewhere the buffer stays mapped until completion, so each ring entry keeps its
+     * own copy. A buffer shared with the kernel is never copied by it, so it's always
+     * the one we send from when we have it.
+     */
+
+    Frame *buffer = &ft->buffer;
+    bool ownBuffer = false;
+    #if NEED_COPY_USB_TRANSFER_BUFFER
+        ownBuffer = true;
+    #endif
+    #if HAVE_USB_DEV_MEM
+        if (ft->devMem) {
+            buffer = ft->devMem;
+            ownBuffer = true;
+        }
+    #endif
+
+    uint8_t *data;
+    int length;
+
+    if (mDeltaFrames) {
+        unsigned count = packDirtyPackets(*mFrameSlot.front(), buffer->packets);
+        ft->whole = count == FRAMEBUFFER_PACKETS;
+        ft->generation = mDeltaGeneration;
+        length = count * sizeof(Packet);
+        data = (uint8_t*) buffer;
+    } else {
+        if (ownBuffer) {
+            memcpy(buffer->packets, mFrameSlot.front()->packets, sizeof buffer->packets);
+            data = (uint8_t*) buffer;
+        } else {
+            data = (uint8_t*) mFrameSlot.front();
+        }
+        length = sizeof mFramebuffer;
+    }
+
+    libusb_fill_bulk_transfer(ft->transfer, mHandle,
+        OUT_ENDPOINT, data, length, FCDevice::completeFrameTransfer, ft, frameTimeout());
+
+    ft->submitTime = Metrics::now();
+    int r = libusb_submit_transfer(ft->transfer);
+    countSubmission(r);
+    if (r < 0) {
+        if (mVerbose && r != LIBUSB_ERROR_PIPE) {
+            std::clog << "Error submitting USB transfer: " << libusb_strerror(libusb_error(r)) << "\n";
+        }
+        deltaFailed();
+        return false;
+    }
+
+    ft->heldBack = mWaitingForWindow;
+    mWaitingForWindow = false;
+
+    ft->inFlight = true;
+    mInFlight++;
+    mNextFrame = (mNextFrame + 1) % MAX_FRAMES_PENDING;
+    return true;
+}
+
+unsigned FCDevice::packDirtyPackets(const Frame &frame, Packet *out)
+{
+    /*
+     * Copy the packets that differ from the last frame we sent into 'out', and return
+     * how many there are. The firmware fills in the rest from its previous frame. The
+     * final packet always goes, since it's what tells the firmware the frame is done.
+     */
+
+    unsigned count = 0;
+
+    for (unsigned i = 0; i < FRAMEBUFFER_PACKETS; ++i) {
+        const Packet &packet = frame.packets[i];
+        if (i == FRAMEBUFFER_PACKETS - 1 || !mDeltaSynced ||
+            memcmp(&packet, &mLastSent.packets[i], sizeof packet)) {
+            out[count++] = packet;
+        }
+    }
+
+    memcpy(mLastSent.packets, frame.packets, sizeof mLastSent.packets);
+    return count;
+}
+
+void FCDevice::deltaFailed()
+{
+    // Some packets may not have made it. Send whole frames until one of them gets through.
+    mDeltaGeneration++;
+    mDeltaSynced = false;
+}
+
+bool FCDevice::ranDry(uint64_t now) const
+{
+    /*
+     * Called as the oldest frame in flight completes. Did the device run out of work
+     * after it, while the window held the next frame back? Frames complete in order,
+     * so the next one only kept the device busy if it was submitted at least about one
+     * completion latency before this one finished. If it's still waiting, or went out
+     * more recently than that, a bigger window would have had it there sooner.
+     */
+
+    if (mInFlight < 2) {
+        return mWaitingForWindow;
+    }
+
+    const FrameTransfer *next = mFrameRing[(mNextFrame + MAX_FRAMES_PENDING - mInFlight + 1) % MAX_FRAMES_PENDING];
+    uint64_t latency = mLatencyMin ? mLatencyMin : mLatencyAvg;
+    return next->heldBack && now - next->submitTime < latency;
+}
+
+void FCDevice::adjustWindow(uint64_t latency, bool idled)
+{
+    /*
+     * Called for each completed frame. Latency is tracked as a moving average and mean
+     * deviation, like TCP's round trip time. Every few windows' worth of frames, we
+     * decide whether the window should change:
+     *
+     *   - Grow by one if the device ran dry after most frames while the next one was
+     *     held back by the window, and completions have been consistent. With a latency
+     *     budget, only if one more frame in flight should still fit within it.
+     *
+     *   - Shrink by one if the average latency is over the budget. When aiming for
+     *     throughput, shrink after a while without running dry, to find the smallest
+     *     window that keeps up.
+     */
+
+    if (idled) {
+        mEpochStarved++;
+    }
+
+    if (mLatencyAvg == 0) {
+        mLatencyAvg = latency;
+        mLatencyDev = latency / 2;
+    } else {
+        int64_t error = int64_t(latency) - int64_t(mLatencyAvg);
+        mLatencyAvg += error / 8;
+        mLatencyDev += (std::abs(error) - int64_t(mLatencyDev)) / 4;
+    }
+
+    if (++mEpochCompletions < mWindow * WINDOW_EPOCH) {
+        return;
+    }
+
+    if (mLatencyMin == 0 || mLatencyAvg < mLatencyMin) {
+        mLatencyMin = mLatencyAvg;
+    }
+
+    bool consistent = mLatencyDev * 2 <= mLatencyAvg;
+    bool starved = mEpochStarved * 2 > mEpochCompletions;
+    mCalmEpochs = starved ? 0 : mCalmEpochs + 1;
+
+    if (mLatencyBudget) {
+        if (mLatencyAvg > mLatencyBudget) {
+            mWindow = std::max(1u, mWindow - 1);
+        } else if (starved && consistent && mWindow < mMaxWindow &&
+            uint64_t(mLatencyAvg) * (mWindow + 1) / mWindow <= mLatencyBudget) {
+            mWindow++;
+        }
+    } else {
+        if (starved && consistent && mWindow < mMaxWindow) {
+            mWindow++;
+        } else if (mCalmEpochs >= WINDOW_CALM_EPOCHS && mWindow > 1) {
+            mWindow--;
+            mCalmEpochs = 0;
+        }
+    }
+
+    mEpochCompletions = 0;
+    mEpochStarved = 0;
+}
+
+unsigned FCDevice::frameTimeout() const
+{
+    // Same shape as TCP's retransmission timeout, with plenty of margin on top
+    if (mLatencyAvg == 0) {
+        return TRANSFER_TIMEOUT;
+    }
+    uint64_t ms = (uint64_t(mLatencyAvg) + 4 * uint64_t(mLatencyDev)) * 4 / 1000;
+    return unsigned(std::min<uint64_t>(std::max<uint64_t>(ms, MIN_FRAME_TIMEOUT), TRANSFER_TIMEOUT));
+}
+
+void FCDevice::completeFrameTransfer(libusb_transfer *transfer)
+{
+    FrameTransfer *ft = static_cast<FrameTransfer*>(transfer->user_data);
+    FCDevice *self = ft->device;
+
+    if (!self) {
+        // Orphaned by a device that has since gone away
+        delete ft;
+        return;
+    }
+
+    uint64_t now = Metrics::now();
+    self->countCompletion(transfer, now - ft->submitTime);
+    self->countFrameCompletion(transfer, ft->submitTime, now);
+
+    if (transfer->status == LIBUSB_TRANSFER_COMPLETED) {
+        self->adjustWindow(now - ft->submitTime, self->ranDry(now));
+        if (ft->whole && ft->generation == self->mDeltaGeneration) {
+            // The firmware has everything we've packed since, so deltas are safe again
+            self->mDeltaSynced = true;
+        }
+    } else {
+        self->deltaFailed();
+    }
+    TRACE_SPAN("usb", self->mTraceLane, ft->submitTime, "frame", ft->frameNumber);
+
+    // Keep the pipeline full, without waiting for the main loop to come around again
+    ft->inFlight = false;
+    self->mInFlight--;
+    self->submitFrame();
 }
 
 void FCDevice::flush()
@@ -208,16 +635,7 @@ void FCDevice::flush()
 
         Transfer *fct = *current;
         if (fct->finished) {
-            switch (fct->type) {
-
-                case FRAME:
-                    mNumFramesPending--;
-                    break;
-
-                default:
-                    break;
-            }
-
+            countCompletion(fct->transfer, fct->completeTime - fct->submitTime);
             mPending.erase(current);
             delete fct;
         }
@@ -225,11 +643,8 @@ void FCDevice::flush()
         current = next;
     }
 
-    // Submit new frames, if we had a queued frame waiting
-
-    if (mFrameWaitingForSubmit && mNumFramesPending < MAX_FRAMES_PENDING) {
-        writeFramebuffer();
-    }
+    // Frames queued while the ring was idle
+    submitFrame();
 }
 
 void FCDevice::writeColorCorrection(const Value &color)
@@ -362,22 +777,38 @@ void FCDevice::writeColorCorrection(const Value &color)
 void FCDevice::writeFramebuffer()
 {
     /*
-     * Asynchronously write the current framebuffer.
+     * Hand a snapshot of the current framebuffer to the shard's USB thread. This never
+     * blocks and never calls into libusb. The next flush() or completion submits it.
+     *
+     * If this gets ahead of what the USB device is capable of, the older frame is
+     * dropped. Clients that subscribe to flow control can see this happening, and
+     * slow down to the frame interval we measure in countFrameCompletion().
      *
-     * TODO: Currently if this gets ahead of what the USB device is capable of,
-     *       we always drop frames. Alternatively, it would be nice to have end-to-end
-     *       flow control so that the client can produce frames slower.
+     * Clients often keep sending at full rate while nothing changes. With a keepalive
+     * configured, frames that match the last one we queued are skipped until it runs out.
      */
 
-    if (mNumFramesPending >= MAX_FRAMES_PENDING) {
-        // Too many outstanding frames. Wait to submit until a previous frame completes.
-        mFrameWaitingForSubmit = true;
-        return;
+    if (mKeepalive) {
+        uint64_t now = Metrics::now();
+        if (mLastQueuedAt && now - mLastQueuedAt < mKeepalive &&
+            !memcmp(mLastQueued, mFramebuffer, sizeof mFramebuffer)) {
+            mStats.framesUnchanged.add();
+            return;
+        }
+        memcpy(mLastQueued, mFramebuffer, sizeof mFramebuffer);
+        mLastQueuedAt = now;
     }
 
-    if (submitTransfer(new Transfer(this, &mFramebuffer, sizeof mFramebuffer, FRAME))) {
-        mFrameWaitingForSubmit = false;
-        mNumFramesPending++;
+    memcpy(mFrameSlot.back()->packets, mFramebuffer, sizeof mFramebuffer);
+    #ifdef FCSERVER_TRACE
+        mFrameSlot.back()->mappedAt = Metrics::now();
+        mFrameSlot.back()->number = uint32_t(mStats.framesMapped.get());
+    #endif
+    mStats.framesMapped.add();
+
+    if (mFrameSlot.publish()) {
+        // The USB thread never saw the previous frame
+        mStats.framesSuperseded.add();
     }
 }
 
@@ -458,10 +889,13 @@ void FCDevice::writeMessage(const OPC::Message &msg)
 
     switch (msg.command) {
 
-        case OPC::SetPixelColors:
+        case OPC::SetPixelColors: {
+            TRACE_SCOPE("map", mTraceLane, "frame", uint32_t(mStats.framesMapped.get()));
+            mStats.framesReceived.add();
             opcSetPixelColors(msg);
             writeFramebuffer();
             return;
+        }
 
         case OPC::SystemExclusive:
             opcSysEx(msg);
@@ -482,12 +916,7 @@ void FCDevice::opcSysEx(const OPC::Message &msg)
         return;
     }
 
-    unsigned id = (unsigned(msg.data[0]) << 24) |
-                  (unsigned(msg.data[1]) << 16) |
-                  (unsigned(msg.data[2]) << 8)  |
-                   unsigned(msg.data[3])        ;
-
-    switch (id) {
+    switch (msg.sysExID()) {
 
         case OPC::FCSetGlobalColorCorrection:
             return opcSetGlobalColorCorrection(msg);
@@ -503,150 +932,60 @@ void FCDevice::opcSysEx(const OPC::Message &msg)
 void FCDevice::opcSetPixelColors(const OPC::Message &msg)
 {
     /*
-     * Parse through our device's mapping, and store any relevant portions of 'msg'
-     * in the framebuffer.
+     * Run through the part of our compiled mapping that reads from this message's
+     * channel, and store the relevant portions of 'msg' in the framebuffer.
      */
 
-    if (!mConfigMap) {
-        // No mapping defined yet. This device is inactive.
-        return;
-    }
-
-    const Value &map = *mConfigMap;
-    for (unsigned i = 0, e = map.Size(); i != e; i++) {
-        opcMapPixelColors(msg, map[i]);
+    for (PixelMap::iterator i = mMap.channelBegin(msg.channel), e = mMap.channelEnd(msg.channel); i != e; ++i) {
+        opcMapPixelColors(msg, *i);
     }
 }
 
-void FCDevice::opcMapPixelColors(const OPC::Message &msg, const Value &inst)
+void FCDevice::opcMapPixelColors(const OPC::Message &msg, const PixelMap::Op &op)
 {
     /*
-     * Parse one JSON mapping instruction, and copy any relevant parts of 'msg'
-     * into our framebuffer. This looks for any mapping instructions that we
-     * recognize:
-     *
-     *   [ OPC Channel, First OPC Pixel, First output pixel, Pixel count ]
-     *   [ OPC Channel, First OPC Pixel, First output pixel, Color channels ]
+     * Copy one compiled mapping operation's worth of 'msg' into our framebuffer.
+     * Output clamping was done when the map was compiled, so all that's left is
+     * to clamp against the length of this particular message.
      */
 
-    unsigned msgPixelCount = msg.length() / 3;
-
-    if (inst.IsArray() && inst.Size() == 4) {
-        // Map a range from an OPC channel to our framebuffer
-
-        const Value &vChannel = inst[0u];
-        const Value &vFirstOPC = inst[1];
-        const Value &vFirstOut = inst[2];
-        const Value &vCount = inst[3];
-
-        if (vChannel.IsUint() && vFirstOPC.IsUint() && vFirstOut.IsUint() && vCount.IsInt()) {
-            unsigned channel = vChannel.GetUint();
-            unsigned firstOPC = vFirstOPC.GetUint();
-            unsigned firstOut = vFirstOut.GetUint();
-            unsigned count;
-            int direction;
-            if (vCount.GetInt() >= 0) {
-                count = vCount.GetInt();
-                direction = 1;
-            } else {
-                count = -vCount.GetInt();
-                direction = -1;
-            }
+    unsigned count = PixelMap::inputCount(op, msg.length() / 3);
+    const uint8_t *inPtr = msg.data + (op.firstOPC * 3);
+    unsigned outIndex = op.firstOut;
 
-            if (channel != msg.channel) {
-                return;
-            }
+    switch (op.type) {
 
-            // Clamping, overflow-safe
-            firstOPC = std::min<unsigned>(firstOPC, msgPixelCount);
-            firstOut = std::min<unsigned>(firstOut, unsigned(NUM_PIXELS));
-            count = std::min<unsigned>(count, msgPixelCount - firstOPC);
-            count = std::min<unsigned>(count,
-                    direction > 0 ? NUM_PIXELS - firstOut : firstOut + 1);
+        case PixelMap::COPY:
+            // Copy whole spans of each USB packet at once
+            while (count) {
+                unsigned span = std::min<unsigned>(count, PIXELS_PER_PACKET - (outIndex % PIXELS_PER_PACKET));
+                memcpy(fbPixel(outIndex), inPtr, span * 3);
+                outIndex += span;
+                inPtr += span * 3;
+                count -= span;
+            }
+            break;
 
-            // Copy pixels
-            const uint8_t *inPtr = msg.data + (firstOPC * 3);
-            unsigned outIndex = firstOut;
+        case PixelMap::COPY_REVERSE:
             while (count--) {
-                uint8_t *outPtr = fbPixel(outIndex);
-                outIndex += direction;
+                uint8_t *outPtr = fbPixel(outIndex--);
                 outPtr[0] = inPtr[0];
                 outPtr[1] = inPtr[1];
                 outPtr[2] = inPtr[2];
                 inPtr += 3;
             }
+            break;
 
-            return;
-        }
-    }
-
-    if (inst.IsArray() && inst.Size() == 5) {
-        // Map a range from an OPC channel to our framebuffer, with color channel swizzling
-
-        const Value &vChannel = inst[0u];
-        const Value &vFirstOPC = inst[1];
-        const Value &vFirstOut = inst[2];
-        const Value &vCount = inst[3];
-        const Value &vColorChannels = inst[4];
-
-        if (vChannel.IsUint() && vFirstOPC.IsUint() && vFirstOut.IsUint() && vCount.IsInt()
-            && vColorChannels.IsString() && vColorChannels.GetStringLength() == 3) {
-
-            unsigned channel = vChannel.GetUint();
-            unsigned firstOPC = vFirstOPC.GetUint();
-            unsigned firstOut = vFirstOut.GetUint();
-            unsigned count;
-            int direction;
-            if (vCount.GetInt() >= 0) {
-                count = vCount.GetInt();
-                direction = 1;
-            } else {
-                count = -vCount.GetInt();
-                direction = -1;
-            }
-            const char *colorChannels = vColorChannels.GetString();
-
-            if (channel != msg.channel) {
-                return;
-            }
-
-            // Clamping, overflow-safe
-            firstOPC = std::min<unsigned>(firstOPC, msgPixelCount);
-            firstOut = std::min<unsigned>(firstOut, unsigned(NUM_PIXELS));
-            count = std::min<unsigned>(count, msgPixelCount - firstOPC);
-            count = std::min<unsigned>(count,
-                    direction > 0 ? NUM_PIXELS - firstOut : firstOut + 1);
-
-            // Copy pixels
-            const uint8_t *inPtr = msg.data + (firstOPC * 3);
-            unsigned outIndex = firstOut;
-            bool success = true;
+        case PixelMap::SWIZZLE:
             while (count--) {
                 uint8_t *outPtr = fbPixel(outIndex);
-                outIndex += direction;
-
-                for (int channel = 0; channel < 3; channel++) {
-                    if (!OPC::pickColorChannel(outPtr[channel], colorChannels[channel], inPtr)) {
-                        success = false;
-                        break;
-                    }
-                }
-
+                outIndex += op.direction;
+                outPtr[0] = PixelMap::pickColor(op.colors[0], inPtr);
+                outPtr[1] = PixelMap::pickColor(op.colors[1], inPtr);
+                outPtr[2] = PixelMap::pickColor(op.colors[2], inPtr);
                 inPtr += 3;
             }
-
-            if (success) {
-                return;
-            }
-        }
-    }
-
-    // Still haven't found a match?
-    if (mVerbose) {
-        rapidjson::GenericStringBuffer<rapidjson::UTF8<> > buffer;
-        rapidjson::Writer<rapidjson::GenericStringBuffer<rapidjson::UTF8<> > > writer(buffer);
-        inst.Accept(writer);
-        std::clog << "Unsupported JSON mapping instruction: " << buffer.GetString() << "\n";
+            break;
     }
 }
 
@@ -710,4 +1049,10 @@ void FCDevice::describe(rapidjson::Value &object, Allocator &alloc)
     USBDevice::describe(object, alloc);
     object.AddMember("version", mVersionString, alloc);
     object.AddMember("bcd_version", mDD.bcdDevice, alloc);
+
+    // Frame pipelining, with times in microseconds
+    object.AddMember("frame_window", mWindow, alloc);
+    object.AddMember("frame_latency", mLatencyAvg, alloc);
+    object.AddMember("frame_latency_min", mLatencyMin, alloc);
+    object.AddMember("frame_interval", getFrameInterval(), alloc);
 }
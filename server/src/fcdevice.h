@@ -24,6 +24,7 @@
 #pragma once
 #include "usbdevice.h"
 #include "opc.h"
+#include "frameslot.h"
 #include <set>
 
 
@@ -46,7 +47,7 @@ public:
 
     static const unsigned NUM_PIXELS = 512;
 
-    // Send current buffer contents
+    // Queue the current buffer contents. flush(), or the next completion, sends the newest queued frame.
     void writeFramebuffer();
 
     // Framebuffer accessor
@@ -61,7 +62,24 @@ private:
     static const unsigned LUT_PACKETS = 25;
     static const unsigned LUT_ENTRIES = 257;
     static const unsigned OUT_ENDPOINT = 1;
-    static const unsigned MAX_FRAMES_PENDING = 2;
+    static const unsigned MAX_FRAMES_PENDING = 8;      // Ring size, and the largest window
+    static const unsigned DEFAULT_WINDOW = 2;
+    static const unsigned WINDOW_EPOCH = 4;             // Windows' worth of frames between adjustments
+    static const unsigned WINDOW_CALM_EPOCHS = 4;       // Epochs without starving before we try shrinking
+
+    // Resend an unchanged frame after this long, by default (milliseconds). Zero sends every frame.
+    static const unsigned DEFAULT_KEEPALIVE = 0;
+
+    /*
+     * USB transfer timeouts (milliseconds). Frames time out after a few times the worst
+     * latency we'd expect from what we've measured, so a hung device is noticed quickly.
+     * Everything else, and frames before the first measurement, get the fixed timeout.
+     */
+    static const unsigned TRANSFER_TIMEOUT = 2000;
+    static const unsigned MIN_FRAME_TIMEOUT = 100;
+
+    // First firmware that copies unsent framebuffer packets forward from the previous frame
+    static const unsigned FIRST_DELTA_FIRMWARE = 0x0110;
 
     static const uint8_t TYPE_FRAMEBUFFER = 0x00;
     static const uint8_t TYPE_LUT = 0x40;
@@ -78,26 +96,128 @@ private:
         uint8_t data[63];
     };
 
-    enum PacketType {
-        OTHER = 0,
-        FRAME,
+    struct Frame {
+        Packet packets[FRAMEBUFFER_PACKETS];
+        #ifdef FCSERVER_TRACE
+          uint64_t mappedAt;    // Not sent. Starts the "queued" span.
+          uint32_t number;
+        #endif
+    };
+
+    /*
+     * With HAVE_USB_DEV_MEM, transfer buffers come from memory that usbfs shares with
+     * the kernel, if it'll give us any. Freeing them takes the device handle, so the
+     * handle stays open until the last buffer is gone, even if that's after we are.
+     * Only touched with the shard lock held, or before the device is published.
+     */
+    struct HandleRef {
+        libusb_device_handle *handle;
+        unsigned refs;
     };
 
     struct Transfer {
-        Transfer(FCDevice *device, void *buffer, int length, PacketType type = OTHER);
+        Transfer(FCDevice *device, void *buffer, int length);
         ~Transfer();
         libusb_transfer *transfer;
         #if NEED_COPY_USB_TRANSFER_BUFFER
           void *bufferCopy;
         #endif
-        PacketType type;
+        #if HAVE_USB_DEV_MEM
+          HandleRef *devMemHandle;      // Zero if the buffer isn't shared with the kernel
+          uint8_t *devMem;
+        #endif
         bool finished;
+        bool orphaned;                  // Freed on completion, since the device is gone
+        uint64_t submitTime;
+        uint64_t completeTime;
     };
 
-    const Value *mConfigMap;
+    /*
+     * Frames go out through a fixed ring of transfers, allocated once per device.
+     * When one completes, its callback sends the next queued frame right away.
+     * A transfer that's still in flight when the device goes away is orphaned,
+     * and frees itself on completion.
+     */
+    struct FrameTransfer {
+        FrameTransfer(FCDevice *device);
+        ~FrameTransfer();
+        libusb_transfer *transfer;
+        FCDevice *device;       // Zero once orphaned
+        bool inFlight;
+        bool heldBack;          // Waited for the window before it was submitted
+        bool whole;             // Every packet was sent, not just a delta
+        uint32_t generation;    // mDeltaGeneration when it was packed
+        uint64_t submitTime;
+        #ifdef FCSERVER_TRACE
+          uint32_t frameNumber;
+        #endif
+        #if HAVE_USB_DEV_MEM
+          HandleRef *devMemHandle;
+          Frame *devMem;        // Used instead of 'buffer' when we have it
+        #endif
+        Frame buffer;           // Packed delta frames, or a copy where the USB buffer stays mapped
+    };
+
+    /*
+     * With firmware that supports it, frames only include the packets that changed since
+     * the last frame we sent, plus the final packet. After a failed transfer we don't
+     * know what the firmware has, and frames already in flight were packed against it,
+     * so each failure starts a new generation. Frames go out whole until one packed in
+     * the current generation completes. Only touched by the USB thread.
+     */
+    bool mDeltaFrames;
+    bool mDeltaSynced;
+    uint32_t mDeltaGeneration;
+    Frame mLastSent;
+
     std::set<Transfer*> mPending;
-    int mNumFramesPending;
-    bool mFrameWaitingForSubmit;
+    FrameTransfer *mFrameRing[MAX_FRAMES_PENDING];
+    unsigned mNextFrame;
+
+    /*
+     * How many frames may be in flight at once. More keeps the device busy when
+     * completions are slow to reach us, fewer keeps latency down. The window adapts
+     * between 1 and mMaxWindow, aiming for a latency budget if there is one and for
+     * throughput otherwise. See adjustWindow(). USB thread only.
+     */
+    unsigned mWindow;
+    unsigned mMaxWindow;
+    unsigned mInFlight;
+    uint64_t mLatencyBudget;        // Microseconds, or zero
+    bool mWaitingForWindow;         // A queued frame was held back by the window
+
+    // Completion latency in microseconds: moving average, mean deviation, lowest average
+    uint32_t mLatencyAvg;
+    uint32_t mLatencyDev;
+    uint32_t mLatencyMin;
+
+    // Since the last adjustment
+    unsigned mEpochCompletions;
+    unsigned mEpochStarved;
+    unsigned mCalmEpochs;
+
+    /*
+     * Frames travel from the network thread to the USB thread through this slot.
+     * mFramebuffer is the network thread's working copy, and it's only ever
+     * touched by the thread that maps OPC messages.
+     */
+    FrameSlot<Frame> mFrameSlot;
+
+    /*
+     * With a keepalive interval, frames identical to the last one queued are skipped
+     * until it runs out. The firmware interpolates over the time between keyframes, so
+     * the keepalive also limits how slowly it fades into the next change. That's why
+     * it's off unless configured. Network thread only, like mFramebuffer.
+     */
+    uint64_t mKeepalive;        // Microseconds, zero to send every frame
+    uint64_t mLastQueuedAt;     // Zero if nothing's been queued yet
+    Packet mLastQueued[FRAMEBUFFER_PACKETS];
+
+#if HAVE_USB_DEV_MEM
+    HandleRef *mDevMemHandle;   // Zero if we couldn't get shared memory for the frame ring
+    void allocDevMem();
+    static void releaseDevMem(HandleRef *ref, void *buffer, size_t length);
+#endif
 
     char mSerialBuffer[256];
     char mVersionString[10];
@@ -108,14 +228,21 @@ private:
     Packet mFirmwareConfig;
 
     bool submitTransfer(Transfer *fct);
+    bool submitFrame();
+    unsigned packDirtyPackets(const Frame &frame, Packet *out);
+    void deltaFailed();
+    bool ranDry(uint64_t now) const;
+    void adjustWindow(uint64_t latency, bool idled);
+    unsigned frameTimeout() const;
     void writeFirmwareConfiguration();
     void writeFirmwareConfiguration(const Value &json);
     void writeDevicePixels(Document &msg);
     static LIBUSB_CALL void completeTransfer(libusb_transfer *transfer);
+    static LIBUSB_CALL void completeFrameTransfer(libusb_transfer *transfer);
 
     void opcSetPixelColors(const OPC::Message &msg);
     void opcSysEx(const OPC::Message &msg);
     void opcSetGlobalColorCorrection(const OPC::Message &msg);
     void opcSetFirmwareConfiguration(const OPC::Message &msg);
-    void opcMapPixelColors(const OPC::Message &msg, const Value &inst);
+    void opcMapPixelColors(const OPC::Message &msg, const PixelMap::Op &op);
 };
@@ -26,25 +26,46 @@
 #include "apa102spidevice.h"
 #include "fcdevice.h"
 #include "version.h"
+#include "trace.h"
 #include "enttecdmxdevice.h"
 #include <ctype.h>
 #include <iostream>
+#include <algorithm>
 
 #ifdef FCSERVER_HAS_WIRINGPI
 #include <wiringPi.h>
 #endif
 
+// Below this many pixels, splitting a message across threads costs more than it saves
+static const unsigned kDefaultMapThreshold = 2048;
+
+// Devices that can be opening at once. Most of the time is spent waiting on USB.
+static const unsigned kOpenThreads = 4;
+
 FCServer::FCServer(rapidjson::Document &config)
     : mConfig(config),
       mListen(config["listen"]),
       mRelay(config["relay"]),
+      mListenUnix(config["listen_unix"]),
+      mUDP(config["udp"]),
+      mShm(config["shm"]),
       mColor(config["color"]),
       mDevices(config["devices"]),
       mVerbose(config["verbose"].IsTrue()),
       mPollForDevicesOnce(false),
-      mTcpNetServer(cbOpcMessage, cbJsonMessage, this, mVerbose),
+      mRecoveryPending(false),
+      mMapThreads(0),
+      mMapThreshold(kDefaultMapThreshold),
+      mUSBThreads(1),
+      mTcpNetServer(cbOpcMessage, cbJsonMessage, cbMetrics, cbFlow, this, mVerbose),
       mUSBHotplugThread(0),
-      mUSB(0)
+      mUSB(0),
+      mStartTime(0),
+      mStartupTime(0),
+      mRoutes(new RouteTable),
+      mRouteReaders(0),
+      mStreamDispatch(false),
+      mFramesStreamed(0)
 {
     /*
      * Validate the listen [host, port] list.
@@ -91,6 +112,116 @@ FCServer::FCServer(rapidjson::Document &config)
         mError << "The optional 'relay' configuration key must be a [host, post] list.\n";
     }
 
+    /*
+     * Validate the Unix domain socket path, or {path, users} object.
+     */
+
+    if (mListenUnix.IsObject()) {
+        const Value &path = mListenUnix["path"];
+        const Value &users = mListenUnix["users"];
+
+        if (!path.IsString() || !path.GetString()[0]) {
+            mError << "The 'listen_unix' path must be a non-empty string.\n";
+        }
+
+        if (users.IsArray()) {
+            for (unsigned i = 0; i < users.Size(); i++) {
+                if (!users[i].IsUint()) {
+                    mError << "The 'listen_unix' users must be numeric user IDs.\n";
+                    break;
+                }
+            }
+        } else if (!users.IsNull()) {
+            mError << "The 'listen_unix' users must be a list.\n";
+        }
+    }
+    else if (!(mListenUnix.IsString() && mListenUnix.GetString()[0]) && !mListenUnix.IsNull()) {
+        mError << "The optional 'listen_unix' configuration key must be a path string or an object.\n";
+    }
+
+    /*
+     * Validate the UDP [host, port] list.
+     */
+
+    if (mUDP.IsArray() && mUDP.Size() == 2) {
+        const Value &host = mUDP[0u];
+        const Value &port = mUDP[1];
+
+        if (!host.IsString() && !host.IsNull()) {
+            mError << "Hostname in 'udp' must be null (any) or a hostname string.\n";
+        }
+
+        if (!port.IsUint()) {
+            mError << "The 'udp' port must be an integer.\n";
+        }
+    }
+    else if (!mUDP.IsNull()) {
+        mError << "The optional 'udp' configuration key must be a [host, port] list.\n";
+    }
+
+    /*
+     * Validate the shared memory input settings
+     */
+
+    if (mShm.IsObject()) {
+        const Value &name = mShm["name"];
+        const Value &canvases = mShm["canvases"];
+
+        if (!name.IsString() || name.GetString()[0] != '/') {
+            mError << "The 'shm' name must be a string starting with '/'.\n";
+        }
+
+        if (!canvases.IsNull() && (!canvases.IsUint() || canvases.GetUint() < 1 || canvases.GetUint() > 256)) {
+            mError << "The 'shm' canvas count must be an integer from 1 to 256.\n";
+        }
+    }
+    else if (!mShm.IsNull()) {
+        mError << "The optional 'shm' configuration key must be an object.\n";
+    }
+
+    /*
+     * Optional parallel mapping settings
+     */
+
+    const Value &mapThreads = config["mapThreads"];
+    const Value &mapThreshold = config["mapThreshold"];
+
+    if (mapThreads.IsUint()) {
+        mMapThreads = mapThreads.GetUint();
+    } else if (!mapThreads.IsNull()) {
+        mError << "The optional 'mapThreads' configuration key must be an integer.\n";
+    }
+
+    if (mapThreshold.IsUint()) {
+        mMapThreshold = mapThreshold.GetUint();
+    } else if (!mapThreshold.IsNull()) {
+        mError << "The optional 'mapThreshold' configuration key must be an integer.\n";
+    }
+
+    /*
+     * Optional streaming dispatch
+     */
+
+    const Value &streamDispatch = config["streamDispatch"];
+
+    if (streamDispatch.IsBool()) {
+        mStreamDispatch = streamDispatch.IsTrue();
+    } else if (!streamDispatch.IsNull()) {
+        mError << "The optional 'streamDispatch' configuration key must be true or false.\n";
+    }
+
+    /*
+     * Optional number of USB service threads
+     */
+
+    const Value &usbThreads = config["usbThreads"];
+
+    if (usbThreads.IsUint()) {
+        mUSBThreads = std::max(1u, usbThreads.GetUint());
+    } else if (!usbThreads.IsNull()) {
+        mError << "The optional 'usbThreads' configuration key must be an integer.\n";
+    }
+
     /*
      * Minimal validation on 'devices'
      */
@@ -106,6 +237,13 @@ bool FCServer::start(libusb_context *usb)
     const Value &port = mListen[1];
     const char *hostStr = host.IsString() ? host.GetString() : NULL;
 
+    mStartTime = Metrics::now();
+    mMapPool.start(mMapThreads);
+
+    if (mStreamDispatch) {
+        mTcpNetServer.setStreamCallback(cbOpcStream);
+    }
+
     bool started = mTcpNetServer.start(hostStr, port.GetUint()) && startUSB(usb) && startSPI();
 
     if (started && !mRelay.IsNull()) {
@@ -115,6 +253,30 @@ bool FCServer::start(libusb_context *usb)
         mTcpNetServer.startRelay(relayHostStr, relayPort.GetUint());
     }
 
+    if (started && !mListenUnix.IsNull()) {
+        const char *path = mListenUnix.IsString() ? mListenUnix.GetString() : mListenUnix["path"].GetString();
+        std::vector<unsigned> users;
+        if (mListenUnix.IsObject() && mListenUnix["users"].IsArray()) {
+            const Value &list = mListenUnix["users"];
+            for (unsigned i = 0; i < list.Size(); i++) {
+                users.push_back(list[i].GetUint());
+            }
+        }
+        started = mTcpNetServer.startUnix(path, users);
+    }
+
+    if (started && !mUDP.IsNull()) {
+        const Value &udpHost = mUDP[0u];
+        const Value &udpPort = mUDP[1];
+        const char *udpHostStr = udpHost.IsString() ? udpHost.GetString() : NULL;
+        started = mTcpNetServer.startUDP(udpHostStr, udpPort.GetUint());
+    }
+
+    if (started && !mShm.IsNull()) {
+        const Value &canvases = mShm["canvases"];
+        started = mTcpNetServer.startShm(mShm["name"].GetString(), canvases.IsUint() ? canvases.GetUint() : 1);
+    }
+
     return started;
 }
 
@@ -122,6 +284,24 @@ bool FCServer::startUSB(libusb_context *usb)
 {
     mUSB = usb;
 
+    // Shard 0 shares our context and runs on the main loop. The rest get their own.
+    for (unsigned i = 0; i < mUSBThreads; i++) {
+        USBShard *shard = new USBShard(i, mLoopTime, cbRecovery, this);
+        if (!shard->init(i ? 0 : mUSB)) {
+            delete shard;
+            return false;
+        }
+        if (i) {
+            shard->startThread();
+        }
+        mShards.push_back(shard);
+        mShardLoad.push_back(0);
+    }
+
+    for (unsigned i = 0; i < kOpenThreads; i++) {
+        mOpenThreads.push_back(new tthread::thread(usbOpenThreadFunc, this));
+    }
+
     // Enumerate all attached devices, and get notified of hotplug events
     libusb_hotplug_register_callback(mUSB,
         libusb_hotplug_event(LIBUSB_HOTPLUG_EVENT_DEVICE_ARRIVED |
@@ -134,6 +314,7 @@ bool FCServer::startUSB(libusb_context *usb)
 
     // On platforms without real USB hotplug, emulate it with a polling thread
     if (!libusb_has_capability(LIBUSB_CAP_HAS_HOTPLUG)) {
+        usbHotplugPoll();
         mUSBHotplugThread = new tthread::thread(usbHotplugThreadFunc, this);
     }
 
@@ -143,63 +324,364 @@ bool FCServer::startUSB(libusb_context *usb)
 void FCServer::cbOpcMessage(OPC::Message &msg, void *context)
 {
     /*
-     * Broadcast the OPC message to all configured devices.
+     * Dispatch an OPC message to the devices that need it. Pixel data only goes to
+     * devices whose maps read from the message's channel. Everything else, like
+     * SysEx, is broadcast to all devices as before.
+     *
+     * Pixel data is the hot path, and it doesn't take mEventMutex. USB devices just
+     * queue a frame, and their shard submits it. Other commands are rare, and they
+     * may need to talk to libusb, so they still run with the locks held.
      */
 
     FCServer *self = static_cast<FCServer*>(context);
-    self->mEventMutex.lock();
 
-    for (std::vector<USBDevice*>::iterator i = self->mUSBDevices.begin(), e = self->mUSBDevices.end(); i != e; ++i) {
-        USBDevice *dev = *i;
-        dev->writeMessage(msg);
+    if (msg.command == OPC::SetPixelColors) {
+        self->dispatchPixels(msg, 0);
+
+    } else {
+        self->mEventMutex.lock();
+
+        for (std::vector<USBShard*>::iterator s = self->mShards.begin(), se = self->mShards.end(); s != se; ++s) {
+            USBShard *shard = *s;
+            tthread::lock_guard<tthread::recursive_mutex> lock(shard->getMutex());
+            const std::vector<USBDevice*> &devices = shard->getDevices();
+
+            for (std::vector<USBDevice*>::const_iterator i = devices.begin(), e = devices.end(); i != e; ++i) {
+                USBDevice *dev = *i;
+                dev->writeMessage(msg);
+            }
+            shard->wake();
+        }
+
+        for (std::vector<SPIDevice*>::iterator i = self->mSPIDevices.begin(), e = self->mSPIDevices.end(); i != e; ++i) {
+            SPIDevice *dev = *i;
+            dev->writeMessage(msg);
+        }
+
+        self->mEventMutex.unlock();
     }
 
-    for (std::vector<SPIDevice*>::iterator i = self->mSPIDevices.begin(), e = self->mSPIDevices.end(); i != e; ++i) {
+    // also forward the message to clients connected on the relay socket
+    self->mTcpNetServer.relayMessage(msg);
+}
+
+void FCServer::cbOpcStream(OPC::Message &msg, unsigned done, unsigned ready, bool complete, void *context)
+{
+    /*
+     * A pixel message is arriving a piece at a time. Each USB device is mapped as soon
+     * as every pixel it reads is in, so its frame can go out over USB while the rest of
+     * the message is still on the network. The devices still waiting when the message
+     * completes are handled like any other message, along with SPI and the relay.
+     *
+     * Devices only ever read pixels below their input end, so they see exactly what
+     * they would have from the complete message.
+     */
+
+    FCServer *self = static_cast<FCServer*>(context);
+
+    if (complete) {
+        self->dispatchPixels(msg, done);
+        self->mTcpNetServer.relayMessage(msg);
+        return;
+    }
+
+    TRACE_SCOPE("stream", Trace::LANE_NETWORK, "pixels", ready);
+    self->mRouteReaders.fetch_add(1);
+    const ChannelRoutes &routes = self->mRoutes.load()->channels[msg.channel];
+
+    unsigned first = firstUnmapped(routes, done);
+    unsigned last = firstUnmapped(routes, ready);
+
+    if (first < last) {
+        self->mapDevices(routes, msg, first, last);
+        self->mFramesStreamed += last - first;
+
+        for (std::vector<USBShard*>::const_iterator i = routes.shards.begin(), e = routes.shards.end(); i != e; ++i) {
+            USBShard *shard = *i;
+            shard->wake();
+        }
+    }
+
+    self->mRouteReaders.fetch_sub(1, std::memory_order_release);
+}
+
+unsigned FCServer::firstUnmapped(const ChannelRoutes &routes, unsigned done)
+{
+    // Index of the first USB device that needs more than 'done' pixels. Before
+    // streaming starts, that's all of them, even ones that read no pixels at all.
+    if (!done) {
+        return 0;
+    }
+    return std::upper_bound(routes.usbInputEnd.begin(), routes.usbInputEnd.end(), done) - routes.usbInputEnd.begin();
+}
+
+void FCServer::dispatchPixels(OPC::Message &msg, unsigned done)
+{
+    // Pixel data for every device on the message's channel, except USB devices that
+    // already have it from streaming dispatch.
+
+    TRACE_SCOPE("dispatch", Trace::LANE_NETWORK, "channel", msg.channel);
+    mRouteReaders.fetch_add(1);
+    const ChannelRoutes &routes = mRoutes.load()->channels[msg.channel];
+
+    mapDevices(routes, msg, firstUnmapped(routes, done), routes.usb.size());
+
+    for (std::vector<SPIDevice*>::const_iterator i = routes.spi.begin(), e = routes.spi.end(); i != e; ++i) {
         SPIDevice *dev = *i;
         dev->writeMessage(msg);
     }
 
-    self->mEventMutex.unlock();
+    // Only the shards with newly queued frames need to wake up
+    for (std::vector<USBShard*>::const_iterator i = routes.shards.begin(), e = routes.shards.end(); i != e; ++i) {
+        USBShard *shard = *i;
+        shard->wake();
+    }
 
-    // also forward the message to clients connected on the relay socket
-    self->mTcpNetServer.relayMessage(msg);
+    mRouteReaders.fetch_sub(1, std::memory_order_release);
+}
+
+void FCServer::mapDevices(const ChannelRoutes &routes, const OPC::Message &msg, unsigned first, unsigned last)
+{
+    if (last - first > 1 && msg.length() / 3 >= mMapThreshold) {
+        // Big message for many devices. Split the devices up among the map threads.
+        MapJob job = { &msg, &routes.usb[first] };
+        mMapPool.run(cbMapDevice, &job, last - first);
+
+    } else {
+        for (unsigned i = first; i < last; i++) {
+            routes.usb[i]->writeMessage(msg);
+        }
+    }
+}
+
+void FCServer::cbFlow(unsigned channel, TcpNetServer::FlowStatus &status, void *context)
+{
+    /*
+     * Flow control feedback for a client sending on this channel, on the network thread.
+     * The slowest device decides how fast frames are worth sending.
+     */
+
+    FCServer *self = static_cast<FCServer*>(context);
+
+    self->mRouteReaders.fetch_add(1);
+    const ChannelRoutes &routes = self->mRoutes.load()->channels[channel];
+
+    for (std::vector<USBDevice*>::const_iterator i = routes.usb.begin(), e = routes.usb.end(); i != e; ++i) {
+        USBDevice *dev = *i;
+        uint32_t interval = dev->getFrameInterval();
+
+        if (interval >= status.interval) {
+            status.interval = interval;
+            status.completed = dev->getStats().framesCompleted.get();
+            status.superseded = dev->getStats().framesSuperseded.get();
+        }
+    }
+
+    self->mRouteReaders.fetch_sub(1, std::memory_order_release);
+}
+
+void FCServer::cbMapDevice(void *context, unsigned index)
+{
+    MapJob *job = static_cast<MapJob*>(context);
+    job->devices[index]->writeMessage(*job->msg);
+}
+
+static bool compareInputEnd(const std::pair<unsigned, USBDevice*> &a, const std::pair<unsigned, USBDevice*> &b)
+{
+    return a.first < b.first;
+}
+
+void FCServer::rebuildRoutes()
+{
+    /*
+     * Rebuild the per-channel routing table from our device lists. Called with
+     * mEventMutex held, any time a device is added or removed. When this returns,
+     * the network thread is no longer using any device that isn't in our lists.
+     */
+
+    RouteTable *table = new RouteTable;
+
+    for (unsigned channel = 0; channel < PixelMap::NUM_CHANNELS; channel++) {
+        ChannelRoutes &routes = table->channels[channel];
+
+        // Sorted by input end, so streaming dispatch can find the devices a partial message covers
+        std::vector<std::pair<unsigned, USBDevice*> > usb;
+
+        for (std::vector<USBDevice*>::iterator i = mUSBDevices.begin(), e = mUSBDevices.end(); i != e; ++i) {
+            USBDevice *dev = *i;
+            if (dev->getMap().usesChannel(channel)) {
+                USBShard *shard = mUSBDeviceShards[dev];
+                usb.push_back(std::make_pair(dev->getMap().channelInputEnd(channel), dev));
+                if (std::find(routes.shards.begin(), routes.shards.end(), shard) == routes.shards.end()) {
+                    routes.shards.push_back(shard);
+                }
+            }
+        }
+
+        std::stable_sort(usb.begin(), usb.end(), compareInputEnd);
+        for (unsigned i = 0; i < usb.size(); i++) {
+            routes.usbInputEnd.push_back(usb[i].first);
+            routes.usb.push_back(usb[i].second);
+        }
+
+        for (std::vector<SPIDevice*>::iterator i = mSPIDevices.begin(), e = mSPIDevices.end(); i != e; ++i) {
+            SPIDevice *dev = *i;
+            if (dev->getMap().usesChannel(channel)) {
+                routes.spi.push_back(dev);
+            }
+        }
+    }
+
+    // Publish the new table, then wait for any message still using the old one.
+    RouteTable *old = mRoutes.exchange(table);
+    while (mRouteReaders.load()) {
+        tthread::this_thread::yield();
+    }
+    delete old;
 }
 
 int FCServer::cbHotplug(libusb_context *ctx, libusb_device *device, libusb_hotplug_event event, void *user_data)
 {
+    // Save it for handleHotplugEvents(). We may be holding shard 0's lock, and ours comes first.
+
     FCServer *self = static_cast<FCServer*>(user_data);
+    HotplugEvent hotplug = { libusb_ref_device(device), (event & LIBUSB_HOTPLUG_EVENT_DEVICE_ARRIVED) != 0 };
 
-    self->mEventMutex.lock();
+    self->mHotplugMutex.lock();
+    self->mHotplugEvents.push_back(hotplug);
+    self->mHotplugMutex.unlock();
+    self->mShards[0]->wake();
+
+    return false;
+}
+
+void FCServer::handleHotplugEvents()
+{
+    std::vector<HotplugEvent> events;
+
+    mHotplugMutex.lock();
+    events.swap(mHotplugEvents);
+    mHotplugMutex.unlock();
 
-    if (event & LIBUSB_HOTPLUG_EVENT_DEVICE_ARRIVED) {
-        self->usbDeviceArrived(device);
+    if (events.empty()) {
+        return;
     }
-    if (event & LIBUSB_HOTPLUG_EVENT_DEVICE_LEFT) {
-        self->usbDeviceLeft(device);
+
+    mEventMutex.lock();
+    for (std::vector<HotplugEvent>::iterator i = events.begin(), e = events.end(); i != e; ++i) {
+        if (i->arrived) {
+            usbDeviceArrived(i->device);
+        } else {
+            usbDeviceLeft(i->device);
+        }
+        libusb_unref_device(i->device);
     }
+    mEventMutex.unlock();
+}
 
-    self->mEventMutex.unlock();
-    return false;
+USBShard *FCServer::shardForNewDevice()
+{
+    // The shard with the fewest devices, counting ones still opening
+    unsigned best = 0;
+    for (unsigned i = 1; i < mShards.size(); i++) {
+        if (mShardLoad[i] < mShardLoad[best]) {
+            best = i;
+        }
+    }
+    return mShards[best];
 }
 
-void FCServer::usbDeviceArrived(libusb_device *device)
+void FCServer::checkStartupDone()
 {
     /*
-     * New USB device. Is this a device we recognize?
+     * Called with mEventMutex held. Startup is over once every device from the initial
+     * enumeration has been opened or given up on.
      */
 
-    USBDevice *dev;
+    if (mStartupTime.load() || !mOpening.empty()) {
+        return;
+    }
 
-    if (FCDevice::probe(device)) {
-        dev = new FCDevice(device, mVerbose);
+    uint64_t elapsed = std::max<uint64_t>(1, Metrics::now() - mStartTime);
+    mStartupTime = elapsed;
 
-    } else if (EnttecDMXDevice::probe(device)) {
-        dev = new EnttecDMXDevice(device, mVerbose);
+    if (mVerbose) {
+        std::clog << "Opened " << mUSBDevices.size() << " USB devices in " << (elapsed + 500) / 1000 << " ms.\n";
+    }
+}
 
-    } else {
+void FCServer::usbDeviceArrived(libusb_device *device, bool reset)
+{
+    /*
+     * New USB device. Is this a device we recognize? If so, pick a shard to own it,
+     * and leave the rest to an open thread. Called with mEventMutex held.
+     */
+
+    if (mOpening.count(device) || mUSBDevicesByHandle.count(device)) {
         return;
     }
 
+    bool isFadecandy = FCDevice::probe(device);
+    if (!isFadecandy && !EnttecDMXDevice::probe(device)) {
+        return;
+    }
+
+    USBShard *shard = shardForNewDevice();
+    mShardLoad[shard->getIndex()]++;
+    mOpening.insert(device);
+
+    OpenJob job = { libusb_ref_device(device), shard, isFadecandy, reset };
+
+    mOpenMutex.lock();
+    mOpenQueue.push_back(job);
+    mOpenReady.notify_one();
+    mOpenMutex.unlock();
+}
+
+void FCServer::usbOpenThreadFunc(void *arg)
+{
+    FCServer *self = static_cast<FCServer*>(arg);
+
+    for (;;) {
+        self->mOpenMutex.lock();
+        while (self->mOpenQueue.empty()) {
+            self->mOpenReady.wait(self->mOpenMutex);
+        }
+        OpenJob job = self->mOpenQueue.front();
+        self->mOpenQueue.pop_front();
+        self->mOpenMutex.unlock();
+
+        self->usbOpenDevice(job);
+    }
+}
+
+void FCServer::usbOpenDevice(const OpenJob &job)
+{
+    /*
+     * Open and configure a device on an open thread, without holding mEventMutex. Nobody
+     * else can see the device yet, except its shard, which handles completions for the
+     * transfers we submit here. The color LUT and firmware configuration are queued on
+     * the device's endpoint before it's published, so they reach it ahead of any frame.
+     *
+     * The device is opened through the context of the shard that's going to own it.
+     */
+
+    libusb_device *shardDevice = job.shard->findDevice(job.device);
+    if (!shardDevice) {
+        // Not visible from that context yet. Try again soon.
+        mPollForDevicesOnce = true;
+        usbOpenFinished(job, 0);
+        return;
+    }
+
+    USBDevice *dev;
+    if (job.isFadecandy) {
+        dev = new FCDevice(shardDevice, mVerbose);
+    } else {
+        dev = new EnttecDMXDevice(shardDevice, mVerbose);
+    }
+    libusb_unref_device(shardDevice);
+
     int r = dev->open();
     if (r < 0) {
         if (mVerbose) {
@@ -223,12 +705,27 @@ void FCServer::usbDeviceArrived(libusb_device *device)
             }
         }
         delete dev;
+        usbOpenFinished(job, 0);
         return;
     }
 
+    if (job.reset) {
+        r = dev->reset();
+        if (r == LIBUSB_ERROR_NOT_FOUND) {
+            // It's re-enumerating as a new device. Hotplug will bring it back.
+            delete dev;
+            usbOpenFinished(job, 0);
+            return;
+        }
+        if (r < 0 && mVerbose) {
+            std::clog << "Error resetting " << dev->getName() << ": " << libusb_strerror(libusb_error(r)) << "\n";
+        }
+    }
+
     if (!dev->probeAfterOpening()) {
         // We were mistaken, this device isn't actually one we want.
         delete dev;
+        usbOpenFinished(job, 0);
         return;
     }
 
@@ -238,12 +735,7 @@ void FCServer::usbDeviceArrived(libusb_device *device)
 
             dev->loadConfiguration(mDevices[i]);
             dev->writeColorCorrection(mColor);
-            mUSBDevices.push_back(dev);
-
-            if (mVerbose) {
-                std::clog << "USB device " << dev->getName() << " attached.\n";
-            }
-            jsonConnectedDevicesChanged();
+            usbOpenFinished(job, dev);
             return;
         }
     }
@@ -252,31 +744,146 @@ void FCServer::usbDeviceArrived(libusb_device *device)
         std::clog << "USB device " << dev->getName() << " has no matching configuration. Not using it.\n";
     }
     delete dev;
+    usbOpenFinished(job, 0);
 }
 
-void FCServer::usbDeviceLeft(libusb_device *device)
+void FCServer::usbOpenFinished(const OpenJob &job, USBDevice *dev)
 {
     /*
-     * Is this a device we recognize? If so, delete it.
+     * Publish a fully configured device, unless it left while we were opening it.
+     * With no device, the open failed or the device isn't one we want.
      */
 
-    for (std::vector<USBDevice*>::iterator i = mUSBDevices.begin(), e = mUSBDevices.end(); i != e; ++i) {
-        USBDevice *dev = *i;
-        if (dev->getDevice() == device) {
-            usbDeviceLeft(i);
-            break;
+    tthread::lock_guard<tthread::recursive_mutex> lock(mEventMutex);
+    bool stillAttached = mOpening.erase(job.device) != 0;
+
+    if (dev && stillAttached) {
+        USBShard *shard = job.shard;
+        const char *serial = dev->getSerial();
+
+        mUSBDevices.push_back(dev);
+        mUSBDevicesByHandle[job.device] = dev;
+        mUSBDevicesBySerial.insert(std::make_pair(std::string(serial ? serial : ""), dev));
+        mUSBDeviceShards[dev] = shard;
+
+        shard->getMutex().lock();
+        shard->addDevice(dev);
+        shard->getMutex().unlock();
+
+        rebuildRoutes();
+        shard->wake();
+
+        if (mVerbose) {
+            std::clog << "USB device " << dev->getName() << " attached";
+            if (mShards.size() > 1) {
+                std::clog << " to USB thread " << shard->getIndex();
+            }
+            std::clog << ".\n";
+        }
+#ifdef FCSERVER_TRACE
+        Trace::nameLane(dev->getTraceLane(), dev->getName());
+#endif
+        jsonConnectedDevicesChanged();
+
+    } else {
+        delete dev;
+        mShardLoad[job.shard->getIndex()]--;
+        libusb_unref_device(job.device);
+    }
+
+    if (mPollForDevicesOnce) {
+        // The main loop only schedules the retry when it wakes
+        mShards[0]->wake();
+    }
+
+    checkStartupDone();
+}
+
+void FCServer::cbRecovery(USBDevice *dev, void *context)
+{
+    // On a USB thread. The main loop takes it from here, once it has our lock.
+    FCServer *self = static_cast<FCServer*>(context);
+    if (!self->mRecoveryPending.exchange(true)) {
+        self->mShards[0]->wake();
+    }
+}
+
+void FCServer::usbRecoverDevices()
+{
+    /*
+     * Devices whose transfers keep timing out are dropped, then opened again like new
+     * ones, with a USB reset in between. Frames for them are discarded until they're
+     * back, while every other device carries on as usual.
+     */
+
+    tthread::lock_guard<tthread::recursive_mutex> lock(mEventMutex);
+    std::vector<libusb_device*> stalled;
+
+    for (std::unordered_map<libusb_device*, USBDevice*>::iterator i = mUSBDevicesByHandle.begin(),
+        e = mUSBDevicesByHandle.end(); i != e; ++i) {
+        if (i->second->needsRecovery()) {
+            if (mVerbose) {
+                std::clog << "Resetting stalled USB device " << i->second->getName() << ".\n";
+            }
+            stalled.push_back(libusb_ref_device(i->first));
         }
     }
+
+    for (std::vector<libusb_device*>::iterator i = stalled.begin(), e = stalled.end(); i != e; ++i) {
+        usbDeviceLeft(*i);
+        usbDeviceArrived(*i, true);
+        libusb_unref_device(*i);
+    }
 }
 
-void FCServer::usbDeviceLeft(std::vector<USBDevice*>::iterator iter)
+void FCServer::usbDeviceLeft(libusb_device *device)
 {
-    USBDevice *dev = *iter;
+    /*
+     * Is this a device we recognize? If so, delete it. Once the new routes are up,
+     * the network thread is done with it, and once it's out of its shard, so is
+     * the USB thread.
+     */
+
+    if (mOpening.erase(device)) {
+        // Still opening. Its open thread will let go of it.
+        return;
+    }
+
+    std::unordered_map<libusb_device*, USBDevice*>::iterator found = mUSBDevicesByHandle.find(device);
+    if (found == mUSBDevicesByHandle.end()) {
+        return;
+    }
+
+    libusb_device *handle = found->first;
+    USBDevice *dev = found->second;
+    USBShard *shard = mUSBDeviceShards[dev];
+
     if (mVerbose) {
         std::clog << "USB device " << dev->getName() << " removed.\n";
     }
-    mUSBDevices.erase(iter);
+
+    const char *serial = dev->getSerial();
+    typedef std::unordered_multimap<std::string, USBDevice*>::iterator serialIter_t;
+    std::pair<serialIter_t, serialIter_t> range = mUSBDevicesBySerial.equal_range(serial ? serial : "");
+    for (serialIter_t i = range.first; i != range.second; ++i) {
+        if (i->second == dev) {
+            mUSBDevicesBySerial.erase(i);
+            break;
+        }
+    }
+
+    mUSBDevicesByHandle.erase(found);
+    mUSBDeviceShards.erase(dev);
+    mShardLoad[shard->getIndex()]--;
+    mUSBDevices.erase(std::find(mUSBDevices.begin(), mUSBDevices.end(), dev));
+    rebuildRoutes();
+
+    shard->getMutex().lock();
+    shard->removeDevice(dev);
     delete dev;
+    shard->getMutex().unlock();
+
+    libusb_unref_device(handle);
     jsonConnectedDevicesChanged();
 }
 
@@ -330,7 +937,11 @@ void FCServer::openAPA102SPIDevice(uint32_t port, int numLights)
 
             dev->loadConfiguration(mDevices[i]);
             dev->writeColorCorrection(mColor);
+
+            mEventMutex.lock();
             mSPIDevices.push_back(dev);
+            rebuildRoutes();
+            mEventMutex.unlock();
 
             if (mVerbose) {
                 std::clog << "SPI device " << dev->getName() << " attached.\n";
@@ -341,32 +952,52 @@ void FCServer::openAPA102SPIDevice(uint32_t port, int numLights)
     }
 }
 
+void FCServer::wakeShards()
+{
+    // Called from any thread after queueing work that could be for any device
+    for (std::vector<USBShard*>::iterator i = mShards.begin(), e = mShards.end(); i != e; ++i) {
+        USBShard *shard = *i;
+        shard->wake();
+    }
+}
+
 void FCServer::mainLoop()
 {
+    // Shard 0 runs here. It also owns hotplug, stall recovery, and retries for devices that failed to open.
+    USBShard *shard = mShards[0];
+
+    // Start opening the devices that were already attached, or notice that there are none
+    handleHotplugEvents();
+    mEventMutex.lock();
+    checkStartupDone();
+    mEventMutex.unlock();
+
+    // Retries are at least this far apart, in microseconds
+    const uint64_t retryInterval = 100000;
+    uint64_t lastPoll = 0;
+
     for (;;) {
-        struct timeval timeout;
-        timeout.tv_sec = 0;
-        timeout.tv_usec = 100000;
+        int timeoutMS = -1;
+        if (mPollForDevicesOnce) {
+            uint64_t sincePoll = Metrics::now() - lastPoll;
+            timeoutMS = sincePoll >= retryInterval ? 0 : (retryInterval - sincePoll + 999) / 1000;
+        }
 
-        int err = libusb_handle_events_timeout_completed(mUSB, &timeout, 0);
-        if (err) {
-            std::clog << "Error handling USB events: " << libusb_strerror(libusb_error(err)) << "\n";
-            // Sometimes this happens on Windows during normal operation if we're queueing a lot of output URBs. Meh.
+        uint64_t wokeAt = shard->handleEvents(timeoutMS);
+        handleHotplugEvents();
+
+        if (mRecoveryPending.exchange(false)) {
+            usbRecoverDevices();
         }
 
         // We may have been asked for a one-shot poll, to retry connecting devices that failed.
-        if (mPollForDevicesOnce) {
+        if (mPollForDevicesOnce && wokeAt - lastPoll >= retryInterval) {
             mPollForDevicesOnce = false;
+            lastPoll = wokeAt;
             usbHotplugPoll();
         }
 
-        // Flush completed transfers
-        mEventMutex.lock();
-        for (std::vector<USBDevice*>::iterator i = mUSBDevices.begin(), e = mUSBDevices.end(); i != e; ++i) {
-            USBDevice *dev = *i;
-            dev->flush();
-        }
-        mEventMutex.unlock();
+        shard->flush(wokeAt);
     }
 }
 
@@ -397,37 +1028,30 @@ bool FCServer::usbHotplugPoll()
     mEventMutex.lock();
 
     // Look for devices that were added
+    std::unordered_map<libusb_device*, bool> listed;
     for (ssize_t listItem = 0; listItem < listSize; ++listItem) {
-        bool isNew = true;
-
-        for (std::vector<USBDevice*>::iterator i = mUSBDevices.begin(), e = mUSBDevices.end(); i != e; ++i) {
-            USBDevice *dev = *i;
-            if (dev->getDevice() == list[listItem]) {
-                isNew = false;
-            }
-        }
-
-        if (isNew) {
+        listed[list[listItem]] = true;
+        if (!mUSBDevicesByHandle.count(list[listItem])) {
             usbDeviceArrived(list[listItem]);
         }
     }
 
-    // Look for devices that were removed
-    for (std::vector<USBDevice*>::iterator i = mUSBDevices.begin(), e = mUSBDevices.end(); i != e; ++i) {
-        USBDevice *dev = *i;
-        libusb_device *usbdev = dev->getDevice();
-        bool isRemoved = true;
-
-        for (ssize_t listItem = 0; listItem < listSize; ++listItem) {
-            if (list[listItem] == usbdev) {
-                isRemoved = false;
-            }
+    // Look for devices that were removed. Collect them first, since removing edits the index.
+    std::vector<libusb_device*> removed;
+    for (std::unordered_map<libusb_device*, USBDevice*>::iterator i = mUSBDevicesByHandle.begin(),
+        e = mUSBDevicesByHandle.end(); i != e; ++i) {
+        if (!listed.count(i->first)) {
+            removed.push_back(i->first);
         }
-
-        if (isRemoved) {
-            usbDeviceLeft(i);
+    }
+    for (std::unordered_set<libusb_device*>::iterator i = mOpening.begin(), e = mOpening.end(); i != e; ++i) {
+        if (!listed.count(*i)) {
+            removed.push_back(*i);
         }
     }
+    for (std::vector<libusb_device*>::iterator i = removed.begin(), e = removed.end(); i != e; ++i) {
+        usbDeviceLeft(*i);
+    }
 
     mEventMutex.unlock();
     libusb_free_device_list(list, true);
@@ -438,9 +1062,10 @@ void FCServer::usbHotplugThreadFunc(void *arg)
 {
     FCServer *self = (FCServer*) arg;
 
-    while (self->usbHotplugPoll()) {
+    // startUSB() did the first poll
+    do {
         tthread::this_thread::sleep_for(tthread::chrono::seconds(1));
-    }
+    } while (self->usbHotplugPoll());
 }
 
 void FCServer::cbJsonMessage(libwebsocket *wsi, rapidjson::Document &message, void *context)
@@ -464,6 +1089,8 @@ void FCServer::cbJsonMessage(libwebsocket *wsi, rapidjson::Document &message, vo
         self->jsonListConnectedDevices(message);
     } else if (!strcmp(type, "server_info")) {
         self->jsonServerInfo(message);
+    } else if (!strcmp(type, "trace_dump")) {
+        self->jsonTraceDump(message);
     } else if (message.HasMember("device")) {
         self->jsonDeviceMessage(message);
     } else {
@@ -471,6 +1098,7 @@ void FCServer::cbJsonMessage(libwebsocket *wsi, rapidjson::Document &message, vo
     }
 
     self->mEventMutex.unlock();
+    self->wakeShards();
 
     // Remove heavyweight members we should never reply with
     message.RemoveMember("pixels");
@@ -480,6 +1108,76 @@ void FCServer::cbJsonMessage(libwebsocket *wsi, rapidjson::Document &message, vo
     self->mTcpNetServer.jsonReply(wsi, message);
 }
 
+void FCServer::cbMetrics(Metrics::Writer &writer, void *context)
+{
+    /*
+     * Add our part of the /metrics document, on the network thread. The counters
+     * themselves never lock, but the device list can change underneath us.
+     */
+
+    FCServer *self = (FCServer*) context;
+    tthread::lock_guard<tthread::recursive_mutex> lock(self->mEventMutex);
+    const std::vector<USBDevice*> &devices = self->mUSBDevices;
+
+    std::vector<std::string> labels;
+    for (unsigned i = 0; i != devices.size(); i++) {
+        const char *serial = devices[i]->getSerial();
+        labels.push_back(Metrics::Writer::label("type", devices[i]->getTypeString()) + "," +
+                         Metrics::Writer::label("serial", serial ? serial : ""));
+    }
+
+    static const struct {
+        const char *name;
+        const char *help;
+        Metrics::Counter USBDevice::Stats::*counter;
+    } counters[] = {
+        { "fcserver_device_frames_received_total", "Pixel messages routed to a device.",
+            &USBDevice::Stats::framesReceived },
+        { "fcserver_device_frames_mapped_total", "Frames mapped and queued for USB.",
+            &USBDevice::Stats::framesMapped },
+        { "fcserver_device_frames_superseded_total", "Queued frames replaced by a newer one before they were sent.",
+            &USBDevice::Stats::framesSuperseded },
+        { "fcserver_device_frames_unchanged_total", "Frames skipped because nothing changed since the last one.",
+            &USBDevice::Stats::framesUnchanged },
+        { "fcserver_device_frames_completed_total", "Frames the device finished receiving.",
+            &USBDevice::Stats::framesCompleted },
+        { "fcserver_device_transfers_submitted_total", "USB transfers submitted.",
+            &USBDevice::Stats::transfersSubmitted },
+        { "fcserver_device_transfers_completed_total", "USB transfers completed successfully.",
+            &USBDevice::Stats::transfersCompleted },
+        { "fcserver_device_transfers_failed_total", "USB transfers that failed to submit or complete.",
+            &USBDevice::Stats::transfersFailed },
+        { "fcserver_device_transfers_stalled_total", "USB transfers that timed out.",
+            &USBDevice::Stats::transfersStalled },
+    };
+
+    for (unsigned c = 0; c < sizeof counters / sizeof counters[0]; c++) {
+        writer.family(counters[c].name, "counter", counters[c].help);
+        for (unsigned i = 0; i != devices.size(); i++) {
+            writer.sample(counters[c].name, labels[i], (devices[i]->getStats().*counters[c].counter).get());
+        }
+    }
+
+    writer.family("fcserver_device_transfer_latency_seconds", "histogram",
+        "Time from USB transfer submission to completion.");
+    for (unsigned i = 0; i != devices.size(); i++) {
+        writer.histogram("fcserver_device_transfer_latency_seconds", labels[i],
+            devices[i]->getStats().transferLatency);
+    }
+
+    writer.family("fcserver_frames_streamed_total", "counter", "Device frames mapped before the rest of their OPC message arrived.");
+    writer.sample("fcserver_frames_streamed_total", "", self->mFramesStreamed);
+
+    writer.family("fcserver_usb_loop_seconds", "histogram", "Time spent handling each wakeup of any USB thread.");
+    writer.histogram("fcserver_usb_loop_seconds", "", self->mLoopTime);
+
+    uint64_t startupTime = self->mStartupTime.load();
+    if (startupTime) {
+        writer.family("fcserver_usb_startup_seconds", "gauge", "Time taken to open the USB devices attached at startup.");
+        writer.sample("fcserver_usb_startup_seconds", "", startupTime / 1e6);
+    }
+}
+
 void FCServer::jsonDeviceMessage(rapidjson::Document &message)
 {
     /*
@@ -491,10 +1189,25 @@ void FCServer::jsonDeviceMessage(rapidjson::Document &message)
     bool matched = false;
 
     if (device.IsObject()) {
-        for (unsigned i = 0; i != mUSBDevices.size(); i++) {
-            USBDevice *usbDev = mUSBDevices[i];
+        // With a serial number, only the devices indexed under it can match
+        std::vector<USBDevice*> candidates;
+        const Value &serial = device["serial"];
+
+        if (serial.IsString()) {
+            typedef std::unordered_multimap<std::string, USBDevice*>::iterator serialIter_t;
+            std::pair<serialIter_t, serialIter_t> range = mUSBDevicesBySerial.equal_range(serial.GetString());
+            for (serialIter_t i = range.first; i != range.second; ++i) {
+                candidates.push_back(i->second);
+            }
+        } else {
+            candidates = mUSBDevices;
+        }
+
+        for (unsigned i = 0; i != candidates.size(); i++) {
+            USBDevice *usbDev = candidates[i];
 
             if (usbDev->matchConfiguration(device)) {
+                tthread::lock_guard<tthread::recursive_mutex> lock(mUSBDeviceShards[usbDev]->getMutex());
                 matched = true;
                 usbDev->writeMessage(message);
                 if (message.HasMember("error"))
@@ -525,8 +1238,9 @@ void FCServer::jsonListConnectedDevices(rapidjson::Document &message)
 
     for (unsigned i = 0; i != mUSBDevices.size(); i++) {
         USBDevice *usbDev = mUSBDevices[i];
+        tthread::lock_guard<tthread::recursive_mutex> lock(mUSBDeviceShards[usbDev]->getMutex());
         list.PushBack(rapidjson::kObjectType, message.GetAllocator());
-        mUSBDevices[i]->describe(list[i], message.GetAllocator());
+        usbDev->describe(list[i], message.GetAllocator());
     }
 
     for (unsigned i = 0; i != mSPIDevices.size(); i++) {
@@ -546,6 +1260,18 @@ void FCServer::jsonServerInfo(rapidjson::Document &message)
     message.DeepCopy(message["config"], mConfig);
 }
 
+void FCServer::jsonTraceDump(rapidjson::Document &message)
+{
+    // Recent pipeline spans, in Chrome's trace event format
+#ifdef FCSERVER_TRACE
+    message.AddMember("traceEvents", rapidjson::kArrayType, message.GetAllocator());
+    Trace::dump(message["traceEvents"], message.GetAllocator());
+    message.AddMember("displayTimeUnit", "ms", message.GetAllocator());
+#else
+    message.AddMember("error", "Tracing is not enabled in this build", message.GetAllocator());
+#endif
+}
+
 void FCServer::jsonConnectedDevicesChanged()
 {
     rapidjson::Document message;
@@ -555,5 +1281,5 @@ void FCServer::jsonConnectedDevicesChanged()
 
     jsonListConnectedDevices(message);
 
-    mTcpNetServer.jsonBroadcast(message);
+    mTcpNetServer.jsonBroadcast(message, true);
 }
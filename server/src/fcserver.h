@@ -27,8 +27,15 @@
 #include "tcpnetserver.h"
 #include "usbdevice.h"
 #include "spidevice.h"
+#include "workerpool.h"
+#include "usbshard.h"
 #include <sstream>
 #include <vector>
+#include <string>
+#include <unordered_map>
+#include <unordered_set>
+#include <deque>
+#include <atomic>
 #include <libusb.h>
 #include "tinythread.h"
 
@@ -53,29 +60,153 @@ private:
     const Document& mConfig;
     const Value& mListen;
     const Value& mRelay;
+    const Value& mListenUnix;
+    const Value& mUDP;
+    const Value& mShm;
     const Value& mColor;
     const Value& mDevices;
     bool mVerbose;
-    bool mPollForDevicesOnce;
+    std::atomic<bool> mPollForDevicesOnce;
+    std::atomic<bool> mRecoveryPending;
+    unsigned mMapThreads;
+    unsigned mMapThreshold;
+    unsigned mUSBThreads;
 
     TcpNetServer mTcpNetServer;
     tthread::recursive_mutex mEventMutex;
     tthread::thread *mUSBHotplugThread;
 
-    std::vector<USBDevice*> mUSBDevices;
     struct libusb_context *mUSB;
 
+    /*
+     * USB devices are split among one or more shards, each serviced by its own thread.
+     * mEventMutex guards the lists below. Touching a device also takes its shard's lock,
+     * after ours.
+     *
+     * mUSBDevices keeps devices in the order they attached. The hashed indexes are keyed
+     * by the libusb_device from hotplug, which we keep a reference to, and by serial.
+     */
+    std::vector<USBShard*> mShards;
+    std::vector<USBDevice*> mUSBDevices;
+    std::unordered_map<libusb_device*, USBDevice*> mUSBDevicesByHandle;
+    std::unordered_multimap<std::string, USBDevice*> mUSBDevicesBySerial;
+    std::unordered_map<USBDevice*, USBShard*> mUSBDeviceShards;
+
+    /*
+     * Hotplug callbacks run inside shard 0's event handling, with its lock held. They
+     * queue events here, and the main loop handles them once it can take our lock first.
+     */
+    struct HotplugEvent {
+        libusb_device *device;      // Referenced until the event is handled
+        bool arrived;
+    };
+    tthread::mutex mHotplugMutex;
+    std::vector<HotplugEvent> mHotplugEvents;
+
+    /*
+     * Opening a device takes several round trips over USB, and some boards are slow to
+     * answer. New devices are opened and configured on a few helper threads, without
+     * our lock, and only then published to their shard and the routing table.
+     *
+     * mOpening holds the hotplug devices still being opened. If one leaves in the
+     * meantime it's taken out, and the helper drops the device when it's done.
+     * mShardLoad counts devices per shard, including ones still opening.
+     * Both are guarded by mEventMutex.
+     */
+    struct OpenJob {
+        libusb_device *device;      // From hotplug, referenced
+        USBShard *shard;
+        bool isFadecandy;
+        bool reset;                 // Reset the device after opening it, to recover from a stall
+    };
+    std::vector<tthread::thread*> mOpenThreads;
+    tthread::mutex mOpenMutex;
+    tthread::condition_variable mOpenReady;
+    std::deque<OpenJob> mOpenQueue;
+    std::unordered_set<libusb_device*> mOpening;
+    std::vector<unsigned> mShardLoad;
+
+    // How long it took to open the devices that were attached at startup
+    uint64_t mStartTime;
+    std::atomic<uint64_t> mStartupTime;     // Microseconds, zero until we know
+
     std::vector<SPIDevice*> mSPIDevices;
 
+    /*
+     * Pixel data routing. For each OPC channel, the devices whose maps read from it.
+     * Only rebuilt when devices attach or detach.
+     *
+     * The network thread reads the current table without taking mEventMutex. A table
+     * never changes once it's published; rebuildRoutes() swaps in a new one, then waits
+     * for mRouteReaders to drain before the old table or any device it names goes away.
+     */
+    struct ChannelRoutes {
+        std::vector<USBDevice*> usb;        // In order of where their input ends, for streaming
+        std::vector<unsigned> usbInputEnd;  // One past the last pixel each of those reads
+        std::vector<SPIDevice*> spi;
+        std::vector<USBShard*> shards;      // Owners of the 'usb' devices, to wake
+    };
+    struct RouteTable {
+        ChannelRoutes channels[PixelMap::NUM_CHANNELS];
+    };
+    std::atomic<RouteTable*> mRoutes;
+    std::atomic<unsigned> mRouteReaders;
+
+    void rebuildRoutes();
+
+    /*
+     * Devices queue frames from the network thread, and their shard submits them.
+     * Each shard sleeps in an event loop that watches its libusb file descriptors,
+     * and other threads wake it up when there's new work.
+     */
+    void wakeShards();
+    USBShard *shardForNewDevice();
+    void handleHotplugEvents();
+    void checkStartupDone();
+
+    // Time spent handling each wakeup of any USB thread, for /metrics
+    Metrics::Histogram mLoopTime;
+
+    /*
+     * Optional helpers for mapping large messages. Each device is still mapped by
+     * exactly one thread per message, and the message finishes before the next starts,
+     * so frames reach every device's slot in order.
+     */
+    WorkerPool mMapPool;
+
+    struct MapJob {
+        const OPC::Message *msg;
+        USBDevice * const *devices;
+    };
+
+    static void cbMapDevice(void *context, unsigned index);
+    void mapDevices(const ChannelRoutes &routes, const OPC::Message &msg, unsigned first, unsigned last);
+    void dispatchPixels(OPC::Message &msg, unsigned done);
+    static unsigned firstUnmapped(const ChannelRoutes &routes, unsigned done);
+
+    /*
+     * Optional streaming dispatch. Devices are mapped as soon as the part of a message
+     * they read has arrived, while the rest is still on its way.
+     */
+    bool mStreamDispatch;
+    uint64_t mFramesStreamed;               // Network thread only
+
     static void cbOpcMessage(OPC::Message &msg, void *context);
+    static void cbOpcStream(OPC::Message &msg, unsigned done, unsigned ready, bool complete, void *context);
     static void cbJsonMessage(libwebsocket *wsi, rapidjson::Document &message, void *context);
+    static void cbMetrics(Metrics::Writer &writer, void *context);
+    static void cbFlow(unsigned channel, TcpNetServer::FlowStatus &status, void *context);
 
+    static void cbRecovery(USBDevice *dev, void *context);
     static LIBUSB_CALL int cbHotplug(libusb_context *ctx, libusb_device *device, libusb_hotplug_event event, void *user_data);
 
     bool startUSB(libusb_context *usb);
-    void usbDeviceArrived(libusb_device *device);
+    void usbDeviceArrived(libusb_device *device, bool reset = false);
     void usbDeviceLeft(libusb_device *device);
-    void usbDeviceLeft(std::vector<USBDevice*>::iterator iter);
+    void usbRecoverDevices();
+    void usbOpenDevice(const OpenJob &job);
+    void usbOpenFinished(const OpenJob &job, USBDevice *dev);
+    static void usbOpenThreadFunc(void *arg);
     bool usbHotplugPoll();
 
     static void usbHotplugThreadFunc(void *arg);
@@ -89,5 +220,6 @@ private:
     // JSON message handlers
     void jsonListConnectedDevices(rapidjson::Document &message);
     void jsonServerInfo(rapidjson::Document &message);
+    void jsonTraceDump(rapidjson::Document &message);
     void jsonDeviceMessage(rapidjson::Document &message);
 };
@@ -0,0 +1,74 @@
+/*
+ * Lock-free latest-frame slot, for handing frames between two threads.
+ *
+ * Copyright (c) 2013 Micah Elizabeth Scott
+ *
+ * Permission is hereby granted, free of charge, to any person obtaining a copy of
+ * this software and associated documentation files (the "Software"), to deal in
+ * the Software without restriction, including without limitation the rights to
+ * use, copy, modify, merge, publish, distribute, sublicense, and/or sell copies of
+ * the Software, and to permit persons to whom the Software is furnished to do so,
+ * subject to the following conditions:
+ *
+ * The above copyright notice and this permission notice shall be included in all
+ * copies or substantial portions of the Software.
+ *
+ * THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+ * IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY, FITNESS
+ * FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL THE AUTHORS OR
+ * COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER LIABILITY, WHETHER
+ * IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING FROM, OUT OF OR IN
+ * CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN THE SOFTWARE.
+ */
+
+#pragma once
+#include <atomic>
+
+
+/*
+ * Triple buffer with one producer and one consumer. The producer fills back()
+ * and publishes it; the consumer picks up the newest published frame and reads
+ * it from front(). Neither side ever blocks. If the producer publishes twice
+ * before the consumer gets around to it, the older frame is superseded.
+ *
+ * Each side owns its own buffer outright, and the third buffer is traded back
+ * and forth through a single atomic word.
+ */
+
+template <typename T>
+class FrameSlot
+{
+public:
+    FrameSlot()
+        : mBack(0), mFront(1), mMiddle(2)
+    {}
+
+    // Producer side. Returns true if this superseded a frame the consumer never saw.
+    T *back() { return &mBuffers[mBack]; }
+    bool publish() {
+        unsigned prev = mMiddle.exchange(mBack | FRESH, std::memory_order_acq_rel);
+        mBack = prev & INDEX;
+        return (prev & FRESH) != 0;
+    }
+
+    // Consumer side. Returns true if a new frame is now available in front().
+    T *front() { return &mBuffers[mFront]; }
+    bool pending() const { return (mMiddle.load(std::memory_order_relaxed) & FRESH) != 0; }
+    bool consume() {
+        if (!pending()) {
+            return false;
+        }
+        unsigned prev = mMiddle.exchange(mFront, std::memory_order_acq_rel);
+        mFront = prev & INDEX;
+        return true;
+    }
+
+private:
+    static const unsigned INDEX = 0x3;
+    static const unsigned FRESH = 0x4;
+
+    T mBuffers[3];
+    unsigned mBack;
+    unsigned mFront;
+    std::atomic<unsigned> mMiddle;
+};
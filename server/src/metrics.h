@@ -0,0 +1,173 @@
+/*
+ * Lock-free counters and histograms, and a Prometheus text format writer
+ *
+ * Copyright (c) 2013 Micah Elizabeth Scott
+ *
+ * Permission is hereby granted, free of charge, to any person obtaining a copy of
+ * this software and associated documentation files (the "Software"), to deal in
+ * the Software without restriction, including without limitation the rights to
+ * use, copy, modify, merge, publish, distribute, sublicense, and/or sell copies of
+ * the Software, and to permit persons to whom the Software is furnished to do so,
+ * subject to the following conditions:
+ *
+ * The above copyright notice and this permission notice shall be included in all
+ * copies or substantial portions of the Software.
+ *
+ * THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+ * IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY, FITNESS
+ * FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL THE AUTHORS OR
+ * COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER LIABILITY, WHETHER
+ * IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING FROM, OUT OF OR IN
+ * CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN THE SOFTWARE.
+ */
+
+#pragma once
+#include <stdint.h>
+#include <stdio.h>
+#include <string>
+#include <atomic>
+#include <chrono>
+
+
+/*
+ * Statistics are updated on the hot path with relaxed atomic adds, and never
+ * take a lock. Readers may see a histogram's buckets, sum, and count from
+ * slightly different moments, which is fine for monitoring.
+ *
+ * The text format is the one Prometheus scrapes: one "# HELP" and "# TYPE" per
+ * metric family, then one sample per line. Times are exported in seconds.
+ */
+
+namespace Metrics {
+
+    // Monotonic time in microseconds
+    inline uint64_t now() {
+        return std::chrono::duration_cast<std::chrono::microseconds>(
+            std::chrono::steady_clock::now().time_since_epoch()).count();
+    }
+
+    class Counter
+    {
+    public:
+        Counter() : mValue(0) {}
+
+        void add(uint64_t n = 1) { mValue.fetch_add(n, std::memory_order_relaxed); }
+        uint64_t get() const { return mValue.load(std::memory_order_relaxed); }
+
+    private:
+        std::atomic<uint64_t> mValue;
+    };
+
+    /*
+     * Durations in power-of-two buckets, from 1 us up to 2^22 us (about 4.2 seconds).
+     * The last bucket catches everything longer, and is exported as +Inf.
+     */
+    class Histogram
+    {
+    public:
+        static const unsigned NUM_BUCKETS = 24;
+
+        Histogram() : mSum(0) {
+            for (unsigned i = 0; i < NUM_BUCKETS; ++i) {
+                mBuckets[i] = 0;
+            }
+        }
+
+        void record(uint64_t us) {
+            unsigned i = 0;
+            while (i < NUM_BUCKETS - 1 && us > (uint64_t(1) << i)) {
+                i++;
+            }
+            mBuckets[i].fetch_add(1, std::memory_order_relaxed);
+            mSum.fetch_add(us, std::memory_order_relaxed);
+        }
+
+        // Upper bound of bucket i, in microseconds. The last bucket has none.
+        static uint64_t bound(unsigned i) { return uint64_t(1) << i; }
+
+        uint64_t bucket(unsigned i) const { return mBuckets[i].load(std::memory_order_relaxed); }
+        uint64_t sum() const { return mSum.load(std::memory_order_relaxed); }
+
+    private:
+        std::atomic<uint64_t> mBuckets[NUM_BUCKETS];
+        std::atomic<uint64_t> mSum;
+    };
+
+    // Formats metric families into a text document
+    class Writer
+    {
+    public:
+        Writer(std::string &out) : mOut(out) {}
+
+        void family(const char *name, const char *type, const char *help) {
+            mOut += "# HELP "; mOut += name; mOut += ' '; mOut += help; mOut += '\n';
+            mOut += "# TYPE "; mOut += name; mOut += ' '; mOut += type; mOut += '\n';
+        }
+
+        void sample(const char *name, const std::string &labels, uint64_t value) {
+            char buf[32];
+            snprintf(buf, sizeof buf, "%llu", (unsigned long long) value);
+            line(name, "", labels, buf);
+        }
+
+        void sample(const char *name, const std::string &labels, double value) {
+            char buf[32];
+            snprintf(buf, sizeof buf, "%.9g", value);
+            line(name, "", labels, buf);
+        }
+
+        void histogram(const char *name, const std::string &labels, const Histogram &h) {
+            char value[32];
+            uint64_t count = 0;
+
+            for (unsigned i = 0; i < Histogram::NUM_BUCKETS; ++i) {
+                count += h.bucket(i);
+                std::string le = labels.empty() ? "" : labels + ",";
+                if (i == Histogram::NUM_BUCKETS - 1) {
+                    le += "le=\"+Inf\"";
+                } else {
+                    snprintf(value, sizeof value, "le=\"%.9g\"", Histogram::bound(i) * 1e-6);
+                    le += value;
+                }
+                snprintf(value, sizeof value, "%llu", (unsigned long long) count);
+                line(name, "_bucket", le, value);
+            }
+
+            snprintf(value, sizeof value, "%.9g", h.sum() * 1e-6);
+            line(name, "_sum", labels, value);
+            snprintf(value, sizeof value, "%llu", (unsigned long long) count);
+            line(name, "_count", labels, value);
+        }
+
+        // Build one label="value" pair, escaped. Join several with commas.
+        static std::string label(const char *key, const char *value) {
+            std::string s = key;
+            s += "=\"";
+            for (; *value; ++value) {
+                switch (*value) {
+                    case '\\': s += "\\\\"; break;
+                    case '"': s += "\\\""; break;
+                    case '\n': s += "\\n"; break;
+                    default: s += *value; break;
+                }
+            }
+            s += '"';
+            return s;
+        }
+
+    private:
+        std::string &mOut;
+
+        void line(const char *name, const char *suffix, const std::string &labels, const char *value) {
+            mOut += name;
+            mOut += suffix;
+            if (!labels.empty()) {
+                mOut += '{'; mOut += labels; mOut += '}';
+            }
+            mOut += ' ';
+            mOut += value;
+            mOut += '\n';
+        }
+    };
+
+}
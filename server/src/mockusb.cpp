@@ -0,0 +1,801 @@
+/*
+ * Mock libusb backend with virtual Fadecandy devices, for testing without hardware
+ *
+ * Copyright (c) 2013 Micah Elizabeth Scott
+ *
+ * Permission is hereby granted, free of charge, to any person obtaining a copy of
+ * this software and associated documentation files (the "Software"), to deal in
+ * the Software without restriction, including without limitation the rights to
+ * use, copy, modify, merge, publish, distribute, sublicense, and/or sell copies of
+ * the Software, and to permit persons to whom the Software is furnished to do so,
+ * subject to the following conditions:
+ *
+ * The above copyright notice and this permission notice shall be included in all
+ * copies or substantial portions of the Software.
+ *
+ * THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+ * IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY, FITNESS
+ * FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL THE AUTHORS OR
+ * COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER LIABILITY, WHETHER
+ * IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING FROM, OUT OF OR IN
+ * CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN THE SOFTWARE.
+ */
+
+/*
+ * This file stands in for libusbx when the server is built with the mock USB
+ * option. It implements the subset of the libusb API that fcserver uses, and
+ * presents a set of virtual Fadecandy boards that decode the same bulk packet
+ * protocol as the real firmware.
+ *
+ * Each virtual device has its own simulated link. A transfer occupies the link
+ * for (length / bandwidth), then completes after an additional fixed latency.
+ * Completions are delivered from libusb_handle_events_timeout_completed(), just
+ * like the real thing, and a pipe is exposed through libusb_get_pollfds() so an
+ * event loop notices new work.
+ *
+ * Configured with environment variables:
+ *
+ *   FCSERVER_MOCK_DEVICES     Number of virtual Fadecandy boards (default 1)
+ *   FCSERVER_MOCK_BANDWIDTH   Link bandwidth per device, in bytes/second
+ *                             (default 1216000, the full-speed bulk maximum)
+ *   FCSERVER_MOCK_LATENCY     Completion latency per transfer, in microseconds
+ *                             (default 1000, one USB frame)
+ *   FCSERVER_MOCK_RECORD      If set, decoded frames, color LUTs, and config
+ *                             packets are appended to this file, one per line.
+ *   FCSERVER_MOCK_REPORT      If set, a UDP port or host:port that receives a
+ *                             MockUSBReport for every decoded frame.
+ *   FCSERVER_MOCK_FIRMWARE    BCD firmware version to report (default 0x0110).
+ *                             Firmware older than 0x0110 doesn't copy unsent
+ *                             packets forward, just like the real thing.
+ *   FCSERVER_MOCK_STALL       If set, "index:frames". The board with that index
+ *                             stops accepting data after decoding that many
+ *                             frames, so its transfers time out, until it's reset.
+ */
+
+#include "mockusb.h"
+#include <libusb.h>
+#include <stdint.h>
+#include <stdlib.h>
+#include <stdio.h>
+#include <string.h>
+#include <errno.h>
+#include <time.h>
+#include <unistd.h>
+#include <fcntl.h>
+#include <poll.h>
+#include <netdb.h>
+#include <sys/socket.h>
+#include <iostream>
+#include <algorithm>
+#include <vector>
+#include <map>
+#include <string>
+#include <new>
+#include "tinythread.h"
+
+static const unsigned kPacketSize = 64;
+static const unsigned kFramebufferPackets = 25;
+static const unsigned kLUTPackets = 25;
+static const unsigned kPixelsPerPacket = 21;
+static const unsigned kLUTEntriesPerPacket = 31;
+static const unsigned kNumPixels = 512;
+static const unsigned kLUTEntries = 3 * 257;
+
+static const uint8_t TYPE_MASK = 0xC0;
+static const uint8_t TYPE_FRAMEBUFFER = 0x00;
+static const uint8_t TYPE_LUT = 0x40;
+static const uint8_t TYPE_CONFIG = 0x80;
+static const uint8_t FINAL = 0x20;
+static const uint8_t INDEX_MASK = 0x1F;
+
+struct libusb_device
+{
+    libusb_context *ctx;
+    unsigned index;
+    char serial[32];
+
+    // Simulated link: busy until this time, in microseconds
+    uint64_t busyUntil;
+
+    /*
+     * Decoder state, updated as transfers complete. Frames are triple buffered like
+     * in the firmware: packets land in fbNew, which becomes fbNext when the final
+     * packet arrives, and the old fbPrev is recycled without being cleared.
+     */
+    uint8_t fb[3][kFramebufferPackets * kPixelsPerPacket * 3];
+    uint8_t *fbPrev;
+    uint8_t *fbNext;
+    uint8_t *fbNew;
+    uint32_t fbNewMask;
+    uint8_t lut[kLUTEntries * 2];
+    uint8_t config[kPacketSize - 1];
+    uint64_t framesDecoded;
+    uint64_t lutsDecoded;
+    uint64_t protocolErrors;
+
+    // Simulated hang. Transfers time out instead of completing.
+    uint64_t stallAfter;    // Frames, or zero for never
+    bool stalled;
+};
+
+struct libusb_device_handle
+{
+    libusb_device *dev;
+};
+
+// Private bookkeeping, allocated just ahead of each public libusb_transfer
+struct MockTransfer
+{
+    typedef std::multimap<uint64_t, MockTransfer*> Queue;
+
+    bool inFlight;
+    bool cancelled;
+    bool timedOut;
+    Queue::iterator position;
+
+    libusb_transfer *transfer() {
+        return reinterpret_cast<libusb_transfer*>(this + 1);
+    }
+
+    static MockTransfer *of(libusb_transfer *transfer) {
+        return reinterpret_cast<MockTransfer*>(transfer) - 1;
+    }
+};
+
+struct libusb_context
+{
+    tthread::mutex mutex;
+    std::vector<libusb_device*> devices;
+    MockTransfer::Queue pending;
+
+    double bytesPerMicrosecond;
+    uint64_t latency;
+    unsigned firmwareVersion;
+    FILE *record;
+    int reportFD;
+
+    int wakePipe[2];
+    bool wakePending;
+    libusb_pollfd pollfd;
+};
+
+static uint64_t now()
+{
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return uint64_t(ts.tv_sec) * 1000000 + ts.tv_nsec / 1000;
+}
+
+static unsigned long envNumber(const char *name, unsigned long defaultValue)
+{
+    const char *value = getenv(name);
+    if (!value || !*value) {
+        return defaultValue;
+    }
+    return strtoul(value, 0, 0);
+}
+
+static void recordHex(FILE *f, const uint8_t *data, unsigned length)
+{
+    static const char digits[] = "0123456789abcdef";
+    for (unsigned i = 0; i < length; ++i) {
+        fputc(digits[data[i] >> 4], f);
+        fputc(digits[data[i] & 0xF], f);
+    }
+}
+
+static void record(libusb_context *ctx, libusb_device *dev, const char *kind,
+    uint64_t number, const uint8_t *data, unsigned length)
+{
+    // One line per record: timestamp, serial, kind, sequence number, hex payload
+    fprintf(ctx->record, "%llu %s %s %llu ", (unsigned long long) now(), dev->serial,
+        kind, (unsigned long long) number);
+    recordHex(ctx->record, data, length);
+    fputc('\n', ctx->record);
+    fflush(ctx->record);
+}
+
+static int openReport(const char *spec)
+{
+    // Either "port" or "host:port", default host is the local machine
+    std::string host = "127.0.0.1";
+    std::string port = spec;
+    size_t colon = port.rfind(':');
+    if (colon != std::string::npos) {
+        host = port.substr(0, colon);
+        port = port.substr(colon + 1);
+    }
+
+    struct addrinfo hints, *ai;
+    memset(&hints, 0, sizeof hints);
+    hints.ai_family = AF_UNSPEC;
+    hints.ai_socktype = SOCK_DGRAM;
+    if (getaddrinfo(host.c_str(), port.c_str(), &hints, &ai)) {
+        return -1;
+    }
+
+    int fd = socket(ai->ai_family, ai->ai_socktype, ai->ai_protocol);
+    if (fd >= 0 && connect(fd, ai->ai_addr, ai->ai_addrlen) < 0) {
+        close(fd);
+        fd = -1;
+    }
+    if (fd >= 0) {
+        fcntl(fd, F_SETFL, O_NONBLOCK);
+    }
+
+    freeaddrinfo(ai);
+    return fd;
+}
+
+static void report(libusb_context *ctx, libusb_device *dev)
+{
+    MockUSBReport r;
+    r.device = dev->index;
+    memcpy(&r.stamp, dev->fbNext, sizeof r.stamp);
+    r.timestamp = now();
+
+    // Best effort; a full socket buffer just loses the report
+    if (send(ctx->reportFD, &r, sizeof r, 0) < 0) {}
+}
+
+static void finalizeFramebuffer(libusb_context *ctx, libusb_device *dev)
+{
+    // Newer firmware copies packets the host didn't send forward from the previous frame
+    if (ctx->firmwareVersion >= 0x0110) {
+        unsigned packetBytes = kPixelsPerPacket * 3;
+        for (unsigned i = 0; i < kFramebufferPackets; ++i) {
+            if (!(dev->fbNewMask & (1 << i))) {
+                memcpy(dev->fbNew + i * packetBytes, dev->fbNext + i * packetBytes, packetBytes);
+            }
+        }
+    }
+    dev->fbNewMask = 0;
+
+    uint8_t *recycle = dev->fbPrev;
+    dev->fbPrev = dev->fbNext;
+    dev->fbNext = dev->fbNew;
+    dev->fbNew = recycle;
+}
+
+static void decodePacket(libusb_context *ctx, libusb_device *dev, const uint8_t *packet)
+{
+    uint8_t control = packet[0];
+    unsigned index = control & INDEX_MASK;
+    const uint8_t *payload = packet + 1;
+
+    switch (control & TYPE_MASK) {
+
+        case TYPE_FRAMEBUFFER: {
+            if (index >= kFramebufferPackets) {
+                dev->protocolErrors++;
+                return;
+            }
+
+            unsigned packetBytes = kPixelsPerPacket * 3;
+            memcpy(dev->fbNew + index * packetBytes, payload, packetBytes);
+            dev->fbNewMask |= 1 << index;
+
+            if (control & FINAL) {
+                finalizeFramebuffer(ctx, dev);
+                dev->framesDecoded++;
+                if (dev->framesDecoded == dev->stallAfter) {
+                    dev->stalled = true;
+                }
+                if (ctx->reportFD >= 0) {
+                    report(ctx, dev);
+                }
+                if (ctx->record) {
+                    // The last packet only carries the remaining 8 pixels
+                    record(ctx, dev, "frame", dev->framesDecoded, dev->fbNext, kNumPixels * 3);
+                }
+            }
+            break;
+        }
+
+        case TYPE_LUT: {
+            if (index >= kLUTPackets) {
+                dev->protocolErrors++;
+                return;
+            }
+
+            // Entries are 16-bit little endian, after one byte of padding
+            unsigned first = index * kLUTEntriesPerPacket;
+            unsigned count = std::min(kLUTEntriesPerPacket, kLUTEntries - first);
+            memcpy(dev->lut + first * 2, payload + 1, count * 2);
+
+            if (control & FINAL) {
+                dev->lutsDecoded++;
+                if (ctx->record) {
+                    record(ctx, dev, "lut", dev->lutsDecoded, dev->lut, sizeof dev->lut);
+                }
+            }
+            break;
+        }
+
+        case TYPE_CONFIG: {
+            if (index != 0) {
+                dev->protocolErrors++;
+                return;
+            }
+            memcpy(dev->config, payload, sizeof dev->config);
+            if (ctx->record) {
+                record(ctx, dev, "config", 0, dev->config, sizeof dev->config);
+            }
+            break;
+        }
+
+        default:
+            dev->protocolErrors++;
+            break;
+    }
+}
+
+static void decodeTransfer(libusb_context *ctx, libusb_device *dev, const libusb_transfer *transfer)
+{
+    if (transfer->length % kPacketSize) {
+        std::clog << "Mock USB: " << dev->serial << " received a transfer of "
+            << transfer->length << " bytes, not a whole number of packets\n";
+        dev->protocolErrors++;
+    }
+
+    for (int offset = 0; offset + int(kPacketSize) <= transfer->length; offset += kPacketSize) {
+        decodePacket(ctx, dev, transfer->buffer + offset);
+    }
+}
+
+static void wakeLocked(libusb_context *ctx)
+{
+    // At most one byte is ever waiting in the pipe
+    if (!ctx->wakePending) {
+        ctx->wakePending = true;
+        char c = 0;
+        if (write(ctx->wakePipe[1], &c, 1) < 0) {
+            ctx->wakePending = false;
+        }
+    }
+}
+
+static void scheduleLocked(libusb_context *ctx, MockTransfer *mt, uint64_t due)
+{
+    mt->inFlight = true;
+    mt->position = ctx->pending.insert(std::make_pair(due, mt));
+
+    // Only a new earliest deadline changes the event loop's timeout
+    if (mt->position == ctx->pending.begin()) {
+        wakeLocked(ctx);
+    }
+}
+
+int LIBUSB_CALL libusb_init(libusb_context **context)
+{
+    libusb_context *ctx = new libusb_context;
+
+    unsigned numDevices = envNumber("FCSERVER_MOCK_DEVICES", 1);
+    unsigned long bandwidth = envNumber("FCSERVER_MOCK_BANDWIDTH", 1216000);
+    ctx->bytesPerMicrosecond = bandwidth ? bandwidth / 1e6 : 0;
+    ctx->latency = envNumber("FCSERVER_MOCK_LATENCY", 1000);
+    ctx->firmwareVersion = envNumber("FCSERVER_MOCK_FIRMWARE", 0x0110);
+    ctx->record = 0;
+    ctx->reportFD = -1;
+    ctx->wakePending = false;
+
+    const char *recordPath = getenv("FCSERVER_MOCK_RECORD");
+    if (recordPath && *recordPath) {
+        ctx->record = fopen(recordPath, "a");
+        if (!ctx->record) {
+            std::clog << "Mock USB: can't open " << recordPath << ": " << strerror(errno) << "\n";
+        } else {
+            // Each record goes out in one write, so contexts sharing the file don't interleave
+            setvbuf(ctx->record, 0, _IOFBF, 1 << 16);
+        }
+    }
+
+    const char *reportSpec = getenv("FCSERVER_MOCK_REPORT");
+    if (reportSpec && *reportSpec) {
+        ctx->reportFD = openReport(reportSpec);
+        if (ctx->reportFD < 0) {
+            std::clog << "Mock USB: can't send reports to " << reportSpec << "\n";
+        }
+    }
+
+    if (pipe(ctx->wakePipe) < 0) {
+        delete ctx;
+        return LIBUSB_ERROR_OTHER;
+    }
+    fcntl(ctx->wakePipe[0], F_SETFL, O_NONBLOCK);
+    fcntl(ctx->wakePipe[1], F_SETFL, O_NONBLOCK);
+    ctx->pollfd.fd = ctx->wakePipe[0];
+    ctx->pollfd.events = POLLIN;
+
+    unsigned stallIndex = 0;
+    unsigned long stallAfter = 0;
+    const char *stallSpec = getenv("FCSERVER_MOCK_STALL");
+    if (stallSpec && *stallSpec) {
+        char *frames;
+        stallIndex = strtoul(stallSpec, &frames, 0);
+        stallAfter = *frames == ':' ? strtoul(frames + 1, 0, 0) : 1;
+    }
+
+    for (unsigned i = 0; i < numDevices; ++i) {
+        libusb_device *dev = new libusb_device;
+        memset(dev, 0, sizeof *dev);
+        dev->ctx = ctx;
+        dev->index = i;
+        snprintf(dev->serial, sizeof dev->serial, "MOCK%08u", i);
+        dev->stallAfter = i == stallIndex ? stallAfter : 0;
+        dev->fbPrev = dev->fb[0];
+        dev->fbNext = dev->fb[1];
+        dev->fbNew = dev->fb[2];
+        ctx->devices.push_back(dev);
+    }
+
+    std::clog << "Mock USB: " << numDevices << " virtual Fadecandy devices, "
+        << bandwidth << " bytes/s, " << ctx->latency << " us latency, firmware "
+        << std::hex << ctx->firmwareVersion << std::dec << "\n";
+
+    *context = ctx;
+    return 0;
+}
+
+void LIBUSB_CALL libusb_exit(libusb_context *ctx)
+{
+    for (unsigned i = 0; i < ctx->devices.size(); ++i) {
+        delete ctx->devices[i];
+    }
+    if (ctx->record) {
+        fclose(ctx->record);
+    }
+    if (ctx->reportFD >= 0) {
+        close(ctx->reportFD);
+    }
+    close(ctx->wakePipe[0]);
+    close(ctx->wakePipe[1]);
+    delete ctx;
+}
+
+const char * LIBUSB_CALL libusb_strerror(enum libusb_error errcode)
+{
+    switch (errcode) {
+        case LIBUSB_SUCCESS:                return "Success";
+        case LIBUSB_ERROR_IO:               return "Input/Output Error";
+        case LIBUSB_ERROR_INVALID_PARAM:    return "Invalid parameter";
+        case LIBUSB_ERROR_ACCESS:           return "Access denied (insufficient permissions)";
+        case LIBUSB_ERROR_NO_DEVICE:        return "No such device (it may have been disconnected)";
+        case LIBUSB_ERROR_NOT_FOUND:        return "Entity not found";
+        case LIBUSB_ERROR_BUSY:             return "Resource busy";
+        case LIBUSB_ERROR_TIMEOUT:          return "Operation timed out";
+        case LIBUSB_ERROR_OVERFLOW:         return "Overflow";
+        case LIBUSB_ERROR_PIPE:             return "Pipe error";
+        case LIBUSB_ERROR_INTERRUPTED:      return "System call interrupted (perhaps due to signal)";
+        case LIBUSB_ERROR_NO_MEM:           return "Insufficient memory";
+        case LIBUSB_ERROR_NOT_SUPPORTED:    return "Operation not supported or unimplemented on this platform";
+        default:                            return "Other error";
+    }
+}
+
+int LIBUSB_CALL libusb_has_capability(uint32_t capability)
+{
+    // The virtual devices are all present from the start, so there's no need to poll
+    return capability == LIBUSB_CAP_HAS_CAPABILITY || capability == LIBUSB_CAP_HAS_HOTPLUG;
+}
+
+ssize_t LIBUSB_CALL libusb_get_device_list(libusb_context *ctx, libusb_device ***list)
+{
+    unsigned count = ctx->devices.size();
+    libusb_device **result = (libusb_device**) malloc(sizeof(libusb_device*) * (count + 1));
+    if (!result) {
+        return LIBUSB_ERROR_NO_MEM;
+    }
+    for (unsigned i = 0; i < count; ++i) {
+        result[i] = ctx->devices[i];
+    }
+    result[count] = 0;
+    *list = result;
+    return count;
+}
+
+void LIBUSB_CALL libusb_free_device_list(libusb_device **list, int unref_devices)
+{
+    // Virtual devices live as long as their context, so references aren't counted
+    free(list);
+}
+
+libusb_device * LIBUSB_CALL libusb_ref_device(libusb_device *dev)
+{
+    return dev;
+}
+
+void LIBUSB_CALL libusb_unref_device(libusb_device *dev)
+{}
+
+/*
+ * Every context has the same virtual boards, at the same bus addresses. A real bus
+ * has room for 127 devices.
+ */
+
+uint8_t LIBUSB_CALL libusb_get_bus_number(libusb_device *dev)
+{
+    return 1 + dev->index / 127;
+}
+
+uint8_t LIBUSB_CALL libusb_get_device_address(libusb_device *dev)
+{
+    return 1 + dev->index % 127;
+}
+
+int LIBUSB_CALL libusb_get_device_descriptor(libusb_device *dev, struct libusb_device_descriptor *desc)
+{
+    memset(desc, 0, sizeof *desc);
+    desc->bLength = LIBUSB_DT_DEVICE_SIZE;
+    desc->bDescriptorType = LIBUSB_DT_DEVICE;
+    desc->bcdUSB = 0x0200;
+    desc->bDeviceClass = LIBUSB_CLASS_VENDOR_SPEC;
+    desc->bMaxPacketSize0 = kPacketSize;
+    desc->idVendor = 0x1d50;
+    desc->idProduct = 0x607a;
+    desc->bcdDevice = dev->ctx->firmwareVersion;
+    desc->iManufacturer = 1;
+    desc->iProduct = 2;
+    desc->iSerialNumber = 3;
+    desc->bNumConfigurations = 1;
+    return 0;
+}
+
+int LIBUSB_CALL libusb_open(libusb_device *dev, libusb_device_handle **handle)
+{
+    libusb_device_handle *h = new libusb_device_handle;
+    h->dev = dev;
+    *handle = h;
+    return 0;
+}
+
+void LIBUSB_CALL libusb_close(libusb_device_handle *dev_handle)
+{
+    delete dev_handle;
+}
+
+#if defined(LIBUSB_API_VERSION) && LIBUSB_API_VERSION >= 0x01000105
+
+unsigned char * LIBUSB_CALL libusb_dev_mem_alloc(libusb_device_handle *dev_handle, size_t length)
+{
+    // Ordinary memory stands in for a usbfs mapping
+    return (unsigned char*) malloc(length);
+}
+
+int LIBUSB_CALL libusb_dev_mem_free(libusb_device_handle *dev_handle, unsigned char *buffer, size_t length)
+{
+    free(buffer);
+    return 0;
+}
+
+#endif
+
+int LIBUSB_CALL libusb_reset_device(libusb_device_handle *handle)
+{
+    // Clears a simulated hang, for good
+    libusb_device *dev = handle->dev;
+    tthread::lock_guard<tthread::mutex> lock(dev->ctx->mutex);
+    dev->stalled = false;
+    dev->stallAfter = 0;
+    return 0;
+}
+
+int LIBUSB_CALL libusb_claim_interface(libusb_device_handle *dev, int interface_number)
+{
+    return interface_number == 0 ? 0 : LIBUSB_ERROR_NOT_FOUND;
+}
+
+int LIBUSB_CALL libusb_detach_kernel_driver(libusb_device_handle *dev, int interface_number)
+{
+    return LIBUSB_ERROR_NOT_FOUND;
+}
+
+int LIBUSB_CALL libusb_get_string_descriptor_ascii(libusb_device_handle *dev,
+    uint8_t desc_index, unsigned char *data, int length)
+{
+    const char *str;
+    switch (desc_index) {
+        case 1: str = "scanlime"; break;
+        case 2: str = "Fadecandy"; break;
+        case 3: str = dev->dev->serial; break;
+        default: return LIBUSB_ERROR_INVALID_PARAM;
+    }
+
+    int len = std::min<int>(strlen(str), length - 1);
+    if (len < 0) {
+        return LIBUSB_ERROR_INVALID_PARAM;
+    }
+    memcpy(data, str, len);
+    data[len] = '\0';
+    return len;
+}
+
+struct libusb_transfer * LIBUSB_CALL libusb_alloc_transfer(int iso_packets)
+{
+    size_t size = sizeof(MockTransfer) + sizeof(libusb_transfer) +
+        sizeof(libusb_iso_packet_descriptor) * iso_packets;
+    MockTransfer *mt = (MockTransfer*) calloc(1, size);
+    if (!mt) {
+        return 0;
+    }
+    new (mt) MockTransfer;
+    mt->inFlight = false;
+    mt->cancelled = false;
+    mt->timedOut = false;
+    mt->transfer()->num_iso_packets = iso_packets;
+    return mt->transfer();
+}
+
+void LIBUSB_CALL libusb_free_transfer(struct libusb_transfer *transfer)
+{
+    if (transfer) {
+        if (transfer->flags & LIBUSB_TRANSFER_FREE_BUFFER) {
+            free(transfer->buffer);
+        }
+        MockTransfer *mt = MockTransfer::of(transfer);
+        mt->~MockTransfer();
+        free(mt);
+    }
+}
+
+int LIBUSB_CALL libusb_submit_transfer(struct libusb_transfer *transfer)
+{
+    MockTransfer *mt = MockTransfer::of(transfer);
+    libusb_device *dev = transfer->dev_handle->dev;
+    libusb_context *ctx = dev->ctx;
+
+    if (transfer->type != LIBUSB_TRANSFER_TYPE_BULK || transfer->endpoint != (LIBUSB_ENDPOINT_OUT | 1)) {
+        return LIBUSB_ERROR_NOT_SUPPORTED;
+    }
+
+    tthread::lock_guard<tthread::mutex> lock(ctx->mutex);
+
+    if (mt->inFlight) {
+        return LIBUSB_ERROR_BUSY;
+    }
+
+    mt->cancelled = false;
+    mt->timedOut = false;
+
+    if (dev->stalled) {
+        // Nothing gets through. Time out like libusb would, or wait forever without a timeout.
+        mt->timedOut = true;
+        scheduleLocked(ctx, mt, transfer->timeout ? now() + uint64_t(transfer->timeout) * 1000 : UINT64_MAX);
+        return 0;
+    }
+
+    // Transfers to one device go out back to back, in submission order
+    uint64_t start = std::max(now(), dev->busyUntil);
+    uint64_t wireTime = ctx->bytesPerMicrosecond > 0 ? uint64_t(transfer->length / ctx->bytesPerMicrosecond) : 0;
+    dev->busyUntil = start + wireTime;
+
+    scheduleLocked(ctx, mt, dev->busyUntil + ctx->latency);
+    return 0;
+}
+
+int LIBUSB_CALL libusb_cancel_transfer(struct libusb_transfer *transfer)
+{
+    MockTransfer *mt = MockTransfer::of(transfer);
+    libusb_context *ctx = transfer->dev_handle->dev->ctx;
+
+    tthread::lock_guard<tthread::mutex> lock(ctx->mutex);
+
+    if (!mt->inFlight || mt->cancelled) {
+        return LIBUSB_ERROR_NOT_FOUND;
+    }
+
+    // Complete it on the next event pass, without delivering its data
+    ctx->pending.erase(mt->position);
+    mt->cancelled = true;
+    scheduleLocked(ctx, mt, 0);
+    return 0;
+}
+
+int LIBUSB_CALL libusb_handle_events_timeout_completed(libusb_context *ctx, struct timeval *tv, int *completed)
+{
+    uint64_t deadline = now() + (tv ? uint64_t(tv->tv_sec) * 1000000 + tv->tv_usec : 0);
+    std::vector<libusb_transfer*> done;
+
+    ctx->mutex.lock();
+
+    char buffer[16];
+    while (read(ctx->wakePipe[0], buffer, sizeof buffer) > 0);
+    ctx->wakePending = false;
+
+    // With nothing due yet, wait out the caller's timeout or the next completion
+    if (!ctx->pending.empty()) {
+        uint64_t due = std::min(deadline, ctx->pending.begin()->first);
+        uint64_t t = now();
+        if (due > t) {
+            ctx->mutex.unlock();
+            usleep(due - t);
+            ctx->mutex.lock();
+        }
+    }
+
+    uint64_t t = now();
+    while (!ctx->pending.empty() && ctx->pending.begin()->first <= t) {
+        MockTransfer *mt = ctx->pending.begin()->second;
+        libusb_transfer *transfer = mt->transfer();
+        ctx->pending.erase(ctx->pending.begin());
+        mt->inFlight = false;
+
+        if (mt->cancelled) {
+            transfer->status = LIBUSB_TRANSFER_CANCELLED;
+            transfer->actual_length = 0;
+        } else if (mt->timedOut) {
+            transfer->status = LIBUSB_TRANSFER_TIMED_OUT;
+            transfer->actual_length = 0;
+        } else {
+            decodeTransfer(ctx, transfer->dev_handle->dev, transfer);
+            transfer->status = LIBUSB_TRANSFER_COMPLETED;
+            transfer->actual_length = transfer->length;
+        }
+        done.push_back(transfer);
+    }
+
+    ctx->mutex.unlock();
+
+    // Callbacks may submit more transfers, so they run without the lock
+    for (unsigned i = 0; i < done.size(); ++i) {
+        libusb_transfer *transfer = done[i];
+        bool freeTransfer = transfer->flags & LIBUSB_TRANSFER_FREE_TRANSFER;
+        transfer->callback(transfer);
+        if (freeTransfer) {
+            libusb_free_transfer(transfer);
+        }
+    }
+
+    if (completed) {
+        *completed = 1;
+    }
+    return 0;
+}
+
+int LIBUSB_CALL libusb_get_next_timeout(libusb_context *ctx, struct timeval *tv)
+{
+    tthread::lock_guard<tthread::mutex> lock(ctx->mutex);
+
+    if (ctx->pending.empty()) {
+        return 0;
+    }
+
+    uint64_t due = ctx->pending.begin()->first;
+    uint64_t t = now();
+    uint64_t remaining = due > t ? due - t : 0;
+    tv->tv_sec = remaining / 1000000;
+    tv->tv_usec = remaining % 1000000;
+    return 1;
+}
+
+const struct libusb_pollfd ** LIBUSB_CALL libusb_get_pollfds(libusb_context *ctx)
+{
+    const libusb_pollfd **list = (const libusb_pollfd**) malloc(sizeof(libusb_pollfd*) * 2);
+    if (list) {
+        list[0] = &ctx->pollfd;
+        list[1] = 0;
+    }
+    return list;
+}
+
+void LIBUSB_CALL libusb_set_pollfd_notifiers(libusb_context *ctx, libusb_pollfd_added_cb added_cb,
+    libusb_pollfd_removed_cb removed_cb, void *user_data)
+{
+    // Our only descriptor never changes
+}
+
+int LIBUSB_CALL libusb_hotplug_register_callback(libusb_context *ctx, libusb_hotplug_event events,
+    libusb_hotplug_flag flags, int vendor_id, int product_id, int dev_class,
+    libusb_hotplug_callback_fn cb_fn, void *user_data, libusb_hotplug_callback_handle *handle)
+{
+    // Devices never come or go, so only the initial enumeration is ever reported
+    if ((flags & LIBUSB_HOTPLUG_ENUMERATE) && (events & LIBUSB_HOTPLUG_EVENT_DEVICE_ARRIVED)) {
+        for (unsigned i = 0; i < ctx->devices.size(); ++i) {
+            cb_fn(ctx, ctx->devices[i], LIBUSB_HOTPLUG_EVENT_DEVICE_ARRIVED, user_data);
+        }
+    }
+    if (handle) {
+        *handle = 1;
+    }
+    return 0;
+}
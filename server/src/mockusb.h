@@ -0,0 +1,42 @@
+/*
+ * Mock libusb backend with virtual Fadecandy devices, for testing without hardware
+ *
+ * Copyright (c) 2013 Micah Elizabeth Scott
+ *
+ * Permission is hereby granted, free of charge, to any person obtaining a copy of
+ * this software and associated documentation files (the "Software"), to deal in
+ * the Software without restriction, including without limitation the rights to
+ * use, copy, modify, merge, publish, distribute, sublicense, and/or sell copies of
+ * the Software, and to permit persons to whom the Software is furnished to do so,
+ * subject to the following conditions:
+ *
+ * The above copyright notice and this permission notice shall be included in all
+ * copies or substantial portions of the Software.
+ *
+ * THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+ * IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY, FITNESS
+ * FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL THE AUTHORS OR
+ * COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER LIABILITY, WHETHER
+ * IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING FROM, OUT OF OR IN
+ * CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN THE SOFTWARE.
+ */
+
+#pragma once
+#include <stdint.h>
+
+
+/*
+ * When FCSERVER_MOCK_REPORT names a UDP port (or host:port), the mock backend
+ * sends one of these datagrams for every frame a virtual device decodes. The
+ * stamp is the first four bytes of the frame's pixel data, which lets a load
+ * generator tag each frame it sends and match it up with its completion.
+ *
+ * Fields are in host byte order; the report is only meant for the local machine.
+ */
+
+struct MockUSBReport
+{
+    uint32_t device;        // Index of the virtual device
+    uint32_t stamp;         // First four bytes of the decoded frame
+    uint64_t timestamp;     // CLOCK_MONOTONIC at completion, in microseconds
+};
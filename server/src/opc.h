@@ -34,7 +34,8 @@ namespace OPC {
     // SysEx system and command IDs
     enum SysEx {
         FCSetGlobalColorCorrection = 0x00010001,
-        FCSetFirmwareConfiguration = 0x00010002
+        FCSetFirmwareConfiguration = 0x00010002,
+        FCFlowControl = 0x00010003
     };
 
     struct Message
@@ -53,40 +54,21 @@ namespace OPC {
             lenLow = (uint8_t) l;
             lenHigh = (uint8_t) (l >> 8);
         }
+
+        // Combined system and command ID of a SysEx message, or zero if it's too short
+        unsigned sysExID() const {
+            if (length() < 4) {
+                return 0;
+            }
+            return (unsigned(data[0]) << 24) |
+                   (unsigned(data[1]) << 16) |
+                   (unsigned(data[2]) << 8)  |
+                    unsigned(data[3])        ;
+        }
     };
 
     static const unsigned HEADER_BYTES = 4;
 
     typedef void (*callback_t)(Message &msg, void *context);
 
-    // Common idiom for choosing color channels based on a character string
-    inline bool pickColorChannel(uint8_t &output, char selector, const uint8_t *rgb)
-    {
-        switch (selector) {
-
-            case 'r':
-            case 'R':
-                output = rgb[0];
-                return true;
-
-            case 'g':
-            case 'G':
-                output = rgb[1];
-                return true;
-
-            case 'b':
-            case 'B':
-                output = rgb[2];
-                return true;
-
-            case 'l':
-            case 'L':
-                output = (unsigned(rgb[0]) + unsigned(rgb[1]) + unsigned(rgb[2])) / 3;
-                return true;
-
-            default:
-                return false;
-        }
-    }
-
 }
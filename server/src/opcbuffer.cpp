@@ -0,0 +1,113 @@
+/*
+ * Pooled receive buffers for partial Open Pixel Control messages
+ *
+ * Copyright (c) 2013 Micah Elizabeth Scott
+ *
+ * Permission is hereby granted, free of charge, to any person obtaining a copy of
+ * this software and associated documentation files (the "Software"), to deal in
+ * the Software without restriction, including without limitation the rights to
+ * use, copy, modify, merge, publish, distribute, sublicense, and/or sell copies of
+ * the Software, and to permit persons to whom the Software is furnished to do so,
+ * subject to the following conditions:
+ *
+ * The above copyright notice and this permission notice shall be included in all
+ * copies or substantial portions of the Software.
+ *
+ * THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+ * IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY, FITNESS
+ * FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL THE AUTHORS OR
+ * COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER LIABILITY, WHETHER
+ * IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING FROM, OUT OF OR IN
+ * CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN THE SOFTWARE.
+ */
+
+#include "opcbuffer.h"
+#include <stdlib.h>
+#include <string.h>
+
+
+OPCBufferPool::OPCBufferPool()
+    : mBytesInUse(0),
+      mBytesPooled(0)
+{
+    memset(mFree, 0, sizeof mFree);
+    memset(mFreeCount, 0, sizeof mFreeCount);
+}
+
+OPCBufferPool::~OPCBufferPool()
+{
+    for (unsigned i = 0; i < NUM_CLASSES; i++) {
+        while (mFree[i]) {
+            OPCBuffer *buffer = mFree[i];
+            mFree[i] = buffer->next;
+            free(buffer);
+        }
+    }
+}
+
+unsigned OPCBufferPool::classCapacity(unsigned sizeClass)
+{
+    return MIN_SIZE << sizeClass;
+}
+
+OPCBuffer *OPCBufferPool::alloc(size_t size)
+{
+    unsigned sizeClass = 0;
+    while (classCapacity(sizeClass) < size) {
+        if (++sizeClass == NUM_CLASSES) {
+            return 0;
+        }
+    }
+
+    unsigned bytes = sizeof(OPCBuffer) + classCapacity(sizeClass);
+    OPCBuffer *buffer = mFree[sizeClass];
+
+    if (buffer) {
+        mFree[sizeClass] = buffer->next;
+        mFreeCount[sizeClass]--;
+        mBytesPooled -= bytes;
+    } else {
+        buffer = (OPCBuffer*) malloc(bytes);
+        if (!buffer) {
+            return 0;
+        }
+        buffer->sizeClass = sizeClass;
+    }
+
+    buffer->length = 0;
+    buffer->next = 0;
+    mBytesInUse += bytes;
+    return buffer;
+}
+
+OPCBuffer *OPCBufferPool::grow(OPCBuffer *buffer, size_t size)
+{
+    if (size <= buffer->capacity()) {
+        return buffer;
+    }
+
+    OPCBuffer *bigger = alloc(size);
+    if (bigger) {
+        memcpy(bigger->data(), buffer->data(), buffer->length);
+        bigger->length = buffer->length;
+    }
+    release(buffer);
+    return bigger;
+}
+
+void OPCBufferPool::release(OPCBuffer *buffer)
+{
+    unsigned sizeClass = buffer->sizeClass;
+    unsigned bytes = sizeof(OPCBuffer) + classCapacity(sizeClass);
+    mBytesInUse -= bytes;
+
+    if (mFreeCount[sizeClass] >= MAX_POOLED) {
+        free(buffer);
+        return;
+    }
+
+    buffer->next = mFree[sizeClass];
+    mFree[sizeClass] = buffer;
+    mFreeCount[sizeClass]++;
+    mBytesPooled += bytes;
+}
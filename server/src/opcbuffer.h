@@ -0,0 +1,92 @@
+/*
+ * Pooled receive buffers for partial Open Pixel Control messages
+ *
+ * Copyright (c) 2013 Micah Elizabeth Scott
+ *
+ * Permission is hereby granted, free of charge, to any person obtaining a copy of
+ * this software and associated documentation files (the "Software"), to deal in
+ * the Software without restriction, including without limitation the rights to
+ * use, copy, modify, merge, publish, distribute, sublicense, and/or sell copies of
+ * the Software, and to permit persons to whom the Software is furnished to do so,
+ * subject to the following conditions:
+ *
+ * The above copyright notice and this permission notice shall be included in all
+ * copies or substantial portions of the Software.
+ *
+ * THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+ * IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY, FITNESS
+ * FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL THE AUTHORS OR
+ * COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER LIABILITY, WHETHER
+ * IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING FROM, OUT OF OR IN
+ * CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN THE SOFTWARE.
+ */
+
+#pragma once
+#include <stdint.h>
+#include <stddef.h>
+#include "opc.h"
+
+
+/*
+ * Holds the start of an OPC message that didn't arrive in a single read, until the
+ * rest of it does. Complete messages are handled straight from the read buffer, so
+ * a client only has one of these while it's partway through a message.
+ */
+
+struct OPCBuffer {
+    unsigned length;        // Bytes held
+    unsigned sizeClass;     // See OPCBufferPool
+    OPCBuffer *next;        // While pooled
+
+    uint8_t *data() { return reinterpret_cast<uint8_t*>(this + 1); }
+    unsigned capacity() const;
+};
+
+
+/*
+ * Buffers come in power-of-two size classes, from enough for a protocol-detect header
+ * or a short message up to the largest OPC message. Freed buffers are kept on a list
+ * per class for the next partial message, up to a limit.
+ *
+ * Not thread-safe. Only the network thread uses these.
+ */
+
+class OPCBufferPool
+{
+public:
+    static const unsigned MIN_SIZE = 64;
+    static const unsigned MAX_SIZE = sizeof(OPC::Message);
+    static const unsigned MAX_POOLED = 16;      // Free buffers kept per size class
+
+    OPCBufferPool();
+    ~OPCBufferPool();
+
+    // A new empty buffer for at least 'size' bytes, or zero if we're out of memory
+    OPCBuffer *alloc(size_t size);
+
+    // Make room for at least 'size' bytes, keeping the contents. Zero if out of memory,
+    // in which case the original buffer is released.
+    OPCBuffer *grow(OPCBuffer *buffer, size_t size);
+
+    void release(OPCBuffer *buffer);
+
+    // Memory held by buffers in use, and by buffers waiting in the pool
+    size_t getBytesInUse() const { return mBytesInUse; }
+    size_t getBytesPooled() const { return mBytesPooled; }
+
+    static unsigned classCapacity(unsigned sizeClass);
+
+private:
+    static const unsigned NUM_CLASSES = 12;     // Through 128 kB, enough for MAX_SIZE
+
+    OPCBuffer *mFree[NUM_CLASSES];
+    unsigned mFreeCount[NUM_CLASSES];
+    size_t mBytesInUse;
+    size_t mBytesPooled;
+};
+
+
+inline unsigned OPCBuffer::capacity() const
+{
+    return OPCBufferPool::classCapacity(sizeClass);
+}
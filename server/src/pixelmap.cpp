@@ -0,0 +1,287 @@
+/*
+ * Compiled pixel mapping for Open Pixel Control devices.
+ *
+ * Copyright (c) 2013 Micah Elizabeth Scott
+ *
+ * Permission is hereby granted, free of charge, to any person obtaining a copy of
+ * this software and associated documentation files (the "Software"), to deal in
+ * the Software without restriction, including without limitation the rights to
+ * use, copy, modify, merge, publish, distribute, sublicense, and/or sell copies of
+ * the Software, and to permit persons to whom the Software is furnished to do so,
+ * subject to the following conditions:
+ *
+ * The above copyright notice and this permission notice shall be included in all
+ * copies or substantial portions of the Software.
+ *
+ * THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+ * IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY, FITNESS
+ * FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL THE AUTHORS OR
+ * COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER LIABILITY, WHETHER
+ * IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING FROM, OUT OF OR IN
+ * CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN THE SOFTWARE.
+ */
+
+#include "pixelmap.h"
+#include "rapidjson/stringbuffer.h"
+#include "rapidjson/writer.h"
+#include <iostream>
+#include <string.h>
+
+// No OPC message can hold more pixels than this
+static const unsigned kMaxOPCPixels = 0xFFFF / 3;
+
+
+PixelMap::PixelMap()
+{
+    clear();
+}
+
+void PixelMap::clear()
+{
+    mOps.clear();
+    mChannelOps.clear();
+    memset(mChannelStart, 0, sizeof mChannelStart);
+    memset(mChannelInputEnd, 0, sizeof mChannelInputEnd);
+}
+
+void PixelMap::buildChannelIndex()
+{
+    /*
+     * Group our ops by OPC channel, so a message only visits the ops that can use it.
+     * CONSTANT ops don't read from any channel. They're repeated in the run for every
+     * channel we use, so they keep their place relative to the ops around them.
+     */
+
+    bool used[NUM_CHANNELS];
+    memset(used, 0, sizeof used);
+    memset(mChannelInputEnd, 0, sizeof mChannelInputEnd);
+
+    for (iterator i = mOps.begin(), e = mOps.end(); i != e; ++i) {
+        if (i->type != CONSTANT) {
+            used[i->channel] = true;
+            mChannelInputEnd[i->channel] = std::max(mChannelInputEnd[i->channel], i->firstOPC + i->count);
+        }
+    }
+
+    mChannelOps.clear();
+    for (unsigned channel = 0; channel < NUM_CHANNELS; channel++) {
+        mChannelStart[channel] = mChannelOps.size();
+        if (used[channel]) {
+            for (iterator i = mOps.begin(), e = mOps.end(); i != e; ++i) {
+                if (i->type == CONSTANT || i->channel == channel) {
+                    mChannelOps.push_back(*i);
+                }
+            }
+        }
+    }
+    mChannelStart[NUM_CHANNELS] = mChannelOps.size();
+}
+
+bool PixelMap::parseColor(uint8_t &color, char selector)
+{
+    switch (selector) {
+
+        case 'r':
+        case 'R':
+            color = RED;
+            return true;
+
+        case 'g':
+        case 'G':
+            color = GREEN;
+            return true;
+
+        case 'b':
+        case 'B':
+            color = BLUE;
+            return true;
+
+        case 'l':
+        case 'L':
+            color = LUMINANCE;
+            return true;
+
+        default:
+            return false;
+    }
+}
+
+bool PixelMap::addRange(const Value &inst, unsigned numOutputs, bool allowColorChannels)
+{
+    /*
+     * Compile a range mapping instruction:
+     *
+     *   [ OPC Channel, First OPC Pixel, First output pixel, Pixel count ]
+     *   [ OPC Channel, First OPC Pixel, First output pixel, Pixel count, Color channels ]
+     *
+     * A negative pixel count maps the range in reverse order, starting at the
+     * first output pixel and decrementing.
+     */
+
+    if (!inst.IsArray() || !(inst.Size() == 4 || (allowColorChannels && inst.Size() == 5))) {
+        return false;
+    }
+
+    const Value &vChannel = inst[0u];
+    const Value &vFirstOPC = inst[1];
+    const Value &vFirstOut = inst[2];
+    const Value &vCount = inst[3];
+
+    if (!(vChannel.IsUint() && vFirstOPC.IsUint() && vFirstOut.IsUint() && vCount.IsInt())) {
+        return false;
+    }
+
+    Op op;
+    memset(&op, 0, sizeof op);
+    op.colors[0] = RED;
+    op.colors[1] = GREEN;
+    op.colors[2] = BLUE;
+
+    if (inst.Size() == 5) {
+        const Value &vColorChannels = inst[4];
+        if (!vColorChannels.IsString() || vColorChannels.GetStringLength() != 3) {
+            return false;
+        }
+
+        const char *colorChannels = vColorChannels.GetString();
+        for (unsigned c = 0; c < 3; c++) {
+            if (!parseColor(op.colors[c], colorChannels[c])) {
+                return false;
+            }
+        }
+    }
+
+    if (vChannel.GetUint() > 0xFF) {
+        // Well-formed, but no OPC message can ever match it.
+        return true;
+    }
+
+    op.channel = vChannel.GetUint();
+    op.firstOPC = std::min<unsigned>(vFirstOPC.GetUint(), kMaxOPCPixels);
+    unsigned firstOut = std::min<unsigned>(vFirstOut.GetUint(), numOutputs);
+    unsigned count;
+
+    if (vCount.GetInt() >= 0) {
+        count = vCount.GetInt();
+        op.direction = 1;
+    } else {
+        count = 0u - unsigned(vCount.GetInt());
+        op.direction = -1;
+    }
+
+    if (op.direction < 0 && firstOut == numOutputs && count && numOutputs) {
+        // Reversed run starting just past the end of the output. Skip that pixel.
+        op.firstOPC++;
+        firstOut--;
+        count--;
+    }
+
+    // Clamp to the output, overflow-safe
+    count = std::min<unsigned>(count, op.direction > 0 ? numOutputs - firstOut : firstOut + 1);
+    count = std::min<unsigned>(count, kMaxOPCPixels);
+
+    if (!count) {
+        // Well-formed, but there's nothing to copy.
+        return true;
+    }
+
+    op.firstOut = firstOut;
+    op.count = count;
+
+    if (op.colors[0] != RED || op.colors[1] != GREEN || op.colors[2] != BLUE) {
+        op.type = SWIZZLE;
+    } else if (op.direction > 0) {
+        op.type = COPY;
+    } else {
+        op.type = COPY_REVERSE;
+    }
+
+    mOps.push_back(op);
+    return true;
+}
+
+bool PixelMap::addPick(const Value &inst)
+{
+    /*
+     * Compile a single-channel instruction:
+     *
+     *   [ OPC Channel, OPC Pixel, Pixel Color, Output index ]
+     *
+     * This becomes a one-pixel SWIZZLE op. Only colors[0] is meaningful.
+     */
+
+    if (!inst.IsArray() || inst.Size() != 4) {
+        return false;
+    }
+
+    const Value &vChannel = inst[0u];
+    const Value &vPixelIndex = inst[1];
+    const Value &vPixelColor = inst[2];
+    const Value &vOutput = inst[3];
+
+    if (!(vChannel.IsUint() && vPixelIndex.IsUint() && vPixelColor.IsString() && vOutput.IsUint())) {
+        return false;
+    }
+
+    Op op;
+    memset(&op, 0, sizeof op);
+
+    if (!parseColor(op.colors[0], vPixelColor.GetString()[0])) {
+        return false;
+    }
+
+    if (vChannel.GetUint() > 0xFF || vPixelIndex.GetUint() >= kMaxOPCPixels) {
+        // Well-formed, but no OPC message can ever match it.
+        return true;
+    }
+
+    op.type = SWIZZLE;
+    op.channel = vChannel.GetUint();
+    op.colors[1] = op.colors[2] = op.colors[0];
+    op.direction = 1;
+    op.firstOPC = vPixelIndex.GetUint();
+    op.firstOut = vOutput.GetUint();
+    op.count = 1;
+
+    mOps.push_back(op);
+    return true;
+}
+
+bool PixelMap::addConstant(const Value &inst)
+{
+    /*
+     * Compile a constant instruction:
+     *
+     *   [ Value, Output index ]
+     */
+
+    if (!inst.IsArray() || inst.Size() != 2) {
+        return false;
+    }
+
+    const Value &vValue = inst[0u];
+    const Value &vOutput = inst[1];
+
+    if (!(vValue.IsUint() && vOutput.IsUint())) {
+        return false;
+    }
+
+    Op op;
+    memset(&op, 0, sizeof op);
+    op.type = CONSTANT;
+    op.value = vValue.GetUint();
+    op.direction = 1;
+    op.firstOut = vOutput.GetUint();
+    op.count = 1;
+
+    mOps.push_back(op);
+    return true;
+}
+
+void PixelMap::logUnsupported(const Value &inst)
+{
+    rapidjson::GenericStringBuffer<rapidjson::UTF8<> > buffer;
+    rapidjson::Writer<rapidjson::GenericStringBuffer<rapidjson::UTF8<> > > writer(buffer);
+    inst.Accept(writer);
+    std::clog << "Unsupported JSON mapping instruction: " << buffer.GetString() << "\n";
+}
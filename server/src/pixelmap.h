@@ -0,0 +1,136 @@
+/*
+ * Compiled pixel mapping for Open Pixel Control devices.
+ *
+ * Copyright (c) 2013 Micah Elizabeth Scott
+ *
+ * Permission is hereby granted, free of charge, to any person obtaining a copy of
+ * this software and associated documentation files (the "Software"), to deal in
+ * the Software without restriction, including without limitation the rights to
+ * use, copy, modify, merge, publish, distribute, sublicense, and/or sell copies of
+ * the Software, and to permit persons to whom the Software is furnished to do so,
+ * subject to the following conditions:
+ *
+ * The above copyright notice and this permission notice shall be included in all
+ * copies or substantial portions of the Software.
+ *
+ * THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+ * IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY, FITNESS
+ * FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL THE AUTHORS OR
+ * COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER LIABILITY, WHETHER
+ * IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING FROM, OUT OF OR IN
+ * CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN THE SOFTWARE.
+ */
+
+#pragma once
+#include "rapidjson/document.h"
+#include <stdint.h>
+#include <vector>
+#include <algorithm>
+
+
+/*
+ * A device's "map" is a JSON list of mapping instructions. Instead of walking
+ * that JSON for every OPC message, devices compile it once when the configuration
+ * is loaded. Type checks, color channel parsing, and clamping against the size of
+ * the device's output all happen here, so the per-frame code only has to clamp
+ * each operation against the length of the incoming message.
+ */
+
+class PixelMap
+{
+public:
+    typedef rapidjson::Value Value;
+
+    enum OpType {
+        COPY = 0,           // Contiguous run of pixels, in order
+        COPY_REVERSE,       // Contiguous run of pixels, output index decreasing
+        SWIZZLE,            // Run of pixels with color channel selection, either direction
+        CONSTANT,           // Constant value for one output, no OPC input
+    };
+
+    // Precomputed color channel selectors
+    enum Color {
+        RED = 0,
+        GREEN,
+        BLUE,
+        LUMINANCE,
+    };
+
+    struct Op {
+        uint8_t type;
+        uint8_t channel;        // OPC channel (not used for CONSTANT)
+        uint8_t colors[3];      // Color selectors (SWIZZLE only)
+        uint8_t value;          // Constant value (CONSTANT only)
+        int direction;          // +1 or -1
+        unsigned firstOPC;      // First OPC pixel
+        unsigned firstOut;      // First output index
+        unsigned count;         // Pixel count, already clamped to the output size
+    };
+
+    typedef std::vector<Op>::const_iterator iterator;
+
+    PixelMap();
+
+    void clear();
+    bool empty() const { return mOps.empty(); }
+    unsigned size() const { return mOps.size(); }
+
+    // All ops, in configuration order
+    iterator begin() const { return mOps.begin(); }
+    iterator end() const { return mOps.end(); }
+
+    /*
+     * Ops grouped by OPC channel. buildChannelIndex() must be called after the
+     * last instruction is added. Each channel's run keeps configuration order.
+     */
+
+    void buildChannelIndex();
+    bool usesChannel(unsigned channel) const { return mChannelStart[channel] != mChannelStart[channel + 1]; }
+    iterator channelBegin(unsigned channel) const { return mChannelOps.begin() + mChannelStart[channel]; }
+    iterator channelEnd(unsigned channel) const { return mChannelOps.begin() + mChannelStart[channel + 1]; }
+
+    // One past the last OPC pixel any op reads from a channel. Once a message has
+    // that many pixels, the rest of it makes no difference to this map.
+    unsigned channelInputEnd(unsigned channel) const { return mChannelInputEnd[channel]; }
+
+    /*
+     * Instruction compilers. Each returns false if the instruction isn't
+     * of the expected form, in which case nothing is added.
+     */
+
+    // [ OPC Channel, First OPC Pixel, First output pixel, Pixel count (, Color channels) ]
+    bool addRange(const Value &inst, unsigned numOutputs, bool allowColorChannels);
+
+    // [ OPC Channel, OPC Pixel, Pixel Color, Output index ]
+    bool addPick(const Value &inst);
+
+    // [ Value, Output index ]
+    bool addConstant(const Value &inst);
+
+    // Verbose logging for instructions no compiler accepted
+    static void logUnsupported(const Value &inst);
+
+    // Number of pixels an op can copy from a message containing 'msgPixelCount' pixels
+    static unsigned inputCount(const Op &op, unsigned msgPixelCount) {
+        return op.firstOPC < msgPixelCount ? std::min<unsigned>(op.count, msgPixelCount - op.firstOPC) : 0;
+    }
+
+    static uint8_t pickColor(uint8_t color, const uint8_t *rgb) {
+        switch (color) {
+            case RED:   return rgb[0];
+            case GREEN: return rgb[1];
+            case BLUE:  return rgb[2];
+            default:    return (unsigned(rgb[0]) + unsigned(rgb[1]) + unsigned(rgb[2])) / 3;
+        }
+    }
+
+    static bool parseColor(uint8_t &color, char selector);
+
+    static const unsigned NUM_CHANNELS = 256;
+
+private:
+    std::vector<Op> mOps;
+    std::vector<Op> mChannelOps;
+    unsigned mChannelStart[NUM_CHANNELS + 1];
+    unsigned mChannelInputEnd[NUM_CHANNELS];
+};
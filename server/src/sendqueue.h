@@ -0,0 +1,139 @@
+/*
+ * Shared send buffers, and short per-client queues of them
+ *
+ * Copyright (c) 2013 Micah Elizabeth Scott
+ *
+ * Permission is hereby granted, free of charge, to any person obtaining a copy of
+ * this software and associated documentation files (the "Software"), to deal in
+ * the Software without restriction, including without limitation the rights to
+ * use, copy, modify, merge, publish, distribute, sublicense, and/or sell copies of
+ * the Software, and to permit persons to whom the Software is furnished to do so,
+ * subject to the following conditions:
+ *
+ * The above copyright notice and this permission notice shall be included in all
+ * copies or substantial portions of the Software.
+ *
+ * THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+ * IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY, FITNESS
+ * FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL THE AUTHORS OR
+ * COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER LIABILITY, WHETHER
+ * IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING FROM, OUT OF OR IN
+ * CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN THE SOFTWARE.
+ */
+
+#pragma once
+#include <stdint.h>
+#include <stdlib.h>
+#include <string.h>
+#include <new>
+#include <atomic>
+#include "libwebsockets.h"
+
+
+/*
+ * One message on its way to any number of clients, with the padding that
+ * libwebsocket_write() needs on either side. It's freed when the last queue
+ * holding it lets it go, so it may be released on any thread.
+ */
+
+struct SendBuffer {
+    std::atomic<unsigned> refs;
+    unsigned length;
+    bool coalesce;      // Carries complete state, so a newer one makes it pointless to send
+
+    // A copy of 'data' with one reference held by the caller, or zero if we're out of memory
+    static SendBuffer *create(const void *data, unsigned length, bool coalesce = false);
+
+    uint8_t *data() { return reinterpret_cast<uint8_t*>(this + 1) + LWS_SEND_BUFFER_PRE_PADDING; }
+    void ref() { refs++; }
+    void unref() { if (--refs == 0) free(this); }
+};
+
+
+/*
+ * A short, fixed-size queue of buffers for one client. Queues live in libwebsockets
+ * per-session data, which starts out zeroed, so an all-zero queue is an empty one.
+ *
+ * Not thread-safe. Whoever owns the client locks around it if needed.
+ */
+
+class SendQueue
+{
+public:
+    static const unsigned DEPTH = 16;
+
+    bool empty() const { return mCount == 0; }
+    bool full() const { return mCount == DEPTH; }
+    unsigned size() const { return mCount; }
+
+    // Adds a reference to the buffer. The queue must not be full.
+    void push(SendBuffer *buffer);
+
+    // The oldest buffer, whose reference now belongs to the caller
+    SendBuffer *pop();
+
+    // Release every queued buffer that's marked 'coalesce', keeping the others in order.
+    // Returns how many were dropped.
+    unsigned dropCoalesced();
+
+    void clear();
+
+private:
+    SendBuffer *mItems[DEPTH];
+    unsigned mHead;
+    unsigned mCount;
+};
+
+
+inline SendBuffer *SendBuffer::create(const void *data, unsigned length, bool coalesce)
+{
+    void *mem = malloc(sizeof(SendBuffer) + LWS_SEND_BUFFER_PRE_PADDING + length + LWS_SEND_BUFFER_POST_PADDING);
+    if (!mem) {
+        return 0;
+    }
+
+    SendBuffer *buffer = new (mem) SendBuffer;
+    buffer->refs = 1;
+    buffer->length = length;
+    buffer->coalesce = coalesce;
+    memcpy(buffer->data(), data, length);
+    return buffer;
+}
+
+inline void SendQueue::push(SendBuffer *buffer)
+{
+    buffer->ref();
+    mItems[(mHead + mCount) % DEPTH] = buffer;
+    mCount++;
+}
+
+inline SendBuffer *SendQueue::pop()
+{
+    SendBuffer *buffer = mItems[mHead];
+    mHead = (mHead + 1) % DEPTH;
+    mCount--;
+    return buffer;
+}
+
+inline unsigned SendQueue::dropCoalesced()
+{
+    unsigned count = mCount;
+    unsigned kept = 0;
+    for (unsigned i = 0; i < mCount; i++) {
+        SendBuffer *buffer = mItems[(mHead + i) % DEPTH];
+        if (buffer->coalesce) {
+            buffer->unref();
+        } else {
+            mItems[(mHead + kept++) % DEPTH] = buffer;
+        }
+    }
+    mCount = kept;
+    return count - kept;
+}
+
+inline void SendQueue::clear()
+{
+    while (mCount) {
+        pop()->unref();
+    }
+}
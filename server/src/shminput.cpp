@@ -0,0 +1,203 @@
+/*
+ * Shared-memory pixel input for renderers on the same machine
+ *
+ * Copyright (c) 2013 Micah Elizabeth Scott
+ *
+ * Permission is hereby granted, free of charge, to any person obtaining a copy of
+ * this software and associated documentation files (the "Software"), to deal in
+ * the Software without restriction, including without limitation the rights to
+ * use, copy, modify, merge, publish, distribute, sublicense, and/or sell copies of
+ * the Software, and to permit persons to whom the Software is furnished to do so,
+ * subject to the following conditions:
+ *
+ * The above copyright notice and this permission notice shall be included in all
+ * copies or substantial portions of the Software.
+ *
+ * THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+ * IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY, FITNESS
+ * FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL THE AUTHORS OR
+ * COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER LIABILITY, WHETHER
+ * IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING FROM, OUT OF OR IN
+ * CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN THE SOFTWARE.
+ */
+
+#ifdef OS_LINUX
+
+#include "shminput.h"
+#include "trace.h"
+#include <iostream>
+#include <stdlib.h>
+#include <string.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <unistd.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <sys/syscall.h>
+#include <linux/futex.h>
+
+
+ShmInput::ShmInput(OPC::callback_t opcCallback, void *context, bool verbose)
+    : mOpcCallback(opcCallback), mUserContext(context), mVerbose(verbose),
+      mSegment(0), mSegmentSize(0), mHeader(0), mCanvases(0), mFront(0),
+      mCanvasCount(0), mSlotSize(0),
+      mLoop(0), mThread(0), mFrames(0), mMalformed(0)
+{}
+
+ShmInput::~ShmInput()
+{
+    // The doorbell thread never exits, so this only cleans up after a failed start()
+    if (mSegment) {
+        munmap(mSegment, mSegmentSize);
+        shm_unlink(mName.c_str());
+    }
+    delete[] mFront;
+}
+
+bool ShmInput::start(EventLoop &loop, const char *name, unsigned canvases)
+{
+    uint32_t slotSize = (sizeof(OPC::Message) + 63) & ~63;
+    mName = name;
+    mSegmentSize = sizeof(Header) + canvases * (sizeof(Canvas) + SLOTS * size_t(slotSize));
+
+    // Start from scratch, even if an old server left its segment behind
+    shm_unlink(name);
+    int fd = shm_open(name, O_RDWR | O_CREAT | O_EXCL, 0600);
+    if (fd < 0) {
+        std::clog << "Can't create shared memory " << name << ": " << strerror(errno) << "\n";
+        return false;
+    }
+
+    if (ftruncate(fd, mSegmentSize) < 0) {
+        std::clog << "Can't size shared memory " << name << ": " << strerror(errno) << "\n";
+        close(fd);
+        shm_unlink(name);
+        return false;
+    }
+
+    void *addr = mmap(0, mSegmentSize, PROT_READ | PROT_WRITE, MAP_SHARED, fd, 0);
+    close(fd);
+    if (addr == MAP_FAILED) {
+        std::clog << "Can't map shared memory " << name << ": " << strerror(errno) << "\n";
+        shm_unlink(name);
+        return false;
+    }
+
+    /*
+     * The segment starts out zeroed. Give each canvas its slots: the producer writes
+     * slot 0 first, slot 1 waits as the (stale) ready one, and we hold slot 2.
+     * The magic number goes in last, so producers don't attach to a half-built segment.
+     */
+
+    mSegment = (uint8_t*) addr;
+    mHeader = (Header*) mSegment;
+    mCanvases = (Canvas*) (mHeader + 1);
+    mFront = new uint32_t[canvases];
+    mCanvasCount = canvases;
+    mSlotSize = slotSize;
+
+    mHeader->version = VERSION;
+    mHeader->canvases = canvases;
+    mHeader->slotSize = slotSize;
+
+    for (unsigned i = 0; i < canvases; i++) {
+        mCanvases[i].back = 0;
+        mCanvases[i].ready = 1;
+        mFront[i] = 2;
+    }
+
+    std::atomic_thread_fence(std::memory_order_release);
+    mHeader->magic = MAGIC;
+
+    if (mVerbose) {
+        std::clog << "Shared memory input " << name << " ready, with " << canvases << " canvases.\n";
+    }
+
+    mLoop = &loop;
+    mThread = new tthread::thread(doorbellThreadFunc, this);
+    return true;
+}
+
+uint8_t *ShmInput::slot(unsigned canvas, unsigned index)
+{
+    uint8_t *slots = (uint8_t*) (mCanvases + mCanvasCount);
+    return slots + (canvas * SLOTS + index) * mSlotSize;
+}
+
+void ShmInput::doorbellThreadFunc(void *arg)
+{
+    /*
+     * Wake the network thread each time the doorbell rings. We only mark ourselves as
+     * sleeping just before waiting, so while frames keep coming, producers don't need
+     * to make any system calls at all.
+     */
+
+    ShmInput *self = static_cast<ShmInput*>(arg);
+    std::atomic<uint32_t> &doorbell = self->mHeader->doorbell;
+    std::atomic<uint32_t> &sleeping = self->mHeader->sleeping;
+    uint32_t seen = doorbell.load();
+
+    for (;;) {
+        uint32_t current = doorbell.load();
+
+        if (current == seen) {
+            sleeping.store(1);
+            if (doorbell.load() == seen) {
+                syscall(SYS_futex, &doorbell, FUTEX_WAIT, seen, NULL, NULL, 0);
+            }
+            sleeping.store(0);
+            continue;
+        }
+
+        seen = current;
+        self->mLoop->wake();
+    }
+}
+
+void ShmInput::poll()
+{
+    /*
+     * Take the newest frame from each canvas that has one, and hand it straight to the
+     * OPC callback. It stays ours until the next one is published, so the producer
+     * never writes to it while we're mapping.
+     */
+
+    for (unsigned i = 0; i != mCanvasCount; i++) {
+        Canvas &canvas = mCanvases[i];
+        if (!(canvas.ready.load(std::memory_order_relaxed) & FRESH)) {
+            continue;
+        }
+
+        mFront[i] = canvas.ready.exchange(mFront[i], std::memory_order_acq_rel) & ~FRESH;
+        if (mFront[i] >= SLOTS) {
+            // Scribbled on by the producer. Nothing we can trust in this canvas until the next frame.
+            mFront[i] = 2;
+            mMalformed++;
+            continue;
+        }
+
+        TRACE_SCOPE("shmRead", Trace::LANE_NETWORK, "canvas", i);
+        OPC::Message *msg = (OPC::Message*) slot(i, mFront[i]);
+        mFrames++;
+        mOpcCallback(*msg, mUserContext);
+    }
+}
+
+void ShmInput::writeMetrics(Metrics::Writer &writer)
+{
+    uint64_t published = 0;
+    for (unsigned i = 0; i != mCanvasCount; i++) {
+        published += mCanvases[i].published.load(std::memory_order_relaxed);
+    }
+
+    writer.family("fcserver_shm_frames_published_total", "counter", "Frames producers published to shared memory.");
+    writer.sample("fcserver_shm_frames_published_total", "", published);
+
+    writer.family("fcserver_shm_frames_total", "counter", "Frames taken from shared memory and mapped.");
+    writer.sample("fcserver_shm_frames_total", "", mFrames);
+
+    writer.family("fcserver_shm_errors_total", "counter", "Shared memory canvases found in an inconsistent state.");
+    writer.sample("fcserver_shm_errors_total", "", mMalformed);
+}
+
+#endif  // OS_LINUX
@@ -0,0 +1,120 @@
+/*
+ * Shared-memory pixel input for renderers on the same machine
+ *
+ * Copyright (c) 2013 Micah Elizabeth Scott
+ *
+ * Permission is hereby granted, free of charge, to any person obtaining a copy of
+ * this software and associated documentation files (the "Software"), to deal in
+ * the Software without restriction, including without limitation the rights to
+ * use, copy, modify, merge, publish, distribute, sublicense, and/or sell copies of
+ * the Software, and to permit persons to whom the Software is furnished to do so,
+ * subject to the following conditions:
+ *
+ * The above copyright notice and this permission notice shall be included in all
+ * copies or substantial portions of the Software.
+ *
+ * THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+ * IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY, FITNESS
+ * FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL THE AUTHORS OR
+ * COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER LIABILITY, WHETHER
+ * IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING FROM, OUT OF OR IN
+ * CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN THE SOFTWARE.
+ */
+
+#pragma once
+#ifdef OS_LINUX
+#include <stdint.h>
+#include <atomic>
+#include <string>
+#include "eventloop.h"
+#include "metrics.h"
+#include "tinythread.h"
+#include "opc.h"
+
+
+/*
+ * Lets a renderer on the same machine hand us OPC messages through a POSIX shared
+ * memory segment, without a socket. We create the segment; producers map it, write
+ * each frame straight into a slot, and publish it.
+ *
+ * The segment holds one or more canvases. Each is a triple buffer of slots big enough
+ * for any OPC message: the producer owns one slot, we own another, and the third
+ * holds the newest published frame. Publishing swaps the producer's slot with that
+ * one, and we swap ours in whenever it's been refreshed, so neither side ever waits
+ * for the other or sees a torn frame. Frames published faster than we take them are
+ * simply replaced.
+ *
+ * After publishing, the producer rings a doorbell: a counter it bumps, and wakes with
+ * a futex only if we're asleep on it. A helper thread waits on the doorbell and wakes
+ * the network thread's event loop, which maps the frames straight out of the slots.
+ *
+ * The layout below is shared with the producer helper in examples/cpp/lib/opc_shm.h.
+ * Linux only, since it relies on futexes.
+ */
+
+class ShmInput
+{
+public:
+    static const uint32_t MAGIC = 0x48534346;      // "FCSH"
+    static const uint32_t VERSION = 1;
+    static const uint32_t SLOTS = 3;
+    static const uint32_t FRESH = 0x80000000;      // In 'ready', once published and not yet taken
+
+    // Start of the segment, one cache line
+    struct Header {
+        uint32_t magic;
+        uint32_t version;
+        uint32_t canvases;
+        uint32_t slotSize;                  // Bytes per slot, a multiple of 64
+        std::atomic<uint32_t> doorbell;     // Bumped by the producer after publishing
+        std::atomic<uint32_t> sleeping;     // Nonzero while we wait on the doorbell
+        uint32_t reserved[10];
+    };
+
+    // One per canvas, after the header. Slots follow, canvas by canvas.
+    struct Canvas {
+        std::atomic<uint32_t> ready;        // Newest published slot, plus FRESH
+        std::atomic<uint32_t> back;         // Slot the producer writes next. Producer only.
+        std::atomic<uint32_t> published;    // Frames published, for statistics
+        uint32_t reserved[13];
+    };
+
+    ShmInput(OPC::callback_t opcCallback, void *context, bool verbose = false);
+    ~ShmInput();
+
+    // Create the segment and start waiting on its doorbell. Call once.
+    bool start(EventLoop &loop, const char *name, unsigned canvases);
+
+    // On the event loop's thread, after it wakes. Delivers each newly published frame.
+    void poll();
+
+    void writeMetrics(Metrics::Writer &writer);
+
+private:
+    OPC::callback_t mOpcCallback;
+    void *mUserContext;
+    bool mVerbose;
+
+    std::string mName;
+    uint8_t *mSegment;
+    size_t mSegmentSize;
+    Header *mHeader;
+    Canvas *mCanvases;
+    uint32_t *mFront;                   // The slot we hold, per canvas
+
+    // Our own copy of the layout. The producer can write to the header, so we never read it back.
+    unsigned mCanvasCount;
+    size_t mSlotSize;
+
+    EventLoop *mLoop;
+    tthread::thread *mThread;
+
+    // Statistics for /metrics. Network thread only.
+    uint64_t mFrames;
+    uint64_t mMalformed;
+
+    uint8_t *slot(unsigned canvas, unsigned index);
+    static void doorbellThreadFunc(void *arg);
+};
+
+#endif  // OS_LINUX
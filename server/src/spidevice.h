@@ -26,6 +26,7 @@
 
 #include "rapidjson/document.h"
 #include "opc.h"
+#include "pixelmap.h"
 #include <string>
 #include <libusb.h> // Also brings in gettimeofday() in a portable way
 
@@ -66,10 +67,14 @@ public:
 
     const char *getTypeString() { return mTypeString; }
 
+    // Compiled OPC mapping, valid after loadConfiguration()
+    const PixelMap &getMap() const { return mMap; }
+
 protected:
     struct timeval mTimestamp;
     const char *mTypeString;
     bool mVerbose;
+    PixelMap mMap;
     uint32_t mPort;
 
     // Utilities
@@ -27,17 +27,45 @@
 
 #include "tcpnetserver.h"
 #include "version.h"
+#include "trace.h"
 #include "libwebsockets.h"
 #include "rapidjson/stringbuffer.h"
 #include "rapidjson/writer.h"
 #include <iostream>
 #include <algorithm>
+#include <time.h>
+
+#ifndef OS_WINDOWS
+#include <sys/socket.h>
+#include <sys/stat.h>
+#include <sys/un.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <unistd.h>
+
+#ifndef MSG_NOSIGNAL
+#define MSG_NOSIGNAL 0      // Darwin uses the SO_NOSIGPIPE socket option instead
+#endif
+#endif
+
+
+// Minimum time between flow control updates to one client, in microseconds
+static const uint64_t kFlowUpdateInterval = 50000;
 
 
 TcpNetServer::TcpNetServer(OPC::callback_t opcCallback, jsonCallback_t jsonCallback,
-    void *context, bool verbose)
-    : mOpcCallback(opcCallback), mJsonCallback(jsonCallback),
-      mUserContext(context), mThread(0), mVerbose(verbose)
+    metricsCallback_t metricsCallback, flowCallback_t flowCallback, void *context, bool verbose)
+    : mOpcCallback(opcCallback), mJsonCallback(jsonCallback), mMetricsCallback(metricsCallback),
+      mFlowCallback(flowCallback), mStreamCallback(0), mUserContext(context), mThread(0), mVerbose(verbose), mContext(0),
+      mRelayContext(0), mRelayThread(0), mRelayPending(false),
+#ifndef OS_WINDOWS
+      mUdpServer(0), mUnixListener(-1), mUnixReadBuffer(0), mUnixRefused(0),
+#endif
+#ifdef OS_LINUX
+      mShmInput(0),
+#endif
+      mNextClientID(1), mOPCMessages(0), mOPCBytes(0), mParseErrors(0),
+      mRelayMessages(0), mRelaySends(0), mRelayDropped(0), mBroadcastsCoalesced(0)
 {}
 
 bool TcpNetServer::start(const char *host, int port)
@@ -57,6 +85,14 @@ bool TcpNetServer::start(const char *host, int port)
         { NULL, NULL, 0, 0 }    // terminator
     };
 
+#ifndef OS_WINDOWS
+    // Must be ready before the context exists, since creating it adds the listening socket
+    if (!mEventLoop.init()) {
+        lwsl_err("Event loop init failed\n");
+        return false;
+    }
+#endif
+
     struct lws_context_creation_info info;
     memset(&info, 0, sizeof info);
     info.gid = -1;
@@ -84,7 +120,12 @@ bool TcpNetServer::start(const char *host, int port)
 
     // Note that we pass ownership of all libwebsockets state to this new thread.
     // We shouldn't access it on the other threads afterwards.
+    mContext = context;
+#ifdef OS_WINDOWS
     mThread = new tthread::thread(threadFunc, context);
+#else
+    mThread = new tthread::thread(threadFunc, this);
+#endif
 
     return true;
 }
@@ -99,7 +140,7 @@ bool TcpNetServer::startRelay(const char *host, int port)
         {
             "fcserver-relay",       // Name
             lwsRelayCallback,       // Callback
-            sizeof(Client),         // Protocol-specific data size
+            sizeof(RelayClient),    // Protocol-specific data size
             sizeof(OPC::Message),   // Max frame size / rx buffer
         },
 
@@ -131,13 +172,108 @@ bool TcpNetServer::startRelay(const char *host, int port)
 
     lwsl_notice("Relay Server listening on %s:%d\n", host ? host : "*", port);
 
-    // Note that we pass ownership of all libwebsockets state to this new thread.
+    // Note that we pass ownership of all libwebsockets state to the network thread.
     // We shouldn't access it on the other threads afterwards.
+    mRelayContext = context;
+#ifdef OS_WINDOWS
     mRelayThread = new tthread::thread(threadFunc, context);
+#endif
+
+    return true;
+}
 
+bool TcpNetServer::startUDP(const char *host, int port)
+{
+#ifdef OS_WINDOWS
+    lwsl_err("The UDP listener isn't supported on Windows\n");
+    return false;
+#else
+    // Watched by our event loop, which must already be running
+    UdpNetServer *udp = new UdpNetServer(mOpcCallback, mUserContext, mVerbose);
+    if (!udp->start(mEventLoop, host, port)) {
+        delete udp;
+        return false;
+    }
+    mUdpServer = udp;
+    return true;
+#endif
+}
+
+bool TcpNetServer::startShm(const char *name, unsigned canvases)
+{
+#ifndef OS_LINUX
+    lwsl_err("Shared memory input is only supported on Linux\n");
+    return false;
+#else
+    // Its doorbell wakes our event loop, which must already be running
+    ShmInput *shm = new ShmInput(mOpcCallback, mUserContext, mVerbose);
+    if (!shm->start(mEventLoop, name, canvases)) {
+        delete shm;
+        return false;
+    }
+    mShmInput = shm;
     return true;
+#endif
 }
 
+bool TcpNetServer::startUnix(const char *path, const std::vector<unsigned> &users)
+{
+#ifdef OS_WINDOWS
+    lwsl_err("The Unix socket listener isn't supported on Windows\n");
+    return false;
+#else
+    struct sockaddr_un addr;
+    memset(&addr, 0, sizeof addr);
+    addr.sun_family = AF_UNIX;
+    if (strlen(path) >= sizeof addr.sun_path) {
+        lwsl_err("Unix socket path is too long: %s\n", path);
+        return false;
+    }
+    strcpy(addr.sun_path, path);
+
+    // A socket left over from an earlier run would keep us from binding. Leave anything else alone.
+    struct stat st;
+    if (lstat(path, &st) == 0) {
+        if (!S_ISSOCK(st.st_mode)) {
+            lwsl_err("Can't listen on %s, it already exists and isn't a socket\n", path);
+            return false;
+        }
+        unlink(path);
+    }
+
+    mUnixReadBuffer = (uint8_t*) malloc(sizeof(OPC::Message));
+    if (!mUnixReadBuffer) {
+        return false;
+    }
+
+    /*
+     * Who may send us pixels is decided by peer credentials, as each client connects.
+     * Still, when that's nobody but our own user, don't let anyone else connect at all.
+     */
+
+    int fd = socket(AF_UNIX, SOCK_STREAM, 0);
+    if (fd < 0 || bind(fd, (struct sockaddr*) &addr, sizeof addr) < 0 ||
+        chmod(path, users.empty() ? 0600 : 0666) < 0 || listen(fd, 16) < 0) {
+        lwsl_err("Can't listen on Unix socket %s: %s\n", path, strerror(errno));
+        if (fd >= 0) {
+            close(fd);
+        }
+        return false;
+    }
+    fcntl(fd, F_SETFL, O_NONBLOCK);
+
+    mUnixUsers = users;
+    mUnixListener = fd;
+    lwsl_notice("Server listening on Unix socket %s\n", path);
+
+    // Watched by our event loop, which must already be running
+    mEventLoop.add(fd, POLLIN, cbUnixAccept, this);
+    return true;
+#endif
+}
+
+#ifdef OS_WINDOWS
+
 void TcpNetServer::threadFunc(void *arg)
 {
     struct libwebsocket_context *context = (libwebsocket_context*) arg;
@@ -153,13 +289,200 @@ void TcpNetServer::threadFunc(void *arg)
      * that much. During normal operation we'll be receiving lots of data over the
      * network anyway.
      */
-    while (libwebsocket_service(context, 100) >= 0) {
-        self->flushBroadcastList();
+    // Nothing wakes the relay thread when messages are queued for it, so it looks more often.
+    bool relay = context == self->mRelayContext.load();
+    int timeoutMS = relay ? 10 : 100;
+
+    while (libwebsocket_service(context, timeoutMS) >= 0) {
+        if (relay) {
+            self->relayRequestWrites(context);
+        } else {
+            self->flushBroadcastList();
+        }
     }
 
     libwebsocket_context_destroy(context);
 }
 
+#else   // !OS_WINDOWS
+
+void TcpNetServer::threadFunc(void *arg)
+{
+    TcpNetServer *self = (TcpNetServer*) arg;
+
+    /*
+     * Service sockets as soon as they're ready, and broadcasts as soon as another
+     * thread queues them. libwebsockets also needs a regular call with no socket
+     * so it can expire its own timeouts; once a second is plenty.
+     */
+
+    time_t lastTimeoutCheck = time(0);
+
+    for (;;) {
+        self->mEventLoop.runOnce(1000);
+
+#ifdef OS_LINUX
+        // Before the relay, so frames from shared memory go out on this same pass
+        ShmInput *shm = self->mShmInput.load();
+        if (shm) {
+            shm->poll();
+        }
+#endif
+
+        self->flushBroadcastList();
+
+        libwebsocket_context *relay = self->mRelayContext.load();
+        if (relay) {
+            self->relayRequestWrites(relay);
+        }
+
+        time_t now = time(0);
+        if (now != lastTimeoutCheck) {
+            lastTimeoutCheck = now;
+
+            libwebsocket_service_fd(self->mContext, NULL);
+            if (relay) {
+                libwebsocket_service_fd(relay, NULL);
+            }
+        }
+
+        self->mLoopTime.record(Metrics::now() - self->mEventLoop.wokeAt());
+    }
+}
+
+void TcpNetServer::lwsPollFd(libwebsocket_context *context,
+    enum libwebsocket_callback_reasons reason, void *in)
+{
+    // libwebsockets is running in external poll mode. Keep our event loop in sync with its sockets.
+
+    const libwebsocket_pollargs *args = (const libwebsocket_pollargs*) in;
+
+    switch (reason) {
+
+        case LWS_CALLBACK_ADD_POLL_FD:
+            mEventLoop.add(args->fd, args->events, cbServiceFd, context);
+            break;
+
+        case LWS_CALLBACK_CHANGE_MODE_POLL_FD:
+            mEventLoop.modify(args->fd, args->events);
+            break;
+
+        case LWS_CALLBACK_DEL_POLL_FD:
+            mEventLoop.remove(args->fd);
+            break;
+
+        default:
+            break;
+    }
+}
+
+void TcpNetServer::cbServiceFd(int fd, short revents, void *context)
+{
+    struct pollfd pfd;
+    pfd.fd = fd;
+    pfd.events = revents;
+    pfd.revents = revents;
+    libwebsocket_service_fd((libwebsocket_context*) context, &pfd);
+}
+
+void TcpNetServer::cbUnixAccept(int fd, short revents, void *context)
+{
+    TcpNetServer *self = (TcpNetServer*) context;
+    self->unixAccept();
+}
+
+void TcpNetServer::cbUnixRead(int fd, short revents, void *context)
+{
+    UnixClient *uc = (UnixClient*) context;
+    uc->server->unixRead(uc);
+}
+
+void TcpNetServer::unixAccept()
+{
+    int fd = accept(mUnixListener, NULL, NULL);
+    if (fd < 0) {
+        if (errno != EAGAIN && errno != EWOULDBLOCK && errno != EINTR && errno != ECONNABORTED) {
+            lwsl_err("Error accepting Unix socket client: %s\n", strerror(errno));
+        }
+        return;
+    }
+
+    unsigned uid;
+    if (!unixPeerAllowed(fd, uid)) {
+        lwsl_notice("Refused Unix socket client from user %u\n", uid);
+        mUnixRefused++;
+        close(fd);
+        return;
+    }
+
+    fcntl(fd, F_SETFL, O_NONBLOCK);
+#ifdef SO_NOSIGPIPE
+    int one = 1;
+    setsockopt(fd, SOL_SOCKET, SO_NOSIGPIPE, &one, sizeof one);
+#endif
+
+    // No protocol detection here. It's Open Pixel Control from the first byte.
+    UnixClient *uc = new UnixClient;
+    memset(&uc->client, 0, sizeof uc->client);
+    uc->server = this;
+    uc->client.state = CLIENT_STATE_OPEN_PIXEL_CONTROL;
+    uc->client.unixSocket = fd;
+
+    mUnixClients.insert(uc);
+    mEventLoop.add(fd, POLLIN, cbUnixRead, uc);
+    lwsl_notice("New Open Pixel Control connection on Unix socket, from user %u\n", uid);
+}
+
+bool TcpNetServer::unixPeerAllowed(int fd, unsigned &uid)
+{
+    // Our own user and root are always welcome, plus any users listed in the config
+    uid = unsigned(-1);
+
+#ifdef OS_LINUX
+    struct ucred cred;
+    socklen_t len = sizeof cred;
+    if (getsockopt(fd, SOL_SOCKET, SO_PEERCRED, &cred, &len) < 0) {
+        return false;
+    }
+    uid = cred.uid;
+#else
+    uid_t euid;
+    gid_t egid;
+    if (getpeereid(fd, &euid, &egid) < 0) {
+        return false;
+    }
+    uid = euid;
+#endif
+
+    return uid == 0 || uid == unsigned(geteuid()) ||
+        std::find(mUnixUsers.begin(), mUnixUsers.end(), uid) != mUnixUsers.end();
+}
+
+void TcpNetServer::unixRead(UnixClient *uc)
+{
+    ssize_t len = recv(uc->client.unixSocket, mUnixReadBuffer, sizeof(OPC::Message), 0);
+    if (len < 0 && (errno == EAGAIN || errno == EWOULDBLOCK || errno == EINTR)) {
+        return;
+    }
+    if (len <= 0 || opcRead(NULL, NULL, uc->client, mUnixReadBuffer, len) < 0) {
+        unixClose(uc);
+    }
+}
+
+void TcpNetServer::unixClose(UnixClient *uc)
+{
+    int fd = uc->client.unixSocket;
+    mEventLoop.remove(fd);
+    close(fd);
+
+    clientClosed(&uc->client);
+    mUnixClients.erase(uc);
+    delete uc;
+    lwsl_notice("Unix socket client disconnected\n");
+}
+
+#endif  // !OS_WINDOWS
+
 int TcpNetServer::lwsCallback(libwebsocket_context *context, libwebsocket *wsi,
     enum libwebsocket_callback_reasons reason, void *user, void *in, size_t len)
 {
@@ -176,21 +499,27 @@ int TcpNetServer::lwsCallback(libwebsocket_context *context, libwebsocket *wsi,
     TcpNetServer *self = (TcpNetServer*) libwebsocket_context_user(context);
     Client *client = (Client*) user;
 
+#ifndef OS_WINDOWS
+    self->lwsPollFd(context, reason, in);
+#endif
+
     switch (reason) {
         case LWS_CALLBACK_CLOSED:
         case LWS_CALLBACK_CLOSED_HTTP:
         case LWS_CALLBACK_DEL_POLL_FD:
-            if (client && client->opcBuffer) {
-                free(client->opcBuffer);
-                client->opcBuffer = NULL;
+            if (client) {
+                self->clientClosed(client);
             }
             self->mClients.erase(wsi);
             break;
 
         case LWS_CALLBACK_ESTABLISHED:
-            self->mClients.insert(wsi);
+            self->mClients[wsi] = client;
             break;
 
+        case LWS_CALLBACK_SERVER_WRITEABLE:
+            return self->jsonWrite(context, wsi, *client);
+
         case LWS_CALLBACK_HTTP:
             return self->httpBegin(context, wsi, *client, (const char*) in);
 
@@ -233,26 +562,32 @@ int TcpNetServer::lwsRelayCallback(libwebsocket_context *context, libwebsocket *
      */
 
     TcpNetServer *self = (TcpNetServer*) libwebsocket_context_user(context);
-    Client *client = (Client*) user;
+    RelayClient *client = (RelayClient*) user;
+
+#ifndef OS_WINDOWS
+    self->lwsPollFd(context, reason, in);
+#endif
 
     switch (reason) {
         case LWS_CALLBACK_CLOSED:
         case LWS_CALLBACK_CLOSED_HTTP:
         case LWS_CALLBACK_DEL_POLL_FD:
-            if (client && client->opcBuffer) {
-                free(client->opcBuffer);
-                client->opcBuffer = NULL;
-            }
-            if (self->mRelayClients.erase(wsi) > 0) {
-                lwsl_notice("Relay client disconnected!\n");
+            if (client) {
+                self->relayClosed(client);
             }
             break;
 
         case LWS_CALLBACK_ESTABLISHED:
             lwsl_notice("Relay client connected!\n");
-            self->mRelayClients.insert(wsi);
+            client->wsi = wsi;
+            self->mRelayMutex.lock();
+            self->mRelayClients.insert(client);
+            self->mRelayMutex.unlock();
             break;
 
+        case LWS_CALLBACK_SERVER_WRITEABLE:
+            return self->relayWrite(context, *client);
+
         default:
             break;
     }
@@ -266,42 +601,134 @@ int TcpNetServer::opcRead(libwebsocket_context *context, libwebsocket *wsi,
     /*
      * Open Pixel Control packet dispatch, and protocol detection.
      *
-     * Store the new packet in our protocol buffer. This should be large enough to never overflow,
-     * since our OPC buffer is large enough for two packets and the OPC max packet size is much larger
-     * than the network receive buffer.
-     *
-     * If we have no buffered data yet, we can do this without copying.
+     * Complete messages are handled right out of the network receive buffer, without
+     * copying. Only a message that's split across reads gets copied, into a buffer from
+     * our pool that's just big enough for it, and that buffer goes back to the pool as
+     * soon as the message is complete. Idle clients hold no buffer at all.
      */
 
-    OPCBuffer *opcb;
-    uint8_t *buffer;
-    unsigned bufferLength;    
+    TRACE_SCOPE("opcRead", Trace::LANE_NETWORK, "bytes", len);
+
+    if (client.opcBuffer) {
+        // Finish the message we have the start of. Once we have its header, we know how long it is.
+        OPCBuffer *opcb = client.opcBuffer;
+
+        for (;;) {
+            size_t wanted = opcWanted(client);
+
+            if (opcb->length < wanted) {
+                if (!len) {
+                    opcStream(client);
+                    return 1;
+                }
+
+                opcb = client.opcBuffer = mOPCBuffers.grow(opcb, wanted);
+                if (!opcb) {
+                    lwsl_err("ERROR: Out of memory allocating OPC reassembly buffer.\n");
+                    return -1;
+                }
+
+                size_t part = std::min(len, wanted - opcb->length);
+                memcpy(opcb->data() + opcb->length, in, part);
+                opcb->length += part;
+                in += part;
+                len -= part;
+                continue;
+            }
+
+            client.opcBuffer = 0;
+            int r = opcParse(context, wsi, client, opcb->data(), opcb->length);
+            if (r < 0 || size_t(r) == opcb->length) {
+                mOPCBuffers.release(opcb);
+                if (r < 0) {
+                    return -1;
+                }
+                break;
+            }
+
+            // Protocol detection only needed the header. Keep going for the rest of the message.
+            client.opcBuffer = opcb;
+        }
+
+        if (client.state == CLIENT_STATE_HTTP) {
+            // Protocol detection just finished. Everything else is for libwebsockets.
+            if (len && libwebsocket_read(context, wsi, in, len) < 0) {
+                return -1;
+            }
+            return 1;
+        }
+    }
 
-    // Allocate the buffer we use for OPC reassembly and protocol-detect.
-    if (client.opcBuffer == NULL) {
-        opcb = (OPCBuffer*) malloc(sizeof *client.opcBuffer);
-        if (opcb == NULL) {
+    int used = opcParse(context, wsi, client, in, len);
+    if (used < 0) {
+        return -1;
+    }
+
+    if (size_t(used) < len) {
+        // The start of a message. Save it for later.
+        OPCBuffer *opcb = mOPCBuffers.alloc(len - used);
+        if (!opcb) {
             lwsl_err("ERROR: Out of memory allocating OPC reassembly buffer.\n");
             return -1;
         }
-        opcb->bufferLength = 0;
+        memcpy(opcb->data(), in + used, len - used);
+        opcb->length = len - used;
         client.opcBuffer = opcb;
-    } else {
-        opcb = client.opcBuffer;
+        opcStream(client);
     }
 
-    if (len + opcb->bufferLength > sizeof opcb->buffer) {
-        return -1;
+    // Don't pass data on to libwebsockets
+    return 1;
+}
+
+size_t TcpNetServer::opcWanted(Client &client)
+{
+    /*
+     * How much of a client's partial message we need before we can handle it: a header,
+     * then the whole thing. Protocol detection looks at the first four bytes, which is
+     * also the length of an OPC header.
+     */
+    OPCBuffer *opcb = client.opcBuffer;
+    if (opcb->length < OPC::HEADER_BYTES || client.state == CLIENT_STATE_PROTOCOL_DETECT) {
+        return OPC::HEADER_BYTES;
     }
+    return OPC::HEADER_BYTES + reinterpret_cast<OPC::Message*>(opcb->data())->length();
+}
 
-    if (opcb->bufferLength) {
-        memcpy(opcb->bufferLength + opcb->buffer, in, len);
-        buffer = opcb->buffer;
-        bufferLength = opcb->bufferLength + len;
-    } else {
-        buffer = in;
-        bufferLength = len;
+void TcpNetServer::opcStream(Client &client)
+{
+    /*
+     * With streaming dispatch on, pass along each new part of a pixel message while
+     * we wait for the rest, so devices that only need the start of it don't have to wait.
+     */
+
+    OPCBuffer *opcb = client.opcBuffer;
+
+    if (!mStreamCallback || client.state != CLIENT_STATE_OPEN_PIXEL_CONTROL || opcb->length < OPC::HEADER_BYTES) {
+        return;
+    }
+
+    OPC::Message *msg = reinterpret_cast<OPC::Message*>(opcb->data());
+    if (msg->command != OPC::SetPixelColors) {
+        return;
+    }
+
+    unsigned ready = (opcb->length - OPC::HEADER_BYTES) / 3;
+    if (ready > client.opcStreamed) {
+        mStreamCallback(*msg, client.opcStreamed, ready, false, mUserContext);
+        client.opcStreamed = ready;
     }
+}
+
+int TcpNetServer::opcParse(libwebsocket_context *context, libwebsocket *wsi,
+    Client &client, uint8_t *buffer, size_t bufferLength)
+{
+    /*
+     * Handle every complete message in a contiguous buffer. Returns how many bytes
+     * that used up, leaving any partial message at the end, or -1 on error.
+     */
+
+    size_t used = 0;
 
     if (client.state == CLIENT_STATE_PROTOCOL_DETECT) {
         /*
@@ -314,28 +741,20 @@ int TcpNetServer::opcRead(libwebsocket_context *context, libwebsocket *wsi,
 
         if (bufferLength < 4) {
             // Not enough data for protocol detect yet. Save this data for later.
-
-            if (buffer != opcb->buffer) {
-                memcpy(opcb->buffer, buffer, bufferLength);
-                opcb->bufferLength = bufferLength;
-            }
-
             // Do not pass this data on to libwebsocket yet
-            return 1;
+            return 0;
         }
 
         if (buffer[0] == 'G' && buffer[1] == 'E' && buffer[2] == 'T' && buffer[3] == ' ') {
             // Detected HTTP. Convert this to an HTTP client, and let libwebsockets handle
-            // all data received so far. We can jettison the OPC buffer at this point.
+            // all data received so far.
 
-            free(client.opcBuffer);
-            client.opcBuffer = 0;
             client.state = CLIENT_STATE_HTTP;
 
             if (libwebsocket_read(context, wsi, buffer, bufferLength) < 0) {
                 return -1;
             }
-            return 1;
+            return bufferLength;
         }
 
         // Not HTTP. Handle this as an OPC socket.
@@ -346,34 +765,36 @@ int TcpNetServer::opcRead(libwebsocket_context *context, libwebsocket *wsi,
     // Process any and all complete packets from our buffer
     while (1) {
 
-        if (bufferLength < OPC::HEADER_BYTES) {
+        if (bufferLength - used < OPC::HEADER_BYTES) {
             // Still waiting for a header
             break;
         }
 
-        OPC::Message *msg = (OPC::Message*) buffer;
+        OPC::Message *msg = (OPC::Message*) (buffer + used);
         unsigned msgLength = OPC::HEADER_BYTES + msg->length();
 
-        if (bufferLength < msgLength) {
+        if (bufferLength - used < msgLength) {
             // Waiting for more data
             break;
         }
 
         // Complete packet.
-        mOpcCallback(*msg, mUserContext);
-
-        buffer += msgLength;
-        bufferLength -= msgLength;
-    }
+        opcCount(client, *msg);
+        if (!flowSubscribe(client, *msg)) {
+            if (client.opcStreamed) {
+                // The rest of a message we've been streaming
+                mStreamCallback(*msg, client.opcStreamed, msg->length() / 3, true, mUserContext);
+                client.opcStreamed = 0;
+            } else {
+                mOpcCallback(*msg, mUserContext);
+            }
+            flowUpdate(wsi, client, *msg);
+        }
 
-    // If we have any residual data, save it for later.
-    if (bufferLength && buffer != opcb->buffer) {
-        memmove(opcb->buffer, buffer, bufferLength);
+        used += msgLength;
     }
-    opcb->bufferLength = bufferLength;
 
-    // Don't pass data on to libwebsockets
-    return 1;
+    return used;
 }
 
 bool TcpNetServer::httpPathEqual(const char *a, const char *b)
@@ -405,6 +826,10 @@ int TcpNetServer::httpBegin(libwebsocket_context *context, libwebsocket *wsi,
      *       them back with deflate content-encoding.
      */
 
+    if (httpPathEqual(path, "/metrics")) {
+        return httpMetrics(context, wsi, client);
+    }
+
     HTTPDocument *doc = httpDocumentList;
 
     // Look for this path in the document list. If it isn't found, we'll serve the 404 doc.
@@ -443,6 +868,141 @@ int TcpNetServer::httpBegin(libwebsocket_context *context, libwebsocket *wsi,
     return 0;
 }
 
+int TcpNetServer::httpMetrics(libwebsocket_context *context, libwebsocket *wsi, Client &client)
+{
+    /*
+     * Generate the /metrics document. Unlike our static documents, it isn't compressed.
+     * The text is kept in a buffer owned by the client until the connection closes.
+     */
+
+    std::string body;
+    Metrics::Writer writer(body);
+    mMetricsCallback(writer, mUserContext);
+    writeMetrics(writer);
+
+    char buffer[1024];
+    int size = snprintf(buffer, sizeof buffer,
+        "HTTP/1.1 200 OK\r\n"
+        "Server: %s\r\n"
+        "Content-Type: text/plain; version=0.0.4\r\n"
+        "Content-Length: %u\r\n"
+        "Connection: close\r\n"
+        "\r\n",
+        kFCServerVersion,
+        unsigned(body.size())
+    );
+
+    if (libwebsocket_write(wsi, (unsigned char*) buffer, size, LWS_WRITE_HTTP) < 0) {
+        return -1;
+    }
+
+    client.httpBuffer = (char*) malloc(body.size());
+    if (!client.httpBuffer) {
+        return -1;
+    }
+    memcpy(client.httpBuffer, body.data(), body.size());
+
+    client.httpBody = client.httpBuffer;
+    client.httpLength = body.size();
+    libwebsocket_callback_on_writable(context, wsi);
+
+    return 0;
+}
+
+void TcpNetServer::writeMetrics(Metrics::Writer &writer)
+{
+    writer.family("fcserver_opc_messages_total", "counter", "OPC messages received from all clients.");
+    writer.sample("fcserver_opc_messages_total", "", mOPCMessages);
+
+    writer.family("fcserver_opc_bytes_total", "counter", "OPC bytes received from all clients, including headers.");
+    writer.sample("fcserver_opc_bytes_total", "", mOPCBytes);
+
+    writer.family("fcserver_opc_clients", "gauge", "Connected clients that have sent OPC.");
+    writer.sample("fcserver_opc_clients", "", uint64_t(mOPCClients.size()));
+
+    writer.family("fcserver_client_opc_messages_total", "counter", "OPC messages received, per client connection.");
+    for (std::set<Client*>::iterator i = mOPCClients.begin(), e = mOPCClients.end(); i != e; ++i) {
+        char id[16];
+        snprintf(id, sizeof id, "%u", (*i)->id);
+        writer.sample("fcserver_client_opc_messages_total", Metrics::Writer::label("client", id), (*i)->opcMessages);
+    }
+
+    writer.family("fcserver_client_opc_bytes_total", "counter", "OPC bytes received, per client connection.");
+    for (std::set<Client*>::iterator i = mOPCClients.begin(), e = mOPCClients.end(); i != e; ++i) {
+        char id[16];
+        snprintf(id, sizeof id, "%u", (*i)->id);
+        writer.sample("fcserver_client_opc_bytes_total", Metrics::Writer::label("client", id), (*i)->opcBytes);
+    }
+
+    writer.family("fcserver_client_buffer_bytes", "gauge", "Memory held for partial OPC messages, per client connection.");
+    for (std::set<Client*>::iterator i = mOPCClients.begin(), e = mOPCClients.end(); i != e; ++i) {
+        char id[16];
+        snprintf(id, sizeof id, "%u", (*i)->id);
+        OPCBuffer *opcb = (*i)->opcBuffer;
+        writer.sample("fcserver_client_buffer_bytes", Metrics::Writer::label("client", id),
+            uint64_t(opcb ? sizeof *opcb + opcb->capacity() : 0));
+    }
+
+    writer.family("fcserver_opc_buffer_bytes", "gauge", "Memory held for partial OPC messages, by all clients.");
+    writer.sample("fcserver_opc_buffer_bytes", "", uint64_t(mOPCBuffers.getBytesInUse()));
+
+    writer.family("fcserver_opc_buffer_pooled_bytes", "gauge", "Free OPC receive buffers kept for reuse.");
+    writer.sample("fcserver_opc_buffer_pooled_bytes", "", uint64_t(mOPCBuffers.getBytesPooled()));
+
+    writer.family("fcserver_parse_errors_total", "counter", "Malformed OPC or JSON messages from clients.");
+    writer.sample("fcserver_parse_errors_total", "", mParseErrors);
+
+    writer.family("fcserver_websocket_clients", "gauge", "Connected WebSockets clients.");
+    writer.sample("fcserver_websocket_clients", "", uint64_t(mClients.size()));
+
+    writer.family("fcserver_broadcasts_coalesced_total", "counter", "Broadcasts to WebSockets clients replaced by a newer one before they were sent.");
+    writer.sample("fcserver_broadcasts_coalesced_total", "", mBroadcastsCoalesced);
+
+    mRelayMutex.lock();
+
+    writer.family("fcserver_relay_clients", "gauge", "Clients connected to the relay socket.");
+    writer.sample("fcserver_relay_clients", "", uint64_t(mRelayClients.size()));
+
+    writer.family("fcserver_relay_messages_total", "counter", "OPC messages forwarded to the relay socket.");
+    writer.sample("fcserver_relay_messages_total", "", mRelayMessages);
+
+    writer.family("fcserver_relay_sends_total", "counter", "Relay writes, one per message per relay client.");
+    writer.sample("fcserver_relay_sends_total", "", mRelaySends);
+
+    writer.family("fcserver_relay_dropped_total", "counter", "Relayed messages dropped because a relay client fell too far behind.");
+    writer.sample("fcserver_relay_dropped_total", "", mRelayDropped);
+
+    mRelayMutex.unlock();
+
+#ifndef OS_WINDOWS
+    if (mUnixListener >= 0) {
+        writer.family("fcserver_unix_clients", "gauge", "Clients connected to the Unix domain socket.");
+        writer.sample("fcserver_unix_clients", "", uint64_t(mUnixClients.size()));
+
+        writer.family("fcserver_unix_refused_total", "counter", "Unix socket connections refused because of the peer's user ID.");
+        writer.sample("fcserver_unix_refused_total", "", mUnixRefused);
+    }
+
+    UdpNetServer *udp = mUdpServer.load();
+    if (udp) {
+        udp->writeMetrics(writer);
+    }
+#endif
+
+#ifdef OS_LINUX
+    ShmInput *shm = mShmInput.load();
+    if (shm) {
+        shm->writeMetrics(writer);
+    }
+#endif
+
+#ifndef OS_WINDOWS
+
+    writer.family("fcserver_network_loop_seconds", "histogram", "Time spent handling each wakeup of the network thread.");
+    writer.histogram("fcserver_network_loop_seconds", "", mLoopTime);
+#endif
+}
+
 int TcpNetServer::httpWrite(libwebsocket_context *context, libwebsocket *wsi, Client &client)
 {
     if (!client.httpBody) {
@@ -472,10 +1032,12 @@ int TcpNetServer::wsRead(libwebsocket_context *context, libwebsocket *wsi, Clien
 {
     // If this frame is binary, it's an OPC message. Does it parse?
     if (lws_frame_is_binary(wsi)) {
+        TRACE_SCOPE("wsRead", Trace::LANE_NETWORK, "bytes", len);
         OPC::Message *msg = (OPC::Message*) in;
 
         if (len < OPC::HEADER_BYTES) {
             lwsl_notice("NOTICE: Received binary WebSockets packet, but it's too small for an OPC header.\n");
+            mParseErrors++;
             return 0;
         }
 
@@ -489,7 +1051,11 @@ int TcpNetServer::wsRead(libwebsocket_context *context, libwebsocket *wsi, Clien
         }
 
         msg->setLength(len - OPC::HEADER_BYTES);
-        mOpcCallback(*msg, mUserContext);
+        opcCount(client, *msg);
+        if (!flowSubscribe(client, *msg)) {
+            mOpcCallback(*msg, mUserContext);
+            flowUpdate(wsi, client, *msg);
+        }
 
         return 0;
     }
@@ -501,86 +1067,376 @@ int TcpNetServer::wsRead(libwebsocket_context *context, libwebsocket *wsi, Clien
     if (message.HasParseError()) {
         lwsl_notice("NOTICE: Parse error in received JSON, character %d: %s\n",
             int(message.GetErrorOffset()), message.GetParseError());
+        mParseErrors++;
         return 0;
     }
 
     if (!message.IsObject()) {
         lwsl_notice("NOTICE: Received JSON is not an object {}\n");
+        mParseErrors++;
         return 0;
     }
 
+    // Flow control belongs to this connection, so we handle it here
+    const rapidjson::Value &type = message["type"];
+    if (type.IsString() && !strcmp(type.GetString(), "flow_control")) {
+        client.flowControl = !message["enable"].IsFalse();
+        client.flowAccepted = 0;
+        client.flowUpdatedAt = 0;
+        return jsonReply(wsi, message) < 0 ? -1 : 0;
+    }
+
     mJsonCallback(wsi, message, mUserContext);
     return 0;
 }
 
-int TcpNetServer::jsonReply(libwebsocket *wsi, rapidjson::Document &message)
+void TcpNetServer::opcCount(Client &client, const OPC::Message &msg)
+{
+    if (!client.id) {
+        client.id = mNextClientID++;
+        mOPCClients.insert(&client);
+    }
+
+    uint64_t bytes = OPC::HEADER_BYTES + msg.length();
+    client.opcMessages++;
+    client.opcBytes += bytes;
+    mOPCMessages++;
+    mOPCBytes += bytes;
+}
+
+bool TcpNetServer::flowSubscribe(Client &client, const OPC::Message &msg)
+{
+    /*
+     * Is this a SysEx message turning flow control on or off? It only affects the
+     * connection it arrives on, so it's handled here rather than passed along.
+     */
+
+    if (msg.command != OPC::SystemExclusive || msg.sysExID() != OPC::FCFlowControl) {
+        return false;
+    }
+
+    client.flowControl = msg.length() < 5 || msg.data[4] != 0;
+    client.flowAccepted = 0;
+    client.flowUpdatedAt = 0;
+    return true;
+}
+
+void TcpNetServer::flowUpdate(libwebsocket *wsi, Client &client, const OPC::Message &msg)
 {
-    jsonBuffer_t buffer;
-    jsonBufferPrepare(buffer, message);
-    return jsonBufferSend(buffer, wsi);
+    /*
+     * After a subscribed client's pixel message has been dispatched, tell it how the
+     * devices on that channel are keeping up. Updates are rate limited, and they're only
+     * advisory, so we skip one rather than block if the socket is backed up.
+     */
+
+    if (!client.flowControl || msg.command != OPC::SetPixelColors) {
+        return;
+    }
+    client.flowAccepted++;
+
+    uint64_t now = Metrics::now();
+    if (client.flowUpdatedAt && now - client.flowUpdatedAt < kFlowUpdateInterval) {
+        return;
+    }
+    if (wsi && (lws_send_pipe_choked(wsi) || !client.jsonQueue.empty())) {
+        return;
+    }
+    client.flowUpdatedAt = now;
+
+    FlowStatus status = { 0, 0, 0 };
+    mFlowCallback(msg.channel, status, mUserContext);
+
+    if (client.state == CLIENT_STATE_OPEN_PIXEL_CONTROL) {
+        // Native OPC gets a SysEx message back on the same socket, big-endian like OPC itself
+        uint32_t fields[] = { status.interval, client.flowAccepted,
+            uint32_t(status.completed), uint32_t(status.superseded) };
+        uint8_t packet[OPC::HEADER_BYTES + 4 + sizeof fields];
+        OPC::Message *reply = (OPC::Message*) packet;
+
+        reply->channel = msg.channel;
+        reply->command = OPC::SystemExclusive;
+        reply->setLength(sizeof packet - OPC::HEADER_BYTES);
+        for (unsigned i = 0; i < 4; i++) {
+            reply->data[i] = uint8_t(OPC::FCFlowControl >> (24 - 8*i));
+        }
+        for (unsigned i = 0; i < sizeof fields / sizeof fields[0]; i++) {
+            for (unsigned j = 0; j < 4; j++) {
+                reply->data[4 + 4*i + j] = uint8_t(fields[i] >> (24 - 8*j));
+            }
+        }
+
+#ifndef OS_WINDOWS
+        if (!wsi) {
+            // A Unix socket client. A reply this small goes out whole or not at all.
+            send(client.unixSocket, packet, sizeof packet, MSG_DONTWAIT | MSG_NOSIGNAL);
+            return;
+        }
+#endif
+        libwebsocket_write(wsi, packet, sizeof packet, LWS_WRITE_HTTP);
+
+    } else {
+        rapidjson::Document message;
+        message.SetObject();
+        message.AddMember("type", "flow_control", message.GetAllocator());
+        message.AddMember("channel", unsigned(msg.channel), message.GetAllocator());
+        message.AddMember("interval", status.interval, message.GetAllocator());
+        message.AddMember("accepted", client.flowAccepted, message.GetAllocator());
+        message.AddMember("completed", status.completed, message.GetAllocator());
+        message.AddMember("superseded", status.superseded, message.GetAllocator());
+        jsonReply(wsi, message);
+    }
+}
+
+void TcpNetServer::clientClosed(Client *client)
+{
+    // May be called more than once per client, as libwebsockets tears it down
+    if (client->opcBuffer) {
+        mOPCBuffers.release(client->opcBuffer);
+        client->opcBuffer = NULL;
+    }
+    if (client->httpBuffer) {
+        free(client->httpBuffer);
+        client->httpBuffer = NULL;
+        client->httpBody = NULL;
+    }
+    client->opcStreamed = 0;
+    client->jsonQueue.clear();
+    mOPCClients.erase(client);
 }
 
-void TcpNetServer::jsonBufferPrepare(jsonBuffer_t &buffer, rapidjson::Value &value)
+int TcpNetServer::jsonReply(libwebsocket *wsi, rapidjson::Document &message)
 {
-    // Pre-packet padding
-    rapidjson::PutN<>(buffer, 0, LWS_SEND_BUFFER_PRE_PADDING);
+    // Replies wait their turn behind anything already queued for the client
+    std::map<libwebsocket*, Client*>::iterator client = mClients.find(wsi);
+    if (client == mClients.end()) {
+        return -1;
+    }
+
+    SendBuffer *buffer = jsonSerialize(mJsonScratch, message);
+    if (!buffer) {
+        return -1;
+    }
+
+    int result = jsonSend(wsi, *client->second, buffer);
+    buffer->unref();
+    return result;
+}
 
-    // Write serialized message
-    rapidjson::Writer<rapidjson::GenericStringBuffer<rapidjson::UTF8<> > > writer(buffer);
+SendBuffer *TcpNetServer::jsonSerialize(jsonBuffer_t &scratch, rapidjson::Value &value, bool coalesce)
+{
+    scratch.Clear();
+    rapidjson::Writer<jsonBuffer_t> writer(scratch);
     value.Accept(writer);
 
-    // Post-packet padding
-    rapidjson::PutN<>(buffer, 0, LWS_SEND_BUFFER_POST_PADDING);
+    SendBuffer *buffer = SendBuffer::create(scratch.GetString(), scratch.Size(), coalesce);
+    if (!buffer) {
+        lwsl_err("ERROR: Out of memory allocating JSON message.\n");
+    }
+    return buffer;
 }
 
-int TcpNetServer::jsonBufferSend(jsonBuffer_t &buffer, libwebsocket *wsi)
+int TcpNetServer::jsonSend(libwebsocket *wsi, Client &client, SendBuffer *buffer)
 {
-    const char *string = buffer.GetString() + LWS_SEND_BUFFER_PRE_PADDING;
-    size_t len = buffer.Size() - LWS_SEND_BUFFER_PRE_PADDING - LWS_SEND_BUFFER_POST_PADDING;
-    return libwebsocket_write(wsi, (unsigned char *) string, len, LWS_WRITE_TEXT);
+    /*
+     * Send right away if nothing is waiting ahead of this message and the socket has
+     * room. Otherwise queue it, to go out in order as the socket becomes writeable, so
+     * a message is never written over the unsent end of another. A newer message with
+     * complete state replaces one that's still waiting.
+     *
+     * Replies and broadcasts can't just be dropped, so a client that lets a whole queue
+     * of them pile up is disconnected.
+     */
+
+    if (client.jsonQueue.empty() && !lws_send_pipe_choked(wsi)) {
+        return libwebsocket_write(wsi, buffer->data(), buffer->length, LWS_WRITE_TEXT) < 0 ? -1 : 0;
+    }
+
+    if (buffer->coalesce) {
+        mBroadcastsCoalesced += client.jsonQueue.dropCoalesced();
+    }
+
+    if (client.jsonQueue.full()) {
+        if (!client.jsonOverflow) {
+            lwsl_notice("WebSockets client isn't keeping up, disconnecting\n");
+            client.jsonOverflow = true;
+        }
+    } else {
+        client.jsonQueue.push(buffer);
+    }
+
+    libwebsocket_callback_on_writable(mContext, wsi);
+    return 0;
+}
+
+int TcpNetServer::jsonWrite(libwebsocket_context *context, libwebsocket *wsi, Client &client)
+{
+    // Send queued messages until the socket backs up, then wait to be writeable again
+
+    if (client.jsonOverflow) {
+        return -1;
+    }
+
+    while (!client.jsonQueue.empty()) {
+        if (lws_send_pipe_choked(wsi)) {
+            libwebsocket_callback_on_writable(context, wsi);
+            return 0;
+        }
+
+        SendBuffer *buffer = client.jsonQueue.pop();
+        int result = libwebsocket_write(wsi, buffer->data(), buffer->length, LWS_WRITE_TEXT);
+        buffer->unref();
+        if (result < 0) {
+            return -1;
+        }
+    }
+
+    return 0;
 }
 
 void TcpNetServer::flushBroadcastList()
 {
-    // Send any pending broadcast packets. These are enqueued by other threads on a list
-    // protected by mBroadcastMutex.
+    /*
+     * Send any pending broadcasts. These are enqueued by other threads on a list
+     * protected by mBroadcastMutex. Of several coalescing broadcasts, only the newest
+     * needs to go out at all.
+     */
 
+    std::vector<SendBuffer*> list;
     mBroadcastMutex.lock();
-    for (std::vector<jsonBuffer_t*>::iterator buf = mBroadcastList.begin(); buf != mBroadcastList.end(); ++buf) {
-        for (std::set<libwebsocket*>::iterator cli = mClients.begin(); cli != mClients.end(); ++cli) {
-            jsonBufferSend(**buf, *cli);
+    list.swap(mBroadcastList);
+    mBroadcastMutex.unlock();
+
+    SendBuffer *newest = 0;
+    for (std::vector<SendBuffer*>::iterator buf = list.begin(); buf != list.end(); ++buf) {
+        if ((*buf)->coalesce) {
+            newest = *buf;
         }
-        delete *buf;
     }
-    mBroadcastList.clear();
-    mBroadcastMutex.unlock();
+
+    for (std::vector<SendBuffer*>::iterator buf = list.begin(); buf != list.end(); ++buf) {
+        if ((*buf)->coalesce && *buf != newest) {
+            mBroadcastsCoalesced += mClients.size();
+        } else {
+            for (std::map<libwebsocket*, Client*>::iterator cli = mClients.begin(); cli != mClients.end(); ++cli) {
+                jsonSend(cli->first, *cli->second, *buf);
+            }
+        }
+        (*buf)->unref();
+    }
 }
 
-void TcpNetServer::jsonBroadcast(rapidjson::Document &message)
+void TcpNetServer::jsonBroadcast(rapidjson::Document &message, bool coalesce)
 {
-    jsonBuffer_t *buffer = new jsonBuffer_t();
-    jsonBufferPrepare(*buffer, message);
-
     mBroadcastMutex.lock();
-    mBroadcastList.push_back(buffer);
+    SendBuffer *buffer = jsonSerialize(mBroadcastScratch, message, coalesce);
+    if (buffer) {
+        mBroadcastList.push_back(buffer);
+    }
     mBroadcastMutex.unlock();
+
+#ifndef OS_WINDOWS
+    // Send it now, rather than whenever the network thread next wakes up
+    mEventLoop.wake();
+#endif
 }
 
 void TcpNetServer::relayMessage(OPC::Message &msg)
 {
-    if (mRelayClients.size()) {
-        int headerLen = 4;
-        int bufferLen = headerLen + msg.length();
-        unsigned char buffer[bufferLen];
-        buffer[0] = (unsigned char)msg.channel;
-        buffer[1] = (unsigned char)msg.command;
-        buffer[2] = (unsigned char)msg.lenHigh;
-        buffer[3] = (unsigned char)msg.lenLow;
-        for (int i=0; i < msg.length(); i++) {
-            buffer[headerLen+i] = (unsigned char)msg.data[i];
+    /*
+     * Copy the message once, with the padding libwebsockets wants, and queue that same
+     * buffer for every relay client. Clients are written from the relay context's own
+     * service loop as each becomes writeable, so a slow one only ever loses its own
+     * oldest messages. It can't hold up OPC input.
+     */
+
+    if (!mRelayContext.load()) {
+        return;
+    }
+
+    tthread::lock_guard<tthread::mutex> lock(mRelayMutex);
+
+    if (mRelayClients.empty()) {
+        return;
+    }
+
+    SendBuffer *buf = SendBuffer::create(&msg, OPC::HEADER_BYTES + msg.length());
+    if (!buf) {
+        lwsl_err("ERROR: Out of memory allocating relay buffer.\n");
+        return;
+    }
+
+    for (std::set<RelayClient*>::iterator cli = mRelayClients.begin(); cli != mRelayClients.end(); ++cli) {
+        RelayClient *client = *cli;
+
+        if (client->queue.full()) {
+            client->queue.pop()->unref();
+            mRelayDropped++;
+        }
+        client->queue.push(buf);
+    }
+
+    buf->unref();
+    mRelayMessages++;
+    mRelayPending = true;
+}
+
+void TcpNetServer::relayRequestWrites(libwebsocket_context *context)
+{
+    // On the relay's service thread, ask to hear when clients with new messages can take them
+    if (context != mRelayContext.load() || !mRelayPending.exchange(false)) {
+        return;
+    }
+
+    mRelayMutex.lock();
+    for (std::set<RelayClient*>::iterator cli = mRelayClients.begin(); cli != mRelayClients.end(); ++cli) {
+        if (!(*cli)->queue.empty()) {
+            libwebsocket_callback_on_writable(context, (*cli)->wsi);
+        }
+    }
+    mRelayMutex.unlock();
+}
+
+int TcpNetServer::relayWrite(libwebsocket_context *context, RelayClient &client)
+{
+    // Send queued messages until the socket backs up, then wait to be writeable again
+
+    for (;;) {
+        mRelayMutex.lock();
+
+        if (client.queue.empty()) {
+            mRelayMutex.unlock();
+            return 0;
         }
-        for (std::set<libwebsocket*>::iterator cli = mRelayClients.begin(); cli != mRelayClients.end(); ++cli) {
-            libwebsocket_write(*cli, buffer, bufferLen, LWS_WRITE_BINARY);
+
+        if (lws_send_pipe_choked(client.wsi)) {
+            mRelayMutex.unlock();
+            libwebsocket_callback_on_writable(context, client.wsi);
+            return 0;
+        }
+
+        SendBuffer *buf = client.queue.pop();
+        mRelaySends++;
+
+        mRelayMutex.unlock();
+
+        int result = libwebsocket_write(client.wsi, buf->data(), buf->length, LWS_WRITE_BINARY);
+        buf->unref();
+        if (result < 0) {
+            return -1;
         }
     }
 }
+
+void TcpNetServer::relayClosed(RelayClient *client)
+{
+    // May be called more than once per client, as libwebsockets tears it down
+    mRelayMutex.lock();
+
+    if (mRelayClients.erase(client) > 0) {
+        lwsl_notice("Relay client disconnected!\n");
+    }
+
+    client->queue.clear();
+
+    mRelayMutex.unlock();
+}
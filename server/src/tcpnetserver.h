@@ -25,31 +25,77 @@
 #include <stdint.h>
 #include <vector>
 #include <set>
+#include <map>
 #include "rapidjson/document.h"
 #include "rapidjson/stringbuffer.h"
 #include "tinythread.h"
 #include "libwebsockets.h"
+#include "eventloop.h"
+#include "metrics.h"
 #include "opc.h"
+#include "opcbuffer.h"
+#include "sendqueue.h"
+#include "udpnetserver.h"
+#include "shminput.h"
+#include <atomic>
 
 
 class TcpNetServer {
 public:
     typedef void (*jsonCallback_t)(libwebsocket *wsi, rapidjson::Document &message, void *context);
+    typedef void (*metricsCallback_t)(Metrics::Writer &writer, void *context);
+
+    /*
+     * Flow control feedback for clients that ask for it. The flow callback describes
+     * the slowest device that an OPC channel's pixels go to.
+     */
+    struct FlowStatus {
+        uint32_t interval;      // Microseconds the device needs per frame, zero if unknown
+        uint64_t completed;     // Frames the device has finished receiving
+        uint64_t superseded;    // Frames dropped for a newer one before they were sent
+    };
+    typedef void (*flowCallback_t)(unsigned channel, FlowStatus &status, void *context);
+
+    /*
+     * Optional streaming dispatch for Set Pixel Colors messages that arrive over more
+     * than one read. The stream callback hears about such a message each time more of
+     * it comes in, with the header and the first 'ready' whole pixels in place, and
+     * once more with 'complete' set when the rest is there. 'done' is the previous
+     * call's 'ready', so each call only has to handle what the last one couldn't.
+     * Messages that arrive all at once go to the OPC callback as usual.
+     */
+    typedef void (*streamCallback_t)(OPC::Message &msg, unsigned done, unsigned ready,
+        bool complete, void *context);
 
     TcpNetServer(OPC::callback_t opcCallback, jsonCallback_t jsonCallback,
+        metricsCallback_t metricsCallback, flowCallback_t flowCallback,
         void *context, bool verbose = false);
 
+    // Turn on streaming dispatch. Call before start().
+    void setStreamCallback(streamCallback_t streamCallback) { mStreamCallback = streamCallback; }
+
     // Start the event loop on a separate thread
     bool start(const char *host, int port);
 
     // Initialize the relay socket
     bool startRelay(const char *host, int port);
 
+    // Also accept OPC over UDP. Messages arrive on the same thread as TCP ones. Not on Windows.
+    bool startUDP(const char *host, int port);
+
+    // Also take frames from renderers through shared memory, mapped on the same thread. Linux only.
+    bool startShm(const char *name, unsigned canvases);
+
+    // Also accept native OPC on a Unix domain socket, from our own user, root, or the listed
+    // user IDs. Serviced on the same thread. Not on Windows.
+    bool startUnix(const char *path, const std::vector<unsigned> &users);
+
     // Reply callback, for use only on the TcpNetServer thread. Call this inside jsonCallback.
     int jsonReply(libwebsocket *wsi, rapidjson::Document &message);
 
-    // Broadcast JSON to all clients, from any thread.
-    void jsonBroadcast(rapidjson::Document &message);
+    // Broadcast JSON to all clients, from any thread. A 'coalesce' message carries complete
+    // state, so it replaces any earlier one that hasn't been sent to a client yet.
+    void jsonBroadcast(rapidjson::Document &message, bool coalesce = false);
 
     // Sends an OPC message to clients connected to the relay socket
     void relayMessage(OPC::Message &msg);
@@ -69,13 +115,6 @@ private:
         int contentLength;
     };
 
-    // Buffer used for protocol-detection and Open Pixel Control. Big enough for two OPC packets.
-    // This buffer is jettisonned 
-    struct OPCBuffer {
-        unsigned bufferLength;
-        uint8_t buffer[2 * sizeof(OPC::Message)];
-    };
-
     struct Client {
         ClientState state;
 
@@ -83,24 +122,124 @@ private:
         const char *httpBody;
         int httpLength;
 
-        // OPC and protocol-detection receive buffer.
+        // Generated HTTP response, owned by this client
+        char *httpBuffer;
+
+        // Partial OPC message or protocol-detect header, if any. From mOPCBuffers.
         OPCBuffer *opcBuffer;
+
+        // Pixels of that partial message already passed to the stream callback
+        unsigned opcStreamed;
+
+        // Unix domain socket, for clients that didn't come through libwebsockets
+        int unixSocket;
+
+        // WebSockets replies and broadcasts waiting for the socket to be writeable
+        SendQueue jsonQueue;
+        bool jsonOverflow;
+
+        // Statistics, once this client has sent OPC
+        unsigned id;
+        uint64_t opcMessages;
+        uint64_t opcBytes;
+
+        // Flow control feedback, once the client subscribes
+        bool flowControl;
+        uint32_t flowAccepted;
+        uint64_t flowUpdatedAt;
+    };
+
+    // Per-connection state for the relay socket. Queues are protected by mRelayMutex.
+    // A client that falls a full queue behind loses its oldest messages.
+    struct RelayClient {
+        libwebsocket *wsi;
+        SendQueue queue;
     };
 
     OPC::callback_t mOpcCallback;
     jsonCallback_t mJsonCallback;
+    metricsCallback_t mMetricsCallback;
+    flowCallback_t mFlowCallback;
+    streamCallback_t mStreamCallback;
     void *mUserContext;
     tthread::thread *mThread;
     bool mVerbose;
-    std::set<libwebsocket*> mClients;
+    libwebsocket_context *mContext;
+    std::map<libwebsocket*, Client*> mClients;     // WebSockets clients
 
-    void *mRelayContext;
+    std::atomic<libwebsocket_context*> mRelayContext;
     tthread::thread *mRelayThread;
-    std::set<libwebsocket*> mRelayClients;
+    std::set<RelayClient*> mRelayClients;
+    tthread::mutex mRelayMutex;
+    std::atomic<bool> mRelayPending;    // Messages queued since the relay last asked for writes
+
+#ifndef OS_WINDOWS
+    /*
+     * Sockets for both the main server and the relay are serviced by one event loop,
+     * on mThread. Other threads wake it up when they queue a broadcast.
+     */
+    EventLoop mEventLoop;
+    std::atomic<UdpNetServer*> mUdpServer;
+
+    void lwsPollFd(libwebsocket_context *context, enum libwebsocket_callback_reasons reason, void *in);
+    static void cbServiceFd(int fd, short revents, void *context);
+
+    /*
+     * Unix domain socket listener. Its clients are always native OPC, and they're read
+     * with the same opcRead() as TCP clients, just without a libwebsocket.
+     */
+    struct UnixClient {
+        TcpNetServer *server;
+        Client client;
+    };
+
+    std::atomic<int> mUnixListener;
+    std::vector<unsigned> mUnixUsers;
+    std::set<UnixClient*> mUnixClients;
+    uint8_t *mUnixReadBuffer;
+    uint64_t mUnixRefused;
 
+    static void cbUnixAccept(int fd, short revents, void *context);
+    static void cbUnixRead(int fd, short revents, void *context);
+    void unixAccept();
+    void unixRead(UnixClient *uc);
+    void unixClose(UnixClient *uc);
+    bool unixPeerAllowed(int fd, unsigned &uid);
+#endif
+
+#ifdef OS_LINUX
+    std::atomic<ShmInput*> mShmInput;
+#endif
+
+    /*
+     * Statistics for /metrics. Only the network thread touches these, and it's also
+     * the thread that serves /metrics, so they need no locking at all.
+     */
+    std::set<Client*> mOPCClients;
+    unsigned mNextClientID;
+    uint64_t mOPCMessages;
+    uint64_t mOPCBytes;
+    uint64_t mParseErrors;
+    uint64_t mRelayMessages;
+    Metrics::Histogram mLoopTime;
+
+    // Relay statistics. On Windows the relay has its own thread, so these are under mRelayMutex.
+    uint64_t mRelaySends;
+    uint64_t mRelayDropped;
+
+    // Receive buffers for OPC messages that span reads. Network thread only.
+    OPCBufferPool mOPCBuffers;
+
+    /*
+     * JSON is serialized once per message, into a SendBuffer shared by every client
+     * it goes to. The scratch buffers are reused so serializing doesn't allocate.
+     */
     typedef rapidjson::GenericStringBuffer<rapidjson::UTF8<> > jsonBuffer_t;
-    std::vector<jsonBuffer_t*> mBroadcastList;
+    jsonBuffer_t mJsonScratch;                  // Network thread only
+    jsonBuffer_t mBroadcastScratch;             // Protected by mBroadcastMutex
+    std::vector<SendBuffer*> mBroadcastList;
     tthread::mutex mBroadcastMutex;
+    uint64_t mBroadcastsCoalesced;              // Network thread only
 
     static HTTPDocument httpDocumentList[];
 
@@ -114,14 +253,31 @@ private:
     // HTTP Server
     int httpBegin(libwebsocket_context *context, libwebsocket *wsi, Client &client, const char *path);
     int httpWrite(libwebsocket_context *context, libwebsocket *wsi, Client &client);
+    int httpMetrics(libwebsocket_context *context, libwebsocket *wsi, Client &client);
     static bool httpPathEqual(const char *a, const char *b);
+    void writeMetrics(Metrics::Writer &writer);
 
     // Open Pixel Control server
     int opcRead(libwebsocket_context *context, libwebsocket *wsi, Client &client, uint8_t *in, size_t len);
+    int opcParse(libwebsocket_context *context, libwebsocket *wsi, Client &client, uint8_t *buffer, size_t bufferLength);
+    size_t opcWanted(Client &client);
+    void opcStream(Client &client);
+    void opcCount(Client &client, const OPC::Message &msg);
+    void clientClosed(Client *client);
+
+    // Flow control
+    bool flowSubscribe(Client &client, const OPC::Message &msg);
+    void flowUpdate(libwebsocket *wsi, Client &client, const OPC::Message &msg);
 
     // WebSockets server
     int wsRead(libwebsocket_context *context, libwebsocket *wsi, Client &client, uint8_t *in, size_t len);
-    void jsonBufferPrepare(jsonBuffer_t &buffer, rapidjson::Value &value);
-    int jsonBufferSend(jsonBuffer_t &buffer, libwebsocket *wsi);
+    SendBuffer *jsonSerialize(jsonBuffer_t &scratch, rapidjson::Value &value, bool coalesce = false);
+    int jsonSend(libwebsocket *wsi, Client &client, SendBuffer *buffer);
+    int jsonWrite(libwebsocket_context *context, libwebsocket *wsi, Client &client);
     void flushBroadcastList();
+
+    // Relay socket
+    void relayRequestWrites(libwebsocket_context *context);
+    int relayWrite(libwebsocket_context *context, RelayClient &client);
+    void relayClosed(RelayClient *client);
 };
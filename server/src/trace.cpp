@@ -0,0 +1,153 @@
+/*
+ * Ring buffer of timestamped events for tracing frames through the pipeline
+ *
+ * Copyright (c) 2013 Micah Elizabeth Scott
+ *
+ * Permission is hereby granted, free of charge, to any person obtaining a copy of
+ * this software and associated documentation files (the "Software"), to deal in
+ * the Software without restriction, including without limitation the rights to
+ * use, copy, modify, merge, publish, distribute, sublicense, and/or sell copies of
+ * the Software, and to permit persons to whom the Software is furnished to do so,
+ * subject to the following conditions:
+ *
+ * The above copyright notice and this permission notice shall be included in all
+ * copies or substantial portions of the Software.
+ *
+ * THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+ * IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY, FITNESS
+ * FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL THE AUTHORS OR
+ * COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER LIABILITY, WHETHER
+ * IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING FROM, OUT OF OR IN
+ * CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN THE SOFTWARE.
+ */
+
+#include "trace.h"
+#ifdef FCSERVER_TRACE
+#include <map>
+#include <algorithm>
+#include <atomic>
+#include "tinythread.h"
+
+namespace Trace {
+
+    // Newest spans kept. Must be a power of two.
+    static const unsigned kRingSize = 1 << 16;
+
+    /*
+     * Each slot has a sequence number, cleared while it's being written and set to the
+     * span's position in the overall stream once it's done. A reader that sees the same
+     * nonzero sequence before and after copying a slot got a consistent span.
+     */
+    struct Span {
+        std::atomic<uint32_t> seq;
+        const char *name;
+        uint64_t start;
+        uint32_t duration;
+        const char *argName;
+        uint32_t arg;
+        unsigned lane;
+    };
+
+    static Span gRing[kRingSize];
+    static std::atomic<uint32_t> gNextSpan(0);
+    static std::atomic<unsigned> gNextLane(LANE_FIRST_DEVICE);
+
+    // Lane names change only when devices come and go
+    static tthread::mutex gLaneMutex;
+    static std::map<unsigned, std::string> gLaneNames;
+
+    void record(const char *name, unsigned lane, uint64_t start, uint64_t duration,
+        const char *argName, uint32_t arg)
+    {
+        uint32_t n = gNextSpan.fetch_add(1, std::memory_order_relaxed);
+        Span &s = gRing[n & (kRingSize - 1)];
+
+        s.seq.store(0, std::memory_order_relaxed);
+        std::atomic_thread_fence(std::memory_order_release);
+
+        s.name = name;
+        s.start = start;
+        s.duration = uint32_t(std::min<uint64_t>(duration, 0xFFFFFFFF));
+        s.argName = argName;
+        s.arg = arg;
+        s.lane = lane;
+
+        s.seq.store(n + 1, std::memory_order_release);
+    }
+
+    unsigned newLane()
+    {
+        return gNextLane.fetch_add(1, std::memory_order_relaxed);
+    }
+
+    void nameLane(unsigned lane, const std::string &name)
+    {
+        tthread::lock_guard<tthread::mutex> lock(gLaneMutex);
+        gLaneNames[lane] = name;
+    }
+
+    static void addMetadata(rapidjson::Value &events, rapidjson::MemoryPoolAllocator<> &alloc,
+        unsigned lane, const char *name)
+    {
+        rapidjson::Value event(rapidjson::kObjectType);
+        rapidjson::Value args(rapidjson::kObjectType);
+        rapidjson::Value laneName(name, alloc);
+        args.AddMember("name", laneName, alloc);
+        event.AddMember("name", "thread_name", alloc);
+        event.AddMember("ph", "M", alloc);
+        event.AddMember("pid", 1, alloc);
+        event.AddMember("tid", lane, alloc);
+        event.AddMember("args", args, alloc);
+        events.PushBack(event, alloc);
+    }
+
+    void dump(rapidjson::Value &events, rapidjson::MemoryPoolAllocator<> &alloc)
+    {
+        events.SetArray();
+
+        addMetadata(events, alloc, LANE_NETWORK, "Network");
+        addMetadata(events, alloc, LANE_USB, "USB");
+        {
+            tthread::lock_guard<tthread::mutex> lock(gLaneMutex);
+            for (std::map<unsigned, std::string>::iterator i = gLaneNames.begin(), e = gLaneNames.end(); i != e; ++i) {
+                addMetadata(events, alloc, i->first, i->second.c_str());
+            }
+        }
+
+        // Oldest first. Spans still being written, or overwritten while we read, are skipped.
+        uint32_t end = gNextSpan.load(std::memory_order_acquire);
+        uint32_t begin = end > kRingSize ? end - kRingSize : 0;
+
+        for (uint32_t n = begin; n != end; ++n) {
+            Span &s = gRing[n & (kRingSize - 1)];
+
+            uint32_t seq = s.seq.load(std::memory_order_acquire);
+            Span copy;
+            copy.name = s.name;
+            copy.start = s.start;
+            copy.duration = s.duration;
+            copy.argName = s.argName;
+            copy.arg = s.arg;
+            copy.lane = s.lane;
+            std::atomic_thread_fence(std::memory_order_acquire);
+            if (seq != n + 1 || s.seq.load(std::memory_order_relaxed) != seq) {
+                continue;
+            }
+
+            rapidjson::Value args(rapidjson::kObjectType);
+            args.AddMember(copy.argName, copy.arg, alloc);
+
+            rapidjson::Value event(rapidjson::kObjectType);
+            event.AddMember("name", copy.name, alloc);
+            event.AddMember("ph", "X", alloc);
+            event.AddMember("ts", copy.start, alloc);
+            event.AddMember("dur", copy.duration, alloc);
+            event.AddMember("pid", 1, alloc);
+            event.AddMember("tid", copy.lane, alloc);
+            event.AddMember("args", args, alloc);
+            events.PushBack(event, alloc);
+        }
+    }
+}
+
+#endif  // FCSERVER_TRACE
@@ -0,0 +1,91 @@
+/*
+ * Ring buffer of timestamped events for tracing frames through the pipeline
+ *
+ * Copyright (c) 2013 Micah Elizabeth Scott
+ *
+ * Permission is hereby granted, free of charge, to any person obtaining a copy of
+ * this software and associated documentation files (the "Software"), to deal in
+ * the Software without restriction, including without limitation the rights to
+ * use, copy, modify, merge, publish, distribute, sublicense, and/or sell copies of
+ * the Software, and to permit persons to whom the Software is furnished to do so,
+ * subject to the following conditions:
+ *
+ * The above copyright notice and this permission notice shall be included in all
+ * copies or substantial portions of the Software.
+ *
+ * THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+ * IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY, FITNESS
+ * FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL THE AUTHORS OR
+ * COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER LIABILITY, WHETHER
+ * IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING FROM, OUT OF OR IN
+ * CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN THE SOFTWARE.
+ */
+
+#pragma once
+#include <stdint.h>
+#include <string>
+#include "metrics.h"
+#include "rapidjson/document.h"
+
+
+/*
+ * Tracing is compiled in only when FCSERVER_TRACE is defined. Without it, the
+ * TRACE_* macros expand to nothing, so ordinary builds pay nothing at all.
+ *
+ * Each pipeline stage records a span (name, start, duration, and one named argument)
+ * into a fixed-size ring, from any thread, without locking. The newest spans can be
+ * dumped as a Chrome trace, for about:tracing or Perfetto.
+ *
+ * Spans are grouped into lanes, which show up as rows in the trace viewer.
+ * Thread-level stages have fixed lanes, and each device gets a lane of its own.
+ */
+
+#ifdef FCSERVER_TRACE
+
+namespace Trace {
+
+    enum Lane {
+        LANE_NETWORK = 1,       // Socket reads and OPC dispatch
+        LANE_USB = 2,           // Main loop
+        LANE_FIRST_DEVICE = 16,
+    };
+
+    // Record a finished span. Safe from any thread. Both strings must outlive the ring, like literals.
+    void record(const char *name, unsigned lane, uint64_t start, uint64_t duration,
+        const char *argName, uint32_t arg);
+
+    // Lanes for devices
+    unsigned newLane();
+    void nameLane(unsigned lane, const std::string &name);
+
+    // Replace 'events' with the ring's contents, as a Chrome trace event array
+    void dump(rapidjson::Value &events, rapidjson::MemoryPoolAllocator<> &alloc);
+
+    // Records a span covering the rest of the enclosing scope
+    class Scope
+    {
+    public:
+        Scope(const char *name, unsigned lane, const char *argName, uint32_t arg)
+            : mName(name), mLane(lane), mArgName(argName), mArg(arg), mStart(Metrics::now()) {}
+        ~Scope() {
+            record(mName, mLane, mStart, Metrics::now() - mStart, mArgName, mArg);
+        }
+
+    private:
+        const char *mName;
+        unsigned mLane;
+        const char *mArgName;
+        uint32_t mArg;
+        uint64_t mStart;
+    };
+}
+
+#define TRACE_SCOPE(name, lane, argName, arg)           Trace::Scope traceScope_(name, lane, argName, arg)
+#define TRACE_SPAN(name, lane, start, argName, arg)     Trace::record(name, lane, start, Metrics::now() - (start), argName, arg)
+
+#else
+
+#define TRACE_SCOPE(name, lane, argName, arg)
+#define TRACE_SPAN(name, lane, start, argName, arg)
+
+#endif
@@ -0,0 +1,432 @@
+/*
+ * Open Pixel Control over UDP
+ *
+ * Copyright (c) 2013 Micah Elizabeth Scott
+ *
+ * Permission is hereby granted, free of charge, to any person obtaining a copy of
+ * this software and associated documentation files (the "Software"), to deal in
+ * the Software without restriction, including without limitation the rights to
+ * use, copy, modify, merge, publish, distribute, sublicense, and/or sell copies of
+ * the Software, and to permit persons to whom the Software is furnished to do so,
+ * subject to the following conditions:
+ *
+ * The above copyright notice and this permission notice shall be included in all
+ * copies or substantial portions of the Software.
+ *
+ * THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+ * IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY, FITNESS
+ * FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL THE AUTHORS OR
+ * COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER LIABILITY, WHETHER
+ * IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING FROM, OUT OF OR IN
+ * CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN THE SOFTWARE.
+ */
+
+#ifndef OS_WINDOWS
+
+#include "udpnetserver.h"
+#include "trace.h"
+#include <iostream>
+#include <stdlib.h>
+#include <string.h>
+#include <stdio.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <unistd.h>
+#include <netdb.h>
+
+
+UdpNetServer::UdpNetServer(OPC::callback_t opcCallback, void *context, bool verbose)
+    : mOpcCallback(opcCallback), mUserContext(context), mVerbose(verbose),
+      mSocket(-1), mBuffers(0),
+      mDatagrams(0), mMessages(0), mDroppedStale(0), mDroppedSuperseded(0),
+      mDroppedIncomplete(0), mDroppedMalformed(0), mDroppedOverflow(0)
+{}
+
+UdpNetServer::~UdpNetServer()
+{
+    for (std::unordered_map<std::string, Sender>::iterator i = mSenders.begin(), e = mSenders.end(); i != e; ++i) {
+        abandonPartial(i->second);
+    }
+    if (mSocket >= 0) {
+        close(mSocket);
+    }
+    free(mBuffers);
+}
+
+bool UdpNetServer::start(EventLoop &loop, const char *host, int port)
+{
+    char service[16];
+    snprintf(service, sizeof service, "%d", port);
+
+    struct addrinfo hints;
+    memset(&hints, 0, sizeof hints);
+    hints.ai_family = AF_UNSPEC;
+    hints.ai_socktype = SOCK_DGRAM;
+    hints.ai_flags = AI_PASSIVE;
+
+    struct addrinfo *addrs;
+    int err = getaddrinfo(host, service, &hints, &addrs);
+    if (err) {
+        std::clog << "UDP listener can't resolve " << (host ? host : "*") << ": " << gai_strerror(err) << "\n";
+        return false;
+    }
+
+    for (struct addrinfo *ai = addrs; ai && mSocket < 0; ai = ai->ai_next) {
+        mSocket = socket(ai->ai_family, ai->ai_socktype, ai->ai_protocol);
+        if (mSocket >= 0 && bind(mSocket, ai->ai_addr, ai->ai_addrlen) < 0) {
+            close(mSocket);
+            mSocket = -1;
+        }
+    }
+    freeaddrinfo(addrs);
+
+    if (mSocket < 0) {
+        std::clog << "UDP listener can't bind to " << (host ? host : "*") << ":" << port << "\n";
+        return false;
+    }
+
+    fcntl(mSocket, F_SETFL, O_NONBLOCK);
+
+    mBuffers = (uint8_t*) malloc(BATCH * DATAGRAM_SIZE);
+    if (!mBuffers) {
+        return false;
+    }
+
+    if (mVerbose) {
+        std::clog << "UDP server listening on " << (host ? host : "*") << ":" << port << "\n";
+    }
+
+    loop.add(mSocket, POLLIN, cbReady, this);
+    return true;
+}
+
+void UdpNetServer::cbReady(int fd, short revents, void *context)
+{
+    UdpNetServer *self = static_cast<UdpNetServer*>(context);
+    self->receive();
+}
+
+unsigned UdpNetServer::receiveBatch()
+{
+    /*
+     * Read as many waiting datagrams as we have room for, with one system call where
+     * there's recvmmsg(). A truncated datagram comes back with length zero, so it's
+     * dropped as malformed.
+     */
+
+#ifdef OS_LINUX
+
+    struct mmsghdr msgs[BATCH];
+    struct iovec iov[BATCH];
+
+    memset(msgs, 0, sizeof msgs);
+    for (unsigned i = 0; i < BATCH; i++) {
+        iov[i].iov_base = mBuffers + i * DATAGRAM_SIZE;
+        iov[i].iov_len = DATAGRAM_SIZE;
+        msgs[i].msg_hdr.msg_name = &mAddresses[i];
+        msgs[i].msg_hdr.msg_namelen = sizeof mAddresses[i];
+        msgs[i].msg_hdr.msg_iov = &iov[i];
+        msgs[i].msg_hdr.msg_iovlen = 1;
+    }
+
+    int count = recvmmsg(mSocket, msgs, BATCH, MSG_DONTWAIT, 0);
+    if (count < 0) {
+        if (errno != EAGAIN && errno != EWOULDBLOCK && errno != EINTR && mVerbose) {
+            std::clog << "Error receiving UDP: " << strerror(errno) << "\n";
+        }
+        return 0;
+    }
+
+    for (int i = 0; i < count; i++) {
+        mLengths[i] = (msgs[i].msg_hdr.msg_flags & MSG_TRUNC) ? 0 : msgs[i].msg_len;
+        mAddressLengths[i] = msgs[i].msg_hdr.msg_namelen;
+    }
+    return count;
+
+#else
+
+    unsigned count = 0;
+    while (count < BATCH) {
+        mAddressLengths[count] = sizeof mAddresses[count];
+        ssize_t r = recvfrom(mSocket, mBuffers + count * DATAGRAM_SIZE, DATAGRAM_SIZE, MSG_DONTWAIT,
+            (struct sockaddr*) &mAddresses[count], &mAddressLengths[count]);
+        if (r < 0) {
+            if (errno != EAGAIN && errno != EWOULDBLOCK && errno != EINTR && mVerbose) {
+                std::clog << "Error receiving UDP: " << strerror(errno) << "\n";
+            }
+            break;
+        }
+        mLengths[count++] = r;
+    }
+    return count;
+
+#endif
+}
+
+void UdpNetServer::receive()
+{
+    unsigned count = receiveBatch();
+    TRACE_SCOPE("udpRead", Trace::LANE_NETWORK, "datagrams", count);
+
+    uint64_t now = Metrics::now();
+    unsigned valid = 0;
+
+    for (unsigned i = 0; i < count; i++) {
+        mDatagrams++;
+        if (parseDatagram(i, now, mBatch[valid])) {
+            valid++;
+        }
+    }
+
+    markSuperseded(valid);
+
+    for (unsigned i = 0; i < valid; i++) {
+        deliver(mBatch[i]);
+    }
+}
+
+UdpNetServer::Sender *UdpNetServer::findSender(unsigned index, uint64_t now, bool &restart)
+{
+    std::string key((const char*) &mAddresses[index], mAddressLengths[index]);
+    std::unordered_map<std::string, Sender>::iterator found = mSenders.find(key);
+
+    if (found == mSenders.end()) {
+        if (mSenders.size() >= MAX_SENDERS) {
+            // Make room by forgetting senders we haven't heard from in a while
+            for (std::unordered_map<std::string, Sender>::iterator i = mSenders.begin(); i != mSenders.end();) {
+                if (now - i->second.lastSeen > SENDER_TIMEOUT) {
+                    abandonPartial(i->second);
+                    i = mSenders.erase(i);
+                } else {
+                    ++i;
+                }
+            }
+            if (mSenders.size() >= MAX_SENDERS) {
+                return 0;
+            }
+        }
+
+        Sender &sender = mSenders[key];
+        memset(&sender, 0, sizeof sender);
+        restart = true;
+        sender.lastSeen = now;
+        return &sender;
+    }
+
+    Sender &sender = found->second;
+    restart = now - sender.lastSeen > SENDER_TIMEOUT;
+    sender.lastSeen = now;
+    return &sender;
+}
+
+bool UdpNetServer::parseDatagram(unsigned index, uint64_t now, Datagram &dg)
+{
+    unsigned length = mLengths[index];
+    uint8_t *data = mBuffers + index * DATAGRAM_SIZE;
+
+    if (length < HEADER_BYTES) {
+        mDroppedMalformed++;
+        return false;
+    }
+
+    dg.sender = findSender(index, now, dg.restart);
+    if (!dg.sender) {
+        mDroppedOverflow++;
+        return false;
+    }
+
+    dg.sequence = (uint32_t(data[0]) << 24) | (uint32_t(data[1]) << 16) | (uint32_t(data[2]) << 8) | data[3];
+    dg.fragmentIndex = data[4];
+    dg.fragmentCount = data[5];
+    dg.fragmentSize = (unsigned(data[6]) << 8) | data[7];
+    dg.payload = data + HEADER_BYTES;
+    dg.payloadLength = length - HEADER_BYTES;
+    dg.superseded = false;
+    return true;
+}
+
+void UdpNetServer::markSuperseded(unsigned count)
+{
+    /*
+     * A Set Pixel Colors message doesn't need to be delivered if the same sender has
+     * a newer one for the same channel later in this batch. Only whole messages count;
+     * fragments are always reassembled in case theirs is the newest.
+     */
+
+    for (unsigned i = 0; i < count; i++) {
+        Datagram &older = mBatch[i];
+        if (older.fragmentCount > 1 || older.payloadLength < OPC::HEADER_BYTES) {
+            continue;
+        }
+        OPC::Message *olderMsg = (OPC::Message*) older.payload;
+        if (olderMsg->command != OPC::SetPixelColors) {
+            continue;
+        }
+
+        for (unsigned j = i + 1; j < count; j++) {
+            Datagram &newer = mBatch[j];
+            if (newer.sender != older.sender || newer.fragmentCount > 1 ||
+                newer.payloadLength < OPC::HEADER_BYTES || int32_t(newer.sequence - older.sequence) <= 0) {
+                continue;
+            }
+            // A malformed message would be dropped by deliver(), so it can't replace anything
+            OPC::Message *newerMsg = (OPC::Message*) newer.payload;
+            if (newerMsg->command == OPC::SetPixelColors && newerMsg->channel == olderMsg->channel &&
+                newer.payloadLength == OPC::HEADER_BYTES + newerMsg->length()) {
+                older.superseded = true;
+                break;
+            }
+        }
+    }
+}
+
+bool UdpNetServer::isNewer(const Sender &sender, const Datagram &dg)
+{
+    // Sequence numbers wrap around. A sender that's been quiet, or jumped far back, is starting over.
+    int32_t diff = int32_t(dg.sequence - sender.sequence);
+    return diff > 0 || diff < -int32_t(RESTART_WINDOW) || dg.restart;
+}
+
+void UdpNetServer::deliver(Datagram &dg)
+{
+    Sender &sender = *dg.sender;
+
+    if (dg.fragmentCount > 1) {
+        reassemble(dg);
+        return;
+    }
+
+    if (!isNewer(sender, dg)) {
+        mDroppedStale++;
+        return;
+    }
+
+    OPC::Message *msg = (OPC::Message*) dg.payload;
+    if (dg.payloadLength < OPC::HEADER_BYTES || dg.payloadLength != OPC::HEADER_BYTES + msg->length()) {
+        mDroppedMalformed++;
+        return;
+    }
+
+    if (sender.partial && int32_t(dg.sequence - sender.partialSequence) > 0) {
+        abandonPartial(sender);
+    }
+
+    if (dg.superseded) {
+        mDroppedSuperseded++;
+        sender.sequence = dg.sequence;
+        return;
+    }
+
+    complete(sender, dg.sequence, *msg);
+}
+
+void UdpNetServer::reassemble(Datagram &dg)
+{
+    Sender &sender = *dg.sender;
+
+    if (!sender.partial || sender.partialSequence != dg.sequence) {
+        if (!isNewer(sender, dg) || (sender.partial && int32_t(dg.sequence - sender.partialSequence) < 0)) {
+            mDroppedStale++;
+            return;
+        }
+
+        // A newer message. Whatever we had is never going to be finished.
+        abandonPartial(sender);
+
+        if (dg.fragmentSize == 0 || (dg.fragmentCount - 1) * dg.fragmentSize >= sizeof(OPC::Message)) {
+            mDroppedMalformed++;
+            return;
+        }
+
+        sender.partial = mReassembly.alloc(std::min<size_t>(dg.fragmentCount * dg.fragmentSize, sizeof(OPC::Message)));
+        if (!sender.partial) {
+            mDroppedMalformed++;
+            return;
+        }
+        sender.partialSequence = dg.sequence;
+        sender.partialSize = dg.fragmentSize;
+        sender.partialLength = 0;
+        sender.fragmentCount = dg.fragmentCount;
+        sender.fragmentsReceived = 0;
+        memset(sender.fragmentMask, 0, sizeof sender.fragmentMask);
+    }
+
+    // Every fragment but the last is exactly the fragment size
+    unsigned index = dg.fragmentIndex;
+    bool last = index == sender.fragmentCount - 1;
+    unsigned offset = index * sender.partialSize;
+
+    if (dg.fragmentCount != sender.fragmentCount || dg.fragmentSize != sender.partialSize ||
+        index >= sender.fragmentCount || dg.payloadLength == 0 ||
+        (last ? dg.payloadLength > sender.partialSize : dg.payloadLength != sender.partialSize) ||
+        offset + dg.payloadLength > sender.partial->capacity()) {
+        mDroppedMalformed++;
+        return;
+    }
+
+    uint64_t bit = uint64_t(1) << (index % 64);
+    if (sender.fragmentMask[index / 64] & bit) {
+        // Duplicate
+        return;
+    }
+    sender.fragmentMask[index / 64] |= bit;
+    sender.fragmentsReceived++;
+
+    memcpy(sender.partial->data() + offset, dg.payload, dg.payloadLength);
+    if (last) {
+        sender.partialLength = offset + dg.payloadLength;
+    }
+
+    if (sender.fragmentsReceived < sender.fragmentCount) {
+        return;
+    }
+
+    OPCBuffer *buffer = sender.partial;
+    OPC::Message *msg = (OPC::Message*) buffer->data();
+    sender.partial = 0;
+
+    if (sender.partialLength < OPC::HEADER_BYTES || sender.partialLength != OPC::HEADER_BYTES + msg->length()) {
+        mDroppedMalformed++;
+    } else {
+        complete(sender, dg.sequence, *msg);
+    }
+
+    mReassembly.release(buffer);
+}
+
+void UdpNetServer::complete(Sender &sender, uint32_t sequence, OPC::Message &msg)
+{
+    sender.sequence = sequence;
+    mMessages++;
+    mOpcCallback(msg, mUserContext);
+}
+
+void UdpNetServer::abandonPartial(Sender &sender)
+{
+    if (sender.partial) {
+        mReassembly.release(sender.partial);
+        sender.partial = 0;
+        mDroppedIncomplete++;
+    }
+}
+
+void UdpNetServer::writeMetrics(Metrics::Writer &writer)
+{
+    writer.family("fcserver_udp_datagrams_total", "counter", "Datagrams received by the UDP listener.");
+    writer.sample("fcserver_udp_datagrams_total", "", mDatagrams);
+
+    writer.family("fcserver_udp_messages_total", "counter", "OPC messages delivered from UDP, after reassembly.");
+    writer.sample("fcserver_udp_messages_total", "", mMessages);
+
+    writer.family("fcserver_udp_dropped_total", "counter", "UDP messages or datagrams dropped, by reason.");
+    writer.sample("fcserver_udp_dropped_total", Metrics::Writer::label("reason", "stale"), mDroppedStale);
+    writer.sample("fcserver_udp_dropped_total", Metrics::Writer::label("reason", "superseded"), mDroppedSuperseded);
+    writer.sample("fcserver_udp_dropped_total", Metrics::Writer::label("reason", "incomplete"), mDroppedIncomplete);
+    writer.sample("fcserver_udp_dropped_total", Metrics::Writer::label("reason", "malformed"), mDroppedMalformed);
+    writer.sample("fcserver_udp_dropped_total", Metrics::Writer::label("reason", "overflow"), mDroppedOverflow);
+
+    writer.family("fcserver_udp_senders", "gauge", "Addresses the UDP listener has heard from recently.");
+    writer.sample("fcserver_udp_senders", "", uint64_t(mSenders.size()));
+}
+
+#endif  // !OS_WINDOWS
@@ -0,0 +1,141 @@
+/*
+ * Open Pixel Control over UDP
+ *
+ * Copyright (c) 2013 Micah Elizabeth Scott
+ *
+ * Permission is hereby granted, free of charge, to any person obtaining a copy of
+ * this software and associated documentation files (the "Software"), to deal in
+ * the Software without restriction, including without limitation the rights to
+ * use, copy, modify, merge, publish, distribute, sublicense, and/or sell copies of
+ * the Software, and to permit persons to whom the Software is furnished to do so,
+ * subject to the following conditions:
+ *
+ * The above copyright notice and this permission notice shall be included in all
+ * copies or substantial portions of the Software.
+ *
+ * THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+ * IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY, FITNESS
+ * FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL THE AUTHORS OR
+ * COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER LIABILITY, WHETHER
+ * IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING FROM, OUT OF OR IN
+ * CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN THE SOFTWARE.
+ */
+
+#pragma once
+#ifndef OS_WINDOWS
+#include <stdint.h>
+#include <string>
+#include <vector>
+#include <unordered_map>
+#include <sys/socket.h>
+#include "eventloop.h"
+#include "metrics.h"
+#include "opcbuffer.h"
+#include "opc.h"
+
+
+/*
+ * Receives OPC messages as UDP datagrams, for clients that would rather lose a frame
+ * than wait for TCP to retransmit it. Each datagram starts with a small header:
+ *
+ *   Bytes 0-3   Sequence number, big-endian. Counts up by one per message, per sender.
+ *   Byte  4     Fragment index, from zero
+ *   Byte  5     Fragment count. Zero or one if the message isn't fragmented.
+ *   Bytes 6-7   Fragment size, big-endian: OPC bytes in every fragment but the last
+ *
+ * then an OPC message, or the fragment of one at index * size.
+ *
+ * Messages are delivered in sequence order only. Anything older than the newest
+ * message we've delivered from that sender is dropped, as is a partly reassembled
+ * message once a newer one starts arriving. When one batch of datagrams holds several
+ * Set Pixel Colors messages for the same channel from the same sender, only the
+ * newest is delivered.
+ *
+ * The socket is serviced by an EventLoop, on the same thread that handles TCP
+ * clients, so messages reach the OPC callback from that one thread. Not available
+ * on Windows.
+ */
+
+class UdpNetServer
+{
+public:
+    UdpNetServer(OPC::callback_t opcCallback, void *context, bool verbose = false);
+    ~UdpNetServer();
+
+    // Bind the socket and start watching it. Call once.
+    bool start(EventLoop &loop, const char *host, int port);
+
+    void writeMetrics(Metrics::Writer &writer);
+
+private:
+    static const unsigned HEADER_BYTES = 8;
+    static const unsigned BATCH = 16;                   // Datagrams per receive call
+    static const unsigned DATAGRAM_SIZE = 65536;        // Larger than any UDP payload
+    static const unsigned MAX_SENDERS = 256;
+    static const unsigned SENDER_TIMEOUT = 1000000;     // Idle microseconds before a sender may start over
+    static const unsigned RESTART_WINDOW = 1024;        // Going back further than this is starting over
+
+    struct Sender {
+        uint32_t sequence;          // Newest message delivered
+        uint64_t lastSeen;
+
+        // Fragmented message being reassembled, if any
+        OPCBuffer *partial;
+        uint32_t partialSequence;
+        unsigned partialSize;       // Bytes per fragment
+        unsigned partialLength;     // Total bytes, once the last fragment is in
+        unsigned fragmentCount;
+        unsigned fragmentsReceived;
+        uint64_t fragmentMask[4];
+    };
+
+    // One received datagram, once its header has been checked
+    struct Datagram {
+        Sender *sender;
+        uint32_t sequence;
+        unsigned fragmentIndex;
+        unsigned fragmentCount;
+        unsigned fragmentSize;
+        uint8_t *payload;
+        unsigned payloadLength;
+        bool restart;               // First from this sender in a while
+        bool superseded;
+    };
+
+    OPC::callback_t mOpcCallback;
+    void *mUserContext;
+    bool mVerbose;
+    int mSocket;
+
+    uint8_t *mBuffers;
+    unsigned mLengths[BATCH];
+    struct sockaddr_storage mAddresses[BATCH];
+    socklen_t mAddressLengths[BATCH];
+    Datagram mBatch[BATCH];
+
+    std::unordered_map<std::string, Sender> mSenders;
+    OPCBufferPool mReassembly;
+
+    // Statistics for /metrics. Network thread only, like the rest.
+    uint64_t mDatagrams;
+    uint64_t mMessages;
+    uint64_t mDroppedStale;         // Older than a message already delivered
+    uint64_t mDroppedSuperseded;    // A newer frame for the same channel came in the same batch
+    uint64_t mDroppedIncomplete;    // Fragmented, and a newer message started before it finished
+    uint64_t mDroppedMalformed;
+    uint64_t mDroppedOverflow;      // From a new sender, with the sender table full
+
+    static void cbReady(int fd, short revents, void *context);
+    unsigned receiveBatch();
+    void receive();
+    Sender *findSender(unsigned index, uint64_t now, bool &restart);
+    bool parseDatagram(unsigned index, uint64_t now, Datagram &dg);
+    void markSuperseded(unsigned count);
+    void deliver(Datagram &dg);
+    void reassemble(Datagram &dg);
+    void complete(Sender &sender, uint32_t sequence, OPC::Message &msg);
+    void abandonPartial(Sender &sender);
+    static bool isNewer(const Sender &sender, const Datagram &dg);
+};
+
+#endif  // !OS_WINDOWS
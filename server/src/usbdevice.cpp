@@ -23,6 +23,7 @@
 
 #include "usbdevice.h"
 #include <iostream>
+#include <algorithm>
 
 
 USBDevice::USBDevice(libusb_device *device, const char *type, bool verbose)
@@ -30,9 +31,18 @@ USBDevice::USBDevice(libusb_device *device, const char *type, bool verbose)
       mHandle(0),
       mTypeString(type),
       mSerialString(0),
-      mVerbose(verbose)
+      mVerbose(verbose),
+      mFrameInterval(0),
+      mLastFrameCompleted(0),
+      mDegraded(false),
+      mNeedsRecovery(false),
+      mStallStreak(0),
+      mHealthyStreak(0)
 {
     gettimeofday(&mTimestamp, NULL);
+#ifdef FCSERVER_TRACE
+    mTraceLane = Trace::newLane();
+#endif
 }
 
 USBDevice::~USBDevice()
@@ -123,4 +133,86 @@ void USBDevice::describe(rapidjson::Value &object, Allocator &alloc)
 
     uint64_t timestamp = (uint64_t)mTimestamp.tv_sec*1000 + mTimestamp.tv_usec/1000;
     object.AddMember("timestamp", timestamp, alloc);
+
+    object.AddMember("frames_superseded", mStats.framesSuperseded.get(), alloc);
+    object.AddMember("health", isDegraded() ? "degraded" : "ok", alloc);
+    object.AddMember("transfers_stalled", mStats.transfersStalled.get(), alloc);
+}
+
+int USBDevice::reset()
+{
+    return libusb_reset_device(mHandle);
+}
+
+void USBDevice::countSubmission(int result)
+{
+    if (result < 0) {
+        mStats.transfersFailed.add();
+    } else {
+        mStats.transfersSubmitted.add();
+    }
+}
+
+void USBDevice::countCompletion(const libusb_transfer *transfer, uint64_t latency)
+{
+    // Cancellation only happens when we're going away, so it isn't an error
+    switch (transfer->status) {
+        case LIBUSB_TRANSFER_COMPLETED:
+            mStats.transfersCompleted.add();
+            mStats.transferLatency.record(latency);
+            mStallStreak = 0;
+            if (isDegraded() && ++mHealthyStreak >= COMPLETIONS_BEFORE_HEALTHY) {
+                mDegraded.store(false, std::memory_order_relaxed);
+                if (mVerbose) {
+                    std::clog << "USB device " << getName() << " recovered.\n";
+                }
+            }
+            break;
+        case LIBUSB_TRANSFER_CANCELLED:
+            break;
+        case LIBUSB_TRANSFER_TIMED_OUT:
+            mStats.transfersFailed.add();
+            mStats.transfersStalled.add();
+            mHealthyStreak = 0;
+            if (!isDegraded()) {
+                mDegraded.store(true, std::memory_order_relaxed);
+                if (mVerbose) {
+                    std::clog << "USB device " << getName() << " stalled, transfer timed out after "
+                              << latency / 1000 << " ms.\n";
+                }
+            }
+            if (++mStallStreak == STALLS_BEFORE_RECOVERY) {
+                mNeedsRecovery.store(true, std::memory_order_relaxed);
+            }
+            break;
+        default:
+            mStats.transfersFailed.add();
+            break;
+    }
+}
+
+void USBDevice::countFrameCompletion(const libusb_transfer *transfer, uint64_t submitTime, uint64_t completeTime)
+{
+    /*
+     * Called on the USB thread for transfers that carry a whole frame, in completion order.
+     * The device only starts on a frame once it's done with the previous one, so the time
+     * it spent on this one runs from whichever came last: submission, or the previous completion.
+     */
+
+    if (transfer->status != LIBUSB_TRANSFER_COMPLETED) {
+        return;
+    }
+
+    uint64_t busy = completeTime - std::max(submitTime, mLastFrameCompleted);
+    mLastFrameCompleted = completeTime;
+    mStats.framesCompleted.add();
+
+    // Exponential moving average, weighting each new frame by 1/8
+    int64_t interval = mFrameInterval.load(std::memory_order_relaxed);
+    if (interval == 0) {
+        interval = busy;
+    } else {
+        interval += (int64_t(busy) - interval) / 8;
+    }
+    mFrameInterval.store(uint32_t(std::min<int64_t>(interval, 0xFFFFFFFF)), std::memory_order_relaxed);
 }
@@ -25,7 +25,11 @@
 
 #include "rapidjson/document.h"
 #include "opc.h"
+#include "pixelmap.h"
+#include "metrics.h"
+#include "trace.h"
 #include <string>
+#include <atomic>
 #include <libusb.h> // Also brings in gettimeofday() in a portable way
 
 
@@ -51,6 +55,17 @@
   #error Dont know whether we need to copy the USB transfer buffer
 #endif
 
+/*
+ * Starting with libusb 1.0.21, Linux can do better than copying: usbfs can allocate
+ * buffers that are mapped into both the kernel and our process, and transfers from
+ * those aren't copied at all. The bundled libusbx is older than that, so this is
+ * only available when building against a newer libusb.
+ */
+
+#if defined(OS_LINUX) && defined(LIBUSB_API_VERSION) && LIBUSB_API_VERSION >= 0x01000105
+  #define HAVE_USB_DEV_MEM 1
+#endif
+
 
 class USBDevice
 {
@@ -74,7 +89,11 @@ public:
     // Load a matching configuration
     virtual void loadConfiguration(const Value &config) = 0;
 
-    // Handle an incoming OPC message
+    /*
+     * Handle an incoming OPC message. Pixel data arrives on the network thread
+     * without mEventMutex held, so it may only touch the device's own frame state;
+     * anything that talks to libusb waits for flush().
+     */
     virtual void writeMessage(const OPC::Message &msg) = 0;
 
     // Handle a device-specific JSON message
@@ -83,7 +102,9 @@ public:
     // Write color LUT from parsed JSON
     virtual void writeColorCorrection(const Value &color);
 
-    // Deal with any I/O that results from completed transfers, outside the context of a completion callback
+    // Deal with any I/O that results from completed transfers, outside the context of a completion callback.
+    // Frames from writeMessage() that are still waiting get submitted here, though a device may also send
+    // the next one straight from a completion callback. Runs on the device's shard thread, with its lock held.
     virtual void flush() = 0;
 
     // Describe this device by adding keys to a JSON object
@@ -95,6 +116,52 @@ public:
     const char *getSerial() { return mSerialString; }
     const char *getTypeString() { return mTypeString; }
 
+    // Compiled OPC mapping, valid after loadConfiguration()
+    const PixelMap &getMap() const { return mMap; }
+
+    /*
+     * Statistics for /metrics. The network thread counts frames and the USB thread
+     * counts transfers, all without locking.
+     */
+    struct Stats {
+        Metrics::Counter framesReceived;        // Pixel messages routed to this device
+        Metrics::Counter framesMapped;          // Frames queued for USB
+        Metrics::Counter framesSuperseded;      // Frames replaced by a newer one before they could be submitted
+        Metrics::Counter framesUnchanged;       // Frames skipped because they matched the last one
+        Metrics::Counter framesCompleted;       // Frames the device finished receiving
+        Metrics::Counter transfersSubmitted;
+        Metrics::Counter transfersCompleted;
+        Metrics::Counter transfersFailed;       // Submission errors, or completed with an error
+        Metrics::Counter transfersStalled;      // Failed because they timed out
+        Metrics::Histogram transferLatency;     // From submission to successful completion
+    };
+
+    const Stats &getStats() const { return mStats; }
+
+    /*
+     * How long the device spends on each frame, in microseconds, as a moving average.
+     * Sending frames any faster than this just gets them superseded. Zero until the
+     * first frame completes. Safe to read from any thread.
+     */
+    uint32_t getFrameInterval() const { return mFrameInterval.load(std::memory_order_relaxed); }
+
+    /*
+     * Health, judged from transfer completions on the USB thread. A device is degraded
+     * from its first timed-out transfer until it completes a run of them normally again.
+     * After several timeouts in a row it needs recovery: the server resets and reopens
+     * it. Safe to read from any thread.
+     */
+    bool isDegraded() const { return mDegraded.load(std::memory_order_relaxed); }
+    bool needsRecovery() const { return mNeedsRecovery.load(std::memory_order_relaxed); }
+
+    // Reset the device at the USB level. Its configuration and any open handles are lost.
+    int reset();
+
+#ifdef FCSERVER_TRACE
+    // Row for this device's spans in a pipeline trace
+    unsigned getTraceLane() const { return mTraceLane; }
+#endif
+
 protected:
     libusb_device *mDevice;
     libusb_device_handle *mHandle;
@@ -102,7 +169,27 @@ protected:
     const char *mTypeString;
     const char *mSerialString;
     bool mVerbose;
+    PixelMap mMap;
+
+    Stats mStats;
+    std::atomic<uint32_t> mFrameInterval;
+    uint64_t mLastFrameCompleted;
+
+    static const unsigned STALLS_BEFORE_RECOVERY = 3;
+    static const unsigned COMPLETIONS_BEFORE_HEALTHY = 100;
+
+    std::atomic<bool> mDegraded;
+    std::atomic<bool> mNeedsRecovery;
+    unsigned mStallStreak;          // Timeouts in a row. USB thread only.
+    unsigned mHealthyStreak;        // Completions since the last timeout, while degraded
+
+#ifdef FCSERVER_TRACE
+    unsigned mTraceLane;
+#endif
 
     // Utilities
     const Value *findConfigMap(const Value &config);
+    void countSubmission(int result);
+    void countCompletion(const libusb_transfer *transfer, uint64_t latency);
+    void countFrameCompletion(const libusb_transfer *transfer, uint64_t submitTime, uint64_t completeTime);
 };
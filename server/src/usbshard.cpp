@@ -0,0 +1,222 @@
+/*
+ * USB service threads, and the devices they own
+ *
+ * Copyright (c) 2013 Micah Elizabeth Scott
+ *
+ * Permission is hereby granted, free of charge, to any person obtaining a copy of
+ * this software and associated documentation files (the "Software"), to deal in
+ * the Software without restriction, including without limitation the rights to
+ * use, copy, modify, merge, publish, distribute, sublicense, and/or sell copies of
+ * the Software, and to permit persons to whom the Software is furnished to do so,
+ * subject to the following conditions:
+ *
+ * The above copyright notice and this permission notice shall be included in all
+ * copies or substantial portions of the Software.
+ *
+ * THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+ * IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY, FITNESS
+ * FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL THE AUTHORS OR
+ * COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER LIABILITY, WHETHER
+ * IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING FROM, OUT OF OR IN
+ * CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN THE SOFTWARE.
+ */
+
+#include "usbshard.h"
+#include <iostream>
+#include <algorithm>
+
+
+USBShard::USBShard(unsigned index, Metrics::Histogram &loopTime,
+    recoveryCallback_t recoveryCallback, void *context)
+    : mIndex(index),
+      mUSB(0),
+      mOwnContext(false),
+      mThread(0),
+      mLoopTime(loopTime),
+      mRecoveryCallback(recoveryCallback),
+      mContext(context)
+{}
+
+bool USBShard::init(libusb_context *usb)
+{
+    if (usb) {
+        mUSB = usb;
+    } else if (libusb_init(&mUSB)) {
+        std::clog << "Error initializing USB library for thread " << mIndex << "\n";
+        return false;
+    } else {
+        mOwnContext = true;
+    }
+
+#ifndef OS_WINDOWS
+    // Watch libusb's file descriptors, including ones it opens later for new devices
+    if (!mEventLoop.init()) {
+        return false;
+    }
+    mUSBEventsReady = false;
+
+    const struct libusb_pollfd **usbFds = libusb_get_pollfds(mUSB);
+    if (usbFds) {
+        for (unsigned i = 0; usbFds[i]; i++) {
+            mEventLoop.add(usbFds[i]->fd, usbFds[i]->events, cbUSBReady, this);
+        }
+        free(usbFds);
+    }
+    libusb_set_pollfd_notifiers(mUSB, cbUSBPollfdAdded, cbUSBPollfdRemoved, this);
+#endif
+
+    return true;
+}
+
+void USBShard::startThread()
+{
+    mThread = new tthread::thread(threadFunc, this);
+}
+
+void USBShard::threadFunc(void *arg)
+{
+    USBShard *self = static_cast<USBShard*>(arg);
+
+    for (;;) {
+        self->flush(self->handleEvents(-1));
+    }
+}
+
+void USBShard::addDevice(USBDevice *dev)
+{
+    mDevices.push_back(dev);
+}
+
+void USBShard::removeDevice(USBDevice *dev)
+{
+    mDevices.erase(std::remove(mDevices.begin(), mDevices.end(), dev), mDevices.end());
+}
+
+libusb_device *USBShard::findDevice(libusb_device *device)
+{
+    if (!mOwnContext) {
+        // Hotplug events come from the context we share with the server
+        return libusb_ref_device(device);
+    }
+
+    libusb_device **list;
+    ssize_t listSize = libusb_get_device_list(mUSB, &list);
+    if (listSize < 0) {
+        std::clog << "Error listing USB devices: " << libusb_strerror(libusb_error(listSize)) << "\n";
+        return 0;
+    }
+
+    uint8_t bus = libusb_get_bus_number(device);
+    uint8_t address = libusb_get_device_address(device);
+    libusb_device *found = 0;
+
+    for (ssize_t i = 0; i < listSize; ++i) {
+        if (libusb_get_bus_number(list[i]) == bus && libusb_get_device_address(list[i]) == address) {
+            found = libusb_ref_device(list[i]);
+            break;
+        }
+    }
+
+    libusb_free_device_list(list, true);
+    return found;
+}
+
+void USBShard::wake()
+{
+#ifndef OS_WINDOWS
+    mEventLoop.wake();
+#endif
+}
+
+#ifndef OS_WINDOWS
+
+void USBShard::cbUSBPollfdAdded(int fd, short events, void *user_data)
+{
+    // May be called on any thread that opens a device
+    USBShard *self = static_cast<USBShard*>(user_data);
+    self->mEventLoop.add(fd, events, cbUSBReady, self);
+}
+
+void USBShard::cbUSBPollfdRemoved(int fd, void *user_data)
+{
+    USBShard *self = static_cast<USBShard*>(user_data);
+    self->mEventLoop.remove(fd);
+}
+
+void USBShard::cbUSBReady(int fd, short revents, void *context)
+{
+    // Let libusb sort out which of its descriptors were ready, once the loop returns
+    USBShard *self = static_cast<USBShard*>(context);
+    self->mUSBEventsReady = true;
+}
+
+#endif
+
+uint64_t USBShard::handleEvents(int timeoutMS)
+{
+    /*
+     * Sleep until libusb has events for us or another thread wakes us, then let libusb
+     * handle whatever is ready. Completion callbacks may submit the next frame right away,
+     * so they run with the lock held, same as flush().
+     */
+
+    struct timeval timeout;
+    timeout.tv_sec = 0;
+    timeout.tv_usec = 0;
+
+#ifdef OS_WINDOWS
+
+    // libusb's file descriptors can't be polled from here, so keep the timeout short
+    // enough that queued frames don't wait long.
+    timeout.tv_usec = 1000;
+    bool usbEvents = true;
+    uint64_t wokeAt = Metrics::now();
+
+#else
+
+    // Sleep for the caller's timeout, unless libusb has a transfer timeout coming up
+    // that it can't watch with a file descriptor.
+    struct timeval next;
+    bool usbTimeout = libusb_get_next_timeout(mUSB, &next) == 1;
+    if (usbTimeout) {
+        int nextMS = next.tv_sec * 1000 + (next.tv_usec + 999) / 1000;
+        timeoutMS = timeoutMS < 0 ? nextMS : std::min<int>(timeoutMS, nextMS);
+    }
+
+    mEventLoop.runOnce(timeoutMS);
+    uint64_t wokeAt = mEventLoop.wokeAt();
+
+    bool usbEvents = mUSBEventsReady || usbTimeout;
+    mUSBEventsReady = false;
+
+#endif
+
+    if (usbEvents) {
+        mMutex.lock();
+        int err = libusb_handle_events_timeout_completed(mUSB, &timeout, 0);
+        mMutex.unlock();
+
+        if (err) {
+            std::clog << "Error handling USB events: " << libusb_strerror(libusb_error(err)) << "\n";
+            // Sometimes this happens on Windows during normal operation if we're queueing a lot of output URBs. Meh.
+        }
+    }
+
+    return wokeAt;
+}
+
+void USBShard::flush(uint64_t wokeAt)
+{
+    // Flush completed transfers, and submit any frames the network thread queued
+    mMutex.lock();
+    for (std::vector<USBDevice*>::iterator i = mDevices.begin(), e = mDevices.end(); i != e; ++i) {
+        USBDevice *dev = *i;
+        dev->flush();
+        if (dev->needsRecovery()) {
+            mRecoveryCallback(dev, mContext);
+        }
+    }
+    mMutex.unlock();
+
+    mLoopTime.record(Metrics::now() - wokeAt);
+}
@@ -0,0 +1,117 @@
+/*
+ * USB service threads, and the devices they own
+ *
+ * Copyright (c) 2013 Micah Elizabeth Scott
+ *
+ * Permission is hereby granted, free of charge, to any person obtaining a copy of
+ * this software and associated documentation files (the "Software"), to deal in
+ * the Software without restriction, including without limitation the rights to
+ * use, copy, modify, merge, publish, distribute, sublicense, and/or sell copies of
+ * the Software, and to permit persons to whom the Software is furnished to do so,
+ * subject to the following conditions:
+ *
+ * The above copyright notice and this permission notice shall be included in all
+ * copies or substantial portions of the Software.
+ *
+ * THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+ * IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY, FITNESS
+ * FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL THE AUTHORS OR
+ * COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER LIABILITY, WHETHER
+ * IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING FROM, OUT OF OR IN
+ * CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN THE SOFTWARE.
+ */
+
+#pragma once
+#include "usbdevice.h"
+#include "eventloop.h"
+#include "metrics.h"
+#include <vector>
+#include <libusb.h>
+#include "tinythread.h"
+
+
+/*
+ * A USB service thread, and the devices it owns.
+ *
+ * Large installations can split their devices across several shards. Each shard has
+ * its own libusb context, event loop, lock, and device list, so completions and
+ * flushes for one shard never wait on another. A device belongs to exactly one
+ * shard, and it's only flushed by that shard's thread.
+ *
+ * Shard 0 uses the server's libusb context, and it runs on the thread that calls
+ * FCServer::mainLoop(). Hotplug events arrive there, and each new device is opened
+ * through whichever shard's context it was assigned to.
+ */
+
+class USBShard
+{
+public:
+    /*
+     * Called from flush() on the shard's thread, with its lock held, when a device
+     * has stalled badly enough to need a reset. It's called again on each flush until
+     * the device is removed, so it should just make a note and wake someone up.
+     */
+    typedef void (*recoveryCallback_t)(USBDevice *dev, void *context);
+
+    USBShard(unsigned index, Metrics::Histogram &loopTime,
+        recoveryCallback_t recoveryCallback, void *context);
+
+    // With a zero context, the shard creates one of its own
+    bool init(libusb_context *usb);
+
+    // Loop forever on a new thread. Shard 0 is run by the main loop instead.
+    void startThread();
+
+    // Sleep until libusb has events or someone wakes us, and handle them.
+    // Returns the time we woke up, for timing the rest of the loop.
+    uint64_t handleEvents(int timeoutMS);
+
+    // Submit queued frames for every device in the shard, and record the loop time
+    void flush(uint64_t wokeAt);
+
+    // From any thread, after queueing work for this shard's devices
+    void wake();
+
+    unsigned getIndex() const { return mIndex; }
+    libusb_context *getContext() const { return mUSB; }
+
+    /*
+     * Held while libusb events are handled and devices are flushed. Other threads take
+     * it before touching a device in this shard. If they also need FCServer's lock,
+     * they take that one first.
+     */
+    tthread::recursive_mutex &getMutex() { return mMutex; }
+
+    // Add or remove with the shard lock held. Reading needs either lock.
+    const std::vector<USBDevice*> &getDevices() const { return mDevices; }
+    void addDevice(USBDevice *dev);
+    void removeDevice(USBDevice *dev);
+
+    /*
+     * libusb devices belong to a context. Find the one in our context that's at the same
+     * bus address as a device from another context. Returns a new reference, or zero.
+     */
+    libusb_device *findDevice(libusb_device *device);
+
+private:
+    unsigned mIndex;
+    libusb_context *mUSB;
+    bool mOwnContext;
+    tthread::recursive_mutex mMutex;
+    tthread::thread *mThread;
+    std::vector<USBDevice*> mDevices;
+    Metrics::Histogram &mLoopTime;
+    recoveryCallback_t mRecoveryCallback;
+    void *mContext;
+
+#ifndef OS_WINDOWS
+    EventLoop mEventLoop;
+    bool mUSBEventsReady;
+
+    static LIBUSB_CALL void cbUSBPollfdAdded(int fd, short events, void *user_data);
+    static LIBUSB_CALL void cbUSBPollfdRemoved(int fd, void *user_data);
+    static void cbUSBReady(int fd, short revents, void *context);
+#endif
+
+    static void threadFunc(void *arg);
+};
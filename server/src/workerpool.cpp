@@ -0,0 +1,135 @@
+/*
+ * Fork-join worker pool
+ *
+ * Copyright (c) 2013 Micah Elizabeth Scott
+ *
+ * Permission is hereby granted, free of charge, to any person obtaining a copy of
+ * this software and associated documentation files (the "Software"), to deal in
+ * the Software without restriction, including without limitation the rights to
+ * use, copy, modify, merge, publish, distribute, sublicense, and/or sell copies of
+ * the Software, and to permit persons to whom the Software is furnished to do so,
+ * subject to the following conditions:
+ *
+ * The above copyright notice and this permission notice shall be included in all
+ * copies or substantial portions of the Software.
+ *
+ * THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+ * IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY, FITNESS
+ * FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL THE AUTHORS OR
+ * COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER LIABILITY, WHETHER
+ * IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING FROM, OUT OF OR IN
+ * CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN THE SOFTWARE.
+ */
+
+#include "workerpool.h"
+
+
+WorkerPool::WorkerPool()
+    : mFunc(0),
+      mContext(0),
+      mCount(0),
+      mGeneration(0),
+      mNumThreads(0),
+      mIdleThreads(0),
+      mQuit(false),
+      mNextItem(0)
+{}
+
+WorkerPool::~WorkerPool()
+{
+    mMutex.lock();
+    mQuit = true;
+    mWorkReady.notify_all();
+    mMutex.unlock();
+
+    for (unsigned i = 0; i < mThreads.size(); i++) {
+        mThreads[i]->join();
+        delete mThreads[i];
+    }
+}
+
+void WorkerPool::start(unsigned numThreads)
+{
+    mMutex.lock();
+    mNumThreads += numThreads;
+    mIdleThreads += numThreads;
+    mMutex.unlock();
+
+    for (unsigned i = 0; i < numThreads; i++) {
+        mThreads.push_back(new tthread::thread(threadFunc, this));
+    }
+}
+
+void WorkerPool::run(Func func, void *context, unsigned count)
+{
+    if (!mNumThreads || count < 2) {
+        for (unsigned i = 0; i < count; i++) {
+            func(context, i);
+        }
+        return;
+    }
+
+    // Hand out the new batch
+    mMutex.lock();
+    mFunc = func;
+    mContext = context;
+    mCount = count;
+    mNextItem.store(0);
+    mIdleThreads = 0;
+    mGeneration++;
+    mWorkReady.notify_all();
+    mMutex.unlock();
+
+    // Pitch in, rather than sitting idle
+    doItems();
+
+    /*
+     * Wait for every helper to check back in, not just for the last item to finish.
+     * That way a slow-to-wake helper can't pick up items from the next batch using
+     * this batch's function.
+     */
+
+    mMutex.lock();
+    while (mIdleThreads < mNumThreads) {
+        mWorkDone.wait(mMutex);
+    }
+    mMutex.unlock();
+}
+
+void WorkerPool::doItems()
+{
+    for (;;) {
+        unsigned i = mNextItem.fetch_add(1);
+        if (i >= mCount) {
+            break;
+        }
+        mFunc(mContext, i);
+    }
+}
+
+void WorkerPool::threadFunc(void *arg)
+{
+    WorkerPool *self = static_cast<WorkerPool*>(arg);
+    unsigned generation = 0;
+
+    self->mMutex.lock();
+    for (;;) {
+        while (!self->mQuit && self->mGeneration == generation) {
+            self->mWorkReady.wait(self->mMutex);
+        }
+        if (self->mQuit) {
+            break;
+        }
+        generation = self->mGeneration;
+
+        // Batch parameters don't change until every helper is idle again
+        self->mMutex.unlock();
+        self->doItems();
+        self->mMutex.lock();
+
+        if (++self->mIdleThreads == self->mNumThreads) {
+            self->mWorkDone.notify_one();
+        }
+    }
+    self->mMutex.unlock();
+}
@@ -0,0 +1,73 @@
+/*
+ * Fork-join worker pool
+ *
+ * Copyright (c) 2013 Micah Elizabeth Scott
+ *
+ * Permission is hereby granted, free of charge, to any person obtaining a copy of
+ * this software and associated documentation files (the "Software"), to deal in
+ * the Software without restriction, including without limitation the rights to
+ * use, copy, modify, merge, publish, distribute, sublicense, and/or sell copies of
+ * the Software, and to permit persons to whom the Software is furnished to do so,
+ * subject to the following conditions:
+ *
+ * The above copyright notice and this permission notice shall be included in all
+ * copies or substantial portions of the Software.
+ *
+ * THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+ * IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY, FITNESS
+ * FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL THE AUTHORS OR
+ * COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER LIABILITY, WHETHER
+ * IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING FROM, OUT OF OR IN
+ * CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN THE SOFTWARE.
+ */
+
+#pragma once
+#include <vector>
+#include <atomic>
+#include "tinythread.h"
+
+
+/*
+ * A small fixed set of threads that split up one batch of independent work items,
+ * alongside the thread that asked for it. run() returns only after every item is
+ * done, so nothing carries over from one batch to the next.
+ *
+ * Only one thread may call run() at a time.
+ */
+
+class WorkerPool
+{
+public:
+    typedef void (*Func)(void *context, unsigned index);
+
+    WorkerPool();
+    ~WorkerPool();
+
+    // Start 'numThreads' helpers. With zero, run() does everything on the calling thread.
+    void start(unsigned numThreads);
+
+    unsigned size() const { return mNumThreads; }
+
+    // Call func(context, i) for every i in [0, count), and wait for all of them.
+    void run(Func func, void *context, unsigned count);
+
+private:
+    std::vector<tthread::thread*> mThreads;
+
+    tthread::mutex mMutex;
+    tthread::condition_variable mWorkReady;
+    tthread::condition_variable mWorkDone;
+
+    // Current batch. Protected by mMutex, except for the item counter.
+    Func mFunc;
+    void *mContext;
+    unsigned mCount;
+    unsigned mGeneration;
+    unsigned mNumThreads;
+    unsigned mIdleThreads;
+    bool mQuit;
+    std::atomic<unsigned> mNextItem;
+
+    static void threadFunc(void *arg);
+    void doItems();
+};